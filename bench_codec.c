@@ -0,0 +1,264 @@
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "decoder.h"
+
+/*
+ * bench_codec - decoder and encoder microbenchmarks
+ *
+ * Every case is run over SLOTS copies of its input per round, so the
+ * input is restored between operations without the copy being timed.
+ * After WARMUP untimed rounds, each round is timed on its own and the
+ * table reports the mean, its spread and the best round, per frame.
+ *
+ *   ./bench_codec [rounds] [name filter]
+ *
+ * Build with `make bench_codec`. Rebuilding with
+ * `make -B bench_codec BENCH_DEFS=-DDECODE_SWAR` (or -DDECODE_SCALAR)
+ * measures the portable scanners instead.
+ */
+
+#define SLOTS 256
+#define SLOT_LEN 2048
+#define WARMUP 20
+#define DEFAULT_ROUNDS 200
+
+typedef enum {
+  OP_DECODE,       // decode_message() once
+  OP_DECODE_ALL,   // decode_message() until the buffer is used up
+  OP_DECODE_BATCH, // decode_messages() until the buffer is used up
+  OP_DECODE_VIEW,  // decode_view() once
+  OP_DRIP_RESCAN,  // decode_message() on every prefix, a byte at a time
+  OP_DRIP_RESUME,  // the same through a Decoder
+  OP_ENCODE_MESSAGE,
+  OP_ENCODE_FAIL,
+  OP_ENCODE_PLAY,
+} Op;
+
+typedef struct {
+  const char *name;
+  Op op;
+  const char *input; // frames to decode, or a field for the encoders
+  int repeat;        // the input is laid out this many times back to back
+  char *type;        // for encode_message()
+} Case;
+
+static char slots[SLOTS][SLOT_LEN];
+static char corpus[SLOT_LEN];
+static int corpus_len;
+
+static char name72[73];
+static char open72[FRAME_MAX];
+
+// summed into so the results cannot be optimised away
+static volatile long sink;
+
+static const Case CASES[] = {
+    {"decode WAIT", OP_DECODE, "0|05|WAIT|", 1},
+    {"decode OPEN", OP_DECODE, "0|11|OPEN|Alice|", 1},
+    {"decode OPEN 72", OP_DECODE, open72, 1},
+    {"decode NAME", OP_DECODE, "0|13|NAME|1|Alice|", 1},
+    {"decode PLAY", OP_DECODE, "0|17|PLAY|1|1 3 5 7 9|", 1},
+    {"decode PLAY clocks", OP_DECODE, "0|29|PLAY|2|1 3 5 7 9|59500 60000|",
+     1},
+    {"decode MOVE", OP_DECODE, "0|09|MOVE|2|3|", 1},
+    {"decode OVER", OP_DECODE, "0|25|OVER|2|0 0 0 0 0|Forfeit|", 1},
+    {"decode FAIL", OP_DECODE, "0|16|FAIL|10 Invalid|", 1},
+    {"decode partial", OP_DECODE, "0|78|OPEN|AAAAAAAAAAAAAAAAAAAAAAAAAA", 1},
+    {"decode bad type", OP_DECODE, "0|09|MOVX|2|3|", 1},
+    {"decode extra field", OP_DECODE, "0|11|MOVE|2|3|4|", 1},
+    {"decode 64 MOVE", OP_DECODE_ALL, "0|09|MOVE|2|3|", 64},
+    {"batch 64 MOVE", OP_DECODE_BATCH, "0|09|MOVE|2|3|", 64},
+    {"view MOVE", OP_DECODE_VIEW, "0|09|MOVE|2|3|", 1},
+    {"view PLAY clocks", OP_DECODE_VIEW,
+     "0|29|PLAY|2|1 3 5 7 9|59500 60000|", 1},
+    {"drip rescan OPEN 72", OP_DRIP_RESCAN, open72, 1},
+    {"drip resume OPEN 72", OP_DRIP_RESUME, open72, 1},
+    {"encode_message PLAY", OP_ENCODE_MESSAGE, "1 3 5 7 9", 1, "PLAY"},
+    {"encode_message NAME", OP_ENCODE_MESSAGE, name72, 1, "NAME"},
+    {"encode_fail", OP_ENCODE_FAIL, NULL, 1},
+    {"encode_play clocks", OP_ENCODE_PLAY, NULL, 1},
+};
+
+static void build_corpora(void) {
+  memset(name72, 'N', 72);
+  name72[72] = '\0';
+  snprintf(open72, sizeof(open72), "0|78|OPEN|%s|", name72);
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long long cycles(void) {
+#ifdef HAVE_RDTSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// lays the case's input out once, returns frames per operation
+static int prepare(const Case *c) {
+  corpus_len = 0;
+  if (c->input != NULL) {
+    int len = strlen(c->input);
+    for (int i = 0; i < c->repeat && corpus_len + len < SLOT_LEN; i++) {
+      memcpy(corpus + corpus_len, c->input, len);
+      corpus_len += len;
+    }
+  }
+  return c->repeat;
+}
+
+// restores every slot the decoders may have written to
+static void refill(const Case *c) {
+  if (c->op >= OP_ENCODE_MESSAGE) {
+    return;
+  }
+  for (int i = 0; i < SLOTS; i++) {
+    memcpy(slots[i], corpus, corpus_len);
+  }
+}
+
+// one operation on @buf, returns something to sum into sink
+static long run_one(const Case *c, char *buf) {
+  static const int piles[5] = {1, 3, 5, 7, 9};
+  static const int clocks[2] = {59500, 60000};
+  Message msg;
+  MessageView view;
+  long sum = 0;
+
+  switch (c->op) {
+  case OP_DECODE:
+    return decode_message(buf, corpus_len, &msg);
+  case OP_DECODE_ALL:
+    for (int at = 0; at < corpus_len;) {
+      int n = decode_message(buf + at, corpus_len - at, &msg);
+      if (n <= 0) {
+        break;
+      }
+      at += n;
+      sum += msg.kind;
+    }
+    return sum;
+  case OP_DECODE_BATCH:
+    for (int at = 0; at < corpus_len;) {
+      FrameDesc frames[16];
+      int consumed;
+      int n = decode_messages(buf + at, corpus_len - at, frames, 16,
+                              &consumed);
+      if (n == 0 || consumed == 0) {
+        break;
+      }
+      for (int i = 0; i < n; i++) {
+        frame_view(buf + at + frames[i].at, &frames[i], &view);
+        sum += view.move.pile;
+      }
+      at += consumed;
+    }
+    return sum;
+  case OP_DECODE_VIEW:
+    return decode_view(NULL, buf, corpus_len, &view) + view.move.count;
+  case OP_DRIP_RESCAN:
+    for (int have = 1; have <= corpus_len; have++) {
+      sum += decode_message(buf, have, &msg);
+    }
+    return sum;
+  case OP_DRIP_RESUME: {
+    Decoder st = {0};
+    for (int have = 1; have <= corpus_len; have++) {
+      sum += decode_view(&st, buf, have, &view);
+    }
+    return sum;
+  }
+  case OP_ENCODE_MESSAGE:
+    return encode_message(buf, SLOT_LEN, c->type, "1", c->input);
+  case OP_ENCODE_FAIL:
+    return encode_fail(buf, SLOT_LEN, ERR_IMPATIENT);
+  case OP_ENCODE_PLAY:
+    return encode_play(buf, SLOT_LEN, 2, piles, clocks);
+  }
+  return 0;
+}
+
+static void bench(const Case *c, int rounds) {
+  int frames = prepare(c);
+  double *ns = malloc(rounds * sizeof(double));
+  unsigned long long total_cycles = 0;
+
+  for (int r = -WARMUP; r < rounds; r++) {
+    refill(c);
+    double start = now_ns();
+    unsigned long long c0 = cycles();
+    for (int i = 0; i < SLOTS; i++) {
+      sink += run_one(c, slots[i]);
+    }
+    unsigned long long c1 = cycles();
+    double took = now_ns() - start;
+    if (r >= 0) {
+      ns[r] = took / ((double)SLOTS * frames);
+      total_cycles += c1 - c0;
+    }
+  }
+
+  double mean = 0;
+  double best = ns[0];
+  for (int r = 0; r < rounds; r++) {
+    mean += ns[r];
+    if (ns[r] < best) {
+      best = ns[r];
+    }
+  }
+  mean /= rounds;
+  double var = 0;
+  for (int r = 0; r < rounds; r++) {
+    var += (ns[r] - mean) * (ns[r] - mean);
+  }
+  double spread = rounds > 1 ? sqrt(var / (rounds - 1)) / mean * 100 : 0;
+
+  printf("%-22s %9.1f %6.1f%% %9.1f %10.2f", c->name, mean, spread, best,
+         1e3 / mean);
+#ifdef HAVE_RDTSC
+  printf(" %9.1f", (double)total_cycles / ((double)rounds * SLOTS * frames));
+#else
+  printf(" %9s", "n/a");
+#endif
+  printf("\n");
+  free(ns);
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUNDS;
+  const char *filter = argc > 2 ? argv[2] : NULL;
+  if (rounds <= 0) {
+    fprintf(stderr, "usage: %s [rounds] [name filter]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  build_corpora();
+
+  printf("==============================================\n");
+  printf("   NGP Codec Benchmarks (%s scanner)\n", decode_scan_path());
+  printf("==============================================\n");
+  printf("%d rounds of %d operations after %d warm-up rounds\n\n", rounds,
+         SLOTS, WARMUP);
+  printf("%-22s %9s %7s %9s %10s %9s\n", "case", "ns/frame", "+-", "best",
+         "Mframes/s", "cycles");
+
+  for (size_t i = 0; i < sizeof(CASES) / sizeof(CASES[0]); i++) {
+    if (filter == NULL || strstr(CASES[i].name, filter) != NULL) {
+      bench(&CASES[i], rounds);
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -1,9 +1,24 @@
 #include "decoder.h"
 #include <ctype.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+/*
+ * Frame scanning runs on SSE2 where the compiler targets it, 16 bytes per
+ * compare, otherwise on 8 bytes at a time in a plain 64-bit word (SWAR).
+ * Build with -DDECODE_SWAR or -DDECODE_SCALAR to force the portable paths;
+ * every path gives the same result.
+ */
+#if defined(__SSE2__) && !defined(DECODE_SWAR) && !defined(DECODE_SCALAR)
+#define SCAN_SSE2
+#include <emmintrin.h>
+#elif !defined(DECODE_SCALAR)
+#define SCAN_SWAR
+#endif
+
 // NGP constants
 #define MAX_NAME_LEN 72
 #define MAX_MSG_LEN 104
@@ -19,122 +34,575 @@
 #define TYPE_OVER "OVER"
 #define TYPE_FAIL "FAIL"
 
-// as per section 3.2
-static int expected_fields(const char *type) {
-  if (strcmp(type, TYPE_OPEN) == 0)
-    return 1;
-  if (strcmp(type, TYPE_WAIT) == 0)
-    return 0;
-  if (strcmp(type, TYPE_NAME) == 0)
-    return 2;
-  if (strcmp(type, TYPE_PLAY) == 0)
-    return 2;
-  if (strcmp(type, TYPE_MOVE) == 0)
-    return 2;
-  if (strcmp(type, TYPE_OVER) == 0)
-    return 3;
-  if (strcmp(type, TYPE_FAIL) == 0)
-    return 1;
+// the four type bytes as one little-endian word
+#define TYPE_WORD(a, b, c, d)                                                  \
+  ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 |                  \
+   (uint32_t)(d) << 24)
 
-  return -1;
+static uint32_t load_type(const char *p) {
+  const unsigned char *u = (const unsigned char *)p;
+  // compilers turn this into a single 32-bit load
+  return (uint32_t)u[0] | (uint32_t)u[1] << 8 | (uint32_t)u[2] << 16 |
+         (uint32_t)u[3] << 24;
+}
+
+// MSG_* for the type at @p, -1 if there is no such type
+static int type_of(const char *p) {
+  switch (load_type(p)) {
+  case TYPE_WORD('O', 'P', 'E', 'N'):
+    return MSG_OPEN;
+  case TYPE_WORD('W', 'A', 'I', 'T'):
+    return MSG_WAIT;
+  case TYPE_WORD('N', 'A', 'M', 'E'):
+    return MSG_NAME;
+  case TYPE_WORD('P', 'L', 'A', 'Y'):
+    return MSG_PLAY;
+  case TYPE_WORD('M', 'O', 'V', 'E'):
+    return MSG_MOVE;
+  case TYPE_WORD('O', 'V', 'E', 'R'):
+    return MSG_OVER;
+  case TYPE_WORD('F', 'A', 'I', 'L'):
+    return MSG_FAIL;
+  default:
+    return -1;
+  }
+}
+
+#define ONES 0x0101010101010101ull
+#define HIGHS 0x8080808080808080ull
+
+// 8 bytes as a little-endian word, so byte i is bits 8i..8i+7
+static inline uint64_t load64(const char *p) {
+  uint64_t w;
+  memcpy(&w, p, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  w = __builtin_bswap64(w);
+#endif
+  return w;
 }
 
-// finds first '|' character in buffer
-static char *find_delimiter(char *buf, int len) {
+// high bit set in each byte of @w that is not an ASCII digit
+static inline uint64_t non_digits64(uint64_t w) {
+  uint64_t x = w ^ (ONES * '0'); // digits become 0..9
+  return (((x & ~HIGHS) + ONES * (0x80 - 10)) | x) & HIGHS;
+}
+
+// high bit set in each byte of @w that is '|', exact (no false positives)
+static inline uint64_t bars64(uint64_t w) {
+  uint64_t x = w ^ (ONES * '|'); // bars become 0
+  return ~(((x & ~HIGHS) + ~HIGHS) | x) & HIGHS;
+}
+
+/* checks and parses the @len digits at @p in the same pass. @out is -1 if
+ * there are none or they add up past INT_MAX. Returns 0, or -1 if a byte
+ * is not a digit. */
+static int parse_number(const char *p, int len, int *out) {
+  int value = len > 0 ? 0 : -1;
   for (int i = 0; i < len; i++) {
-    if (buf[i] == '|') {
-      return &buf[i];
+    unsigned digit = (unsigned char)p[i] - '0';
+    if (digit > 9) {
+      return -1;
+    }
+    if (value >= 0) {
+      value = value > (INT_MAX - (int)digit) / 10 ? -1 : value * 10 + digit;
     }
   }
-  return NULL;
+  *out = value;
+  return 0;
 }
 
-// expects a pointer to the buffer, the length of the buffer,
-// and a pointer to a message struct.
-// returns the number of bytes of the message if successful
-// -1 if there was an error or 0 if incomplete
-int decode_message(char *buf, int len, Message *msg) {
-  memset(msg, 0, sizeof(Message));
+// offset of the first field in a frame, where delimiter bit 0 is
+#define FIELDS_AT 10
 
-  if (len < 5)
-    return 0;
+// ors the mask @m of bytes starting at frame byte @at into @bits
+static inline void add_bits(uint64_t bits[2], int at, uint64_t m) {
+  at -= FIELDS_AT;
+  bits[at / 64] |= m << (at % 64);
+  // a mask can straddle the two words, it is never wider than 16 bits
+  if (at < 64 && at % 64 > 48) {
+    bits[1] |= m >> (64 - at);
+  }
+}
 
-  if (buf[0] == '0' && buf[1] == '|') {
-    msg->version = 0;
-  } else {
-    msg->error_code = ERR_INVALID;
+// sets the bit for each '|' flagged in the SWAR mask @m of bytes at @at
+static inline void add_bars64(uint64_t bits[2], int at, uint64_t m) {
+  while (m != 0) {
+    add_bits(bits, at + __builtin_ctzll(m) / 8, 1);
+    m &= m - 1;
+  }
+}
+
+/* adds a bit to @bits for every '|' at frame[i], @start <= i < @end, bit 0
+ * being frame[FIELDS_AT]. The whole frame before @end is readable and is
+ * at most 104 bytes, so the tail is read with one load that ends at @end
+ * and overlaps bytes already scanned, instead of byte by byte. */
+static void scan_delimiters(const char *frame, int start, int end,
+                            uint64_t bits[2]) {
+  int i = start;
+#if defined(SCAN_SSE2)
+  const __m128i bar = _mm_set1_epi8('|');
+  for (; i + 16 <= end; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(frame + i));
+    add_bits(bits, i, (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, bar)));
+  }
+  if (i < end && end >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(frame + end - 16));
+    unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, bar));
+    add_bits(bits, i, m >> (16 - (end - i)));
+    i = end;
+  }
+#endif
+#if defined(SCAN_SSE2) || defined(SCAN_SWAR)
+  for (; i + 8 <= end; i += 8) {
+    add_bars64(bits, i, bars64(load64(frame + i)));
+  }
+  if (i < end) {
+    uint64_t m = bars64(load64(frame + end - 8));
+    add_bars64(bits, i, m >> 8 * (8 - (end - i)));
+  }
+#else
+  for (; i < end; i++) {
+    if (frame[i] == '|') {
+      add_bits(bits, i, 1);
+    }
+  }
+#endif
+}
+
+// takes the lowest set bit out of @bits, returns its offset or -1
+static inline int next_delimiter(uint64_t bits[2]) {
+  if (bits[0] != 0) {
+    int i = __builtin_ctzll(bits[0]);
+    bits[0] &= bits[0] - 1;
+    return i;
+  }
+  if (bits[1] != 0) {
+    int i = 64 + __builtin_ctzll(bits[1]);
+    bits[1] &= bits[1] - 1;
+    return i;
+  }
+  return -1;
+}
+
+/* checks the "0|LL|" header at @buf, which must hold 5 bytes.
+ * Returns LL, or -1 if the header is malformed. */
+static int decode_header(const char *buf) {
+#if defined(SCAN_SSE2) || defined(SCAN_SWAR)
+  // fixed bytes 0 and 1 in one masked compare, digits 2 and 3 together
+  uint32_t w;
+  memcpy(&w, buf, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  w = __builtin_bswap32(w);
+#endif
+  if ((w & 0xffff) != ('|' << 8 | '0') || buf[4] != '|' ||
+      (non_digits64(w) & 0x80800000u) != 0) {
+    return -1;
+  }
+  return ((w >> 16 & 0xff) - '0') * 10 + ((w >> 24) - '0');
+#else
+  if (buf[0] != '0' || buf[1] != '|' || !isdigit((unsigned char)buf[2]) ||
+      !isdigit((unsigned char)buf[3]) || buf[4] != '|') {
     return -1;
   }
+  return (buf[2] - '0') * 10 + (buf[3] - '0');
+#endif
+}
 
-  if (isdigit(buf[2]) && isdigit(buf[3]) && buf[4] == '|') {
-    int msg_length = (buf[2] - '0') * 10 + (buf[3] - '0');
-    if (msg_length >= 5 && msg_length <= 99) {
-      msg->length = msg_length;
-    } else {
-      msg->error_code = ERR_INVALID;
-      return -1;
+const char *decode_scan_path(void) {
+#if defined(SCAN_SSE2)
+  return "sse2";
+#elif defined(SCAN_SWAR)
+  return "swar";
+#else
+  return "scalar";
+#endif
+}
+
+static int check_open(const char *frame, FrameDesc *d) {
+  return d->field_len[0] > MAX_NAME_LEN ? ERR_LONG_NAME : ERR_NONE;
+}
+
+/* pile and count are read as they are checked. An empty one is 0, as
+ * atoi() made it before the decoder parsed them */
+static int check_move(const char *frame, FrameDesc *d) {
+  for (int i = 0; i < 2; i++) {
+    if (parse_number(frame + d->field_at[i], d->field_len[i], &d->move[i]) <
+        0) {
+      return ERR_INVALID;
     }
-  } else {
-    msg->error_code = ERR_INVALID;
+    if (d->field_len[i] == 0) {
+      d->move[i] = 0;
+    }
+  }
+  return ERR_NONE;
+}
+
+// what each type carries, as per section 3.2
+typedef struct {
+  char name[MSG_TYPE_LEN + 1];
+  int fields;
+  int optional; // extra trailing fields that may follow
+  // ERR_* for a well-framed frame, or NULL
+  int (*check)(const char *frame, FrameDesc *d);
+} TypeDesc;
+
+static const TypeDesc TYPES[MSG_TYPES] = {
+    [MSG_OPEN] = {TYPE_OPEN, 1, 0, check_open},
+    [MSG_WAIT] = {TYPE_WAIT, 0, 0, NULL},
+    [MSG_NAME] = {TYPE_NAME, 2, 0, NULL},
+    // a clocked game's PLAY carries the time left as an extra field
+    [MSG_PLAY] = {TYPE_PLAY, 2, 1, NULL},
+    [MSG_MOVE] = {TYPE_MOVE, 2, 0, check_move},
+    [MSG_OVER] = {TYPE_OVER, 3, 0, NULL},
+    [MSG_FAIL] = {TYPE_FAIL, 1, 0, NULL},
+};
+
+static int expected_fields(const char *type) {
+  if (strlen(type) != MSG_TYPE_LEN) {
     return -1;
   }
+  int kind = type_of(type);
+  return kind < 0 ? -1 : TYPES[kind].fields;
+}
+
+void decoder_reset(Decoder *st) { memset(st, 0, sizeof(*st)); }
 
-  if (msg->length + 5 > len) {
+static int scan_fail(Decoder *st, FrameDesc *d, int error_code) {
+  decoder_reset(st);
+  d->error_code = error_code;
+  return -1;
+}
+
+/* validates the frame at the start of @buf and records where its fields
+ * are, without writing to @buf. Whatever @st says was checked already is
+ * not looked at again, and while the frame is incomplete @st remembers
+ * how far it got; it is reset once the frame is complete or invalid.
+ * A bad header, type or too many fields are caught as soon as they
+ * arrive. Returns the frame size, 0 if incomplete, -1 with
+ * @d->error_code set. */
+static int scan_frame(Decoder *st, const char *buf, int len, FrameDesc *d) {
+  d->size = st->size;
+  d->kind = -1;
+  d->error_code = ERR_NONE;
+  d->field_count = 0;
+
+  if (st->scanned < 5) {
+    if (len < 5) {
+      return 0;
+    }
+    int length = decode_header(buf);
+    if (length < 5) {
+      return scan_fail(st, d, ERR_INVALID);
+    }
+    st->size = 5 + length;
+    st->scanned = 5;
+    d->size = st->size;
+  }
+
+  if (st->scanned < FIELDS_AT) {
+    if (len < 5 + MSG_TYPE_LEN) {
+      return 0;
+    }
+    if (st->scanned < 5 + MSG_TYPE_LEN) {
+      st->kind = type_of(buf + 5);
+      if (st->kind < 0) {
+        return scan_fail(st, d, ERR_INVALID);
+      }
+      st->scanned = 5 + MSG_TYPE_LEN;
+    }
+    // the type's own delimiter
+    if (len < FIELDS_AT) {
+      return 0;
+    }
+    if (buf[FIELDS_AT - 1] != '|') {
+      return scan_fail(st, d, ERR_INVALID);
+    }
+    st->scanned = FIELDS_AT;
+  }
+  const TypeDesc *desc = &TYPES[st->kind];
+  d->kind = st->kind;
+
+  int end = len < st->size ? len : st->size;
+  if (end > st->scanned) {
+    scan_delimiters(buf, st->scanned, end, st->bits);
+    st->scanned = end;
+    int bars = __builtin_popcountll(st->bits[0]) +
+               __builtin_popcountll(st->bits[1]);
+    if (bars > desc->fields + desc->optional) {
+      return scan_fail(st, d, ERR_INVALID);
+    }
+  }
+  if (st->size > len) {
     return 0;
   }
 
-  memcpy(msg->type, buf + 5, 4);
-  msg->type[4] = '\0';
+  // walk the delimiters
+  uint64_t bits[2] = {st->bits[0], st->bits[1]};
+  decoder_reset(st);
+  int span = d->size - FIELDS_AT;
+  int at = 0;
+  for (int i = 0; i < desc->fields + desc->optional; i++) {
+    if (i >= desc->fields && at >= span) {
+      break;
+    }
+    int delim = next_delimiter(bits);
+    if (delim < 0) {
+      d->error_code = ERR_INVALID;
+      return -1;
+    }
 
-  int fc = expected_fields(msg->type);
-  if (fc == -1) {
-    msg->error_code = ERR_INVALID;
+    d->field_at[i] = FIELDS_AT + at;
+    d->field_len[i] = delim - at;
+    d->field_count++;
+    at = delim + 1;
+  }
+
+  if (at != span) {
+    d->error_code = ERR_INVALID;
     return -1;
   }
-  msg->field_count = fc;
 
-  char *p = buf + 10;
-  int remaining = msg->length - 5;
+  if (desc->check != NULL) {
+    d->error_code = desc->check(buf, d);
+    if (d->error_code != ERR_NONE) {
+      return -1;
+    }
+  }
 
-  for (int i = 0; i < msg->field_count; i++) {
-    msg->fields[i] = p;
+  return d->size;
+}
 
-    char *delim = find_delimiter(p, remaining);
-    if (delim == NULL) {
-      msg->error_code = ERR_INVALID;
-      return -1;
+void frame_message(char *frame, const FrameDesc *d, Message *msg) {
+  msg->version = 0;
+  msg->length = d->size - 5;
+  msg->kind = d->kind;
+  memcpy(msg->type, TYPES[d->kind].name, sizeof(msg->type));
+  msg->field_count = d->field_count;
+  msg->error_code = d->error_code;
+  for (int i = 0; i < 3; i++) {
+    if (i < d->field_count) {
+      char *field = frame + d->field_at[i];
+      field[d->field_len[i]] = '\0';
+      msg->fields[i] = field;
+      msg->field_len[i] = d->field_len[i];
+    } else {
+      msg->fields[i] = NULL;
+      msg->field_len[i] = 0;
     }
+  }
+}
 
-    *delim = '\0';
-    remaining -= (delim - p + 1);
-    p = delim + 1;
+int decode_next(Decoder *st, char *buf, int len, Message *msg) {
+  FrameDesc d;
+  int n = scan_frame(st, buf, len, &d);
+  if (n > 0) {
+    frame_message(buf, &d, msg);
+    return n;
   }
 
-  if (p != buf + 5 + msg->length) {
-    msg->error_code = ERR_INVALID;
+  memset(msg, 0, sizeof(Message));
+  msg->length = d.size > 0 ? d.size - 5 : 0;
+  msg->error_code = d.error_code;
+  return n;
+}
+
+// expects a pointer to the buffer, the length of the buffer,
+// and a pointer to a message struct.
+// returns the number of bytes of the message if successful
+// -1 if there was an error or 0 if incomplete
+int decode_message(char *buf, int len, Message *msg) {
+  Decoder st = {0};
+  return decode_next(&st, buf, len, msg);
+}
+
+int decode_stream(Decoder *st, const char *buf, int len, FrameDesc *frames,
+                  int max, int *consumed) {
+  int count = 0;
+  int at = 0;
+  while (count < max) {
+    // only the frame at the start of @buf is remembered, the one @st
+    // describes; the frames after it start from nothing
+    Decoder fresh = {0};
+    FrameDesc *d = &frames[count];
+    int n = scan_frame(count == 0 ? st : &fresh, buf + at, len - at, d);
+    if (n == 0) {
+      break;
+    }
+    d->at = at;
+    count++;
+    if (n < 0) {
+      // nothing after a bad frame can be framed
+      break;
+    }
+    at += n;
+  }
+  *consumed = at;
+  return count;
+}
+
+int decode_messages(const char *buf, int len, FrameDesc *frames, int max,
+                    int *consumed) {
+  Decoder st = {0};
+  return decode_stream(&st, buf, len, frames, max, consumed);
+}
+
+int view_eq(View v, const char *s) {
+  return (int)strlen(s) == v.len && memcmp(v.data, s, v.len) == 0;
+}
+
+int view_int(View v, int *out) {
+  int value;
+  if (parse_number(v.data, v.len, &value) < 0 || value < 0) {
     return -1;
   }
+  *out = value;
+  return 0;
+}
 
-  if (strcmp(msg->type, TYPE_OPEN) == 0) {
-    if (strlen(msg->fields[0]) > MAX_NAME_LEN) {
-      msg->error_code = ERR_LONG_NAME;
+// parses @v as exactly @n numbers separated by single spaces
+static int parse_list(View v, int *out, int n) {
+  const char *p = v.data;
+  const char *end = v.data + v.len;
+  for (int i = 0; i < n; i++) {
+    const char *q = memchr(p, ' ', end - p);
+    if (q == NULL) {
+      q = end;
+    }
+    if (parse_number(p, q - p, &out[i]) < 0 || out[i] < 0) {
+      return -1;
+    }
+    if ((q == end) != (i == n - 1)) {
       return -1;
     }
+    p = q + 1;
   }
+  return 0;
+}
 
-  if (strcmp(msg->type, TYPE_MOVE) == 0) {
-    for (int i = 0; i < msg->field_count; i++) {
-      char *field = msg->fields[i];
-      for (int j = 0; field[j] != '\0'; j++) {
-        if (!isdigit(field[j])) {
-          msg->error_code = ERR_INVALID;
-          return -1;
-        }
-      }
+static void parse_board(MessageView *msg) {
+  Board *b = &msg->board;
+  int ok = view_int(msg->fields[0], &b->player) == 0 &&
+           parse_list(msg->fields[1], b->piles, 5) == 0;
+  if (msg->kind == MSG_PLAY && msg->field_count == 3) {
+    b->clocked = 1;
+    ok = ok && parse_list(msg->fields[2], b->clocks, 2) == 0;
+  }
+  if (msg->kind == MSG_OVER) {
+    b->forfeit = view_eq(msg->fields[2], "Forfeit");
+  }
+  b->valid = ok;
+}
+
+void frame_view(const char *frame, const FrameDesc *d, MessageView *msg) {
+  msg->kind = d->kind;
+  msg->length = d->size - 5;
+  msg->field_count = d->field_count;
+  msg->error_code = d->error_code;
+  msg->frame.data = frame;
+  msg->frame.len = d->size;
+  for (int i = 0; i < 3; i++) {
+    if (i < d->field_count) {
+      msg->fields[i].data = frame + d->field_at[i];
+      msg->fields[i].len = d->field_len[i];
+    } else {
+      msg->fields[i].data = NULL;
+      msg->fields[i].len = 0;
     }
   }
 
-  return 5 + msg->length;
+  memset(&msg->board, 0, sizeof(msg->board));
+  if (d->kind == MSG_MOVE) {
+    msg->move.pile = d->move[0];
+    msg->move.count = d->move[1];
+  } else {
+    msg->move.pile = -1;
+    msg->move.count = -1;
+    if (d->kind == MSG_PLAY || d->kind == MSG_OVER) {
+      parse_board(msg);
+    }
+  }
+}
+
+int decode_view(Decoder *st, const char *buf, int len, MessageView *msg) {
+  Decoder fresh = {0};
+  FrameDesc d;
+  int n = scan_frame(st != NULL ? st : &fresh, buf, len, &d);
+  if (n > 0) {
+    frame_view(buf, &d, msg);
+    return n;
+  }
+
+  // a frame still arriving is asked about once per read, keep this short
+  msg->kind = -1;
+  msg->length = d.size > 0 ? d.size - 5 : 0;
+  msg->field_count = 0;
+  msg->error_code = d.error_code;
+  return n;
+}
+
+int view_copy(View v, char *dst, int size) {
+  if (v.len >= size) {
+    return -1;
+  }
+  memcpy(dst, v.data, v.len);
+  dst[v.len] = '\0';
+  return v.len;
+}
+
+// fills in the header once the content is written. @end is one past the
+// content, which starts at buf + 5
+static int finish_frame(char *buf, int bufsize, char *end) {
+  int content_len = end - (buf + 5);
+  if (content_len > 99) {
+    return -1;
+  }
+  buf[0] = '0';
+  buf[1] = '|';
+  buf[2] = '0' + content_len / 10;
+  buf[3] = '0' + content_len % 10;
+  buf[4] = '|';
+  if (end - buf < bufsize) {
+    *end = '\0';
+  }
+  return end - buf;
+}
+
+static char *put_str(char *p, const char *s, int len) {
+  memcpy(p, s, len);
+  p[len] = '|';
+  return p + len + 1;
+}
+
+char *encode_int(char *p, int v) {
+  unsigned u = v;
+  if (v < 0) {
+    *p++ = '-';
+    u = -u;
+  }
+  if (u < 10) {
+    // piles, turns and winners are single digits
+    *p++ = '0' + u;
+    return p;
+  }
+  char digits[10];
+  int n = 0;
+  while (u > 0) {
+    digits[n++] = '0' + u % 10;
+    u /= 10;
+  }
+  while (n > 0) {
+    *p++ = digits[--n];
+  }
+  return p;
+}
+
+// "p0 p1 p2 p3 p4|", straight into the frame
+static char *put_board(char *p, const int piles[5]) {
+  for (int i = 0; i < 5; i++) {
+    p = encode_int(p, piles[i]);
+    *p++ = i < 4 ? ' ' : '|';
+  }
+  return p;
 }
 
 int encode_message(char *buf, int bufsize, char *type, ...) {
@@ -145,25 +613,106 @@ int encode_message(char *buf, int bufsize, char *type, ...) {
   va_list args;
   va_start(args, type);
   char *fields[3];
+  int lens[3];
+  int content_len = 5;
   for (int i = 0; i < fc; i++) {
     fields[i] = va_arg(args, char *);
+    lens[i] = strlen(fields[i]);
+    content_len += lens[i] + 1; // plus one for |
   }
   va_end(args);
 
-  int content_len = 5;
+  if (content_len > 99 || 5 + content_len > bufsize)
+    return -1;
+
+  char *p = put_str(buf + 5, type, MSG_TYPE_LEN);
   for (int i = 0; i < fc; i++) {
-    content_len += strlen(fields[i]) + 1; // plus one for |
+    p = put_str(p, fields[i], lens[i]);
   }
+  return finish_frame(buf, bufsize, p);
+}
 
-  if (5 + content_len > bufsize)
+int encode_name(char *buf, int bufsize, int p_num, const char *name) {
+  int len = strlen(name);
+  if (len > MAX_NAME_LEN || bufsize < FRAME_MAX) {
     return -1;
+  }
+  char *p = put_str(buf + 5, TYPE_NAME, MSG_TYPE_LEN);
+  p = encode_int(p, p_num);
+  *p++ = '|';
+  p = put_str(p, name, len);
+  return finish_frame(buf, bufsize, p);
+}
 
-  int pos = sprintf(buf, "0|%02d|%s|", content_len, type);
-  for (int i = 0; i < fc; i++) {
-    pos += sprintf(buf + pos, "%s|", fields[i]);
+int encode_play(char *buf, int bufsize, int turn, const int piles[5],
+                const int clocks[2]) {
+  if (bufsize < FRAME_MAX) {
+    return -1;
   }
+  char *p = put_str(buf + 5, TYPE_PLAY, MSG_TYPE_LEN);
+  p = encode_int(p, turn);
+  *p++ = '|';
+  p = put_board(p, piles);
+  if (clocks != NULL) {
+    p = encode_int(p, clocks[0]);
+    *p++ = ' ';
+    p = encode_int(p, clocks[1]);
+    *p++ = '|';
+  }
+  return finish_frame(buf, bufsize, p);
+}
+
+int encode_over(char *buf, int bufsize, int winner, const int piles[5],
+                int forfeit) {
+  if (bufsize < FRAME_MAX) {
+    return -1;
+  }
+  char *p = put_str(buf + 5, TYPE_OVER, MSG_TYPE_LEN);
+  p = encode_int(p, winner);
+  *p++ = '|';
+  p = put_board(p, piles);
+  p = forfeit ? put_str(p, "Forfeit", 7) : put_str(p, "", 0);
+  return finish_frame(buf, bufsize, p);
+}
 
-  return pos;
+#define CONST_FRAME(s) {s, sizeof(s) - 1}
+
+static const Frame WAIT_FRAME = CONST_FRAME("0|05|WAIT|");
+
+Frame wait_frame(void) { return WAIT_FRAME; }
+
+Frame fail_frame(int error_code) {
+  static const Frame fails[] = {
+      CONST_FRAME("0|16|FAIL|10 Invalid|"),
+      CONST_FRAME("0|18|FAIL|21 Long Name|"),
+      CONST_FRAME("0|24|FAIL|22 Already Playing|"),
+      CONST_FRAME("0|21|FAIL|23 Already Open|"),
+      CONST_FRAME("0|20|FAIL|24 Not Playing|"),
+      CONST_FRAME("0|18|FAIL|31 Impatient|"),
+      CONST_FRAME("0|19|FAIL|32 Pile Index|"),
+      CONST_FRAME("0|17|FAIL|33 Quantity|"),
+      CONST_FRAME("0|19|FAIL|Unknown error|"),
+  };
+  switch (error_code) {
+  case ERR_INVALID:
+    return fails[0];
+  case ERR_LONG_NAME:
+    return fails[1];
+  case ERR_ALREADY_PLAY:
+    return fails[2];
+  case ERR_ALREADY_OPEN:
+    return fails[3];
+  case ERR_NOT_PLAYING:
+    return fails[4];
+  case ERR_IMPATIENT:
+    return fails[5];
+  case ERR_PILE_INDEX:
+    return fails[6];
+  case ERR_QUANTITY:
+    return fails[7];
+  default:
+    return fails[8];
+  }
 }
 
 const char *error_string(int error_code) {
@@ -192,7 +741,13 @@ const char *error_string(int error_code) {
 }
 
 int encode_fail(char *buf, int bufsize, int error_code) {
-  return encode_message(buf, bufsize, "FAIL", error_string(error_code));
+  Frame f = fail_frame(error_code);
+  if (f.len > bufsize) {
+    return -1;
+  }
+  // the literal's terminator comes along if there is room
+  memcpy(buf, f.data, f.len < bufsize ? f.len + 1 : f.len);
+  return f.len;
 }
 
 void debug_print_message(const Message *msg) {
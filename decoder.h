@@ -14,14 +14,19 @@
  *  - Type: 4 ASCII characters
  *  - Fields: 0 to 3 depending on type, seperated by '|'
  *
- *  Memory model: decode_message() modifiers the input buffer in-place,
- *  replaces '|' delimiters with null-terminators. The fields[] pointers
- *  in the message struct pointer directly into the buffer.
+ *  Memory model: decoding does not write to the input. decode_view() and
+ *  frame_view() fill a MessageView whose fields are (pointer, length)
+ *  runs inside the buffer, which is how the server reads frames straight
+ *  out of a connection's ring. decode_message() is the older interface for
+ *  callers that want C strings: it still replaces the '|' delimiters of
+ *  the frame it decodes with null-terminators, in place.
  *
- *  DO NOT FREE fields[], and ensure buffer lifetime is valid while using
- *  Message.
+ *  Either way the fields point into the buffer. DO NOT FREE them, and keep
+ *  the buffer alive and unchanged while the Message or MessageView is used.
  */
 
+#include <stdint.h>
+
 // error codes from table 1
 #define ERR_NONE 0
 #define ERR_INVALID 10
@@ -33,26 +38,114 @@
 #define ERR_PILE_INDEX 32
 #define ERR_QUANTITY 33
 
+// message types, for Message.kind
+enum {
+  MSG_OPEN,
+  MSG_WAIT,
+  MSG_NAME,
+  MSG_PLAY,
+  MSG_MOVE,
+  MSG_OVER,
+  MSG_FAIL,
+  MSG_TYPES
+};
+
 /*
  * Message struct populated by decode_message()
  *
  * Fields:
  *  version     - protocol version (always 0)
  *  length      - content length
+ *  kind        - message type as MSG_*, dispatch on this
  *  type        - message type, null-terminated
  *  fields      - array of pointers to field strings in buffer
+ *  field_len   - length of each field
  *  field_count - number of fields
  *  error_code  - set on decode failure, 0 on success
  */
 typedef struct {
   int version;
   int length;
+  int kind;
   char type[5];
   char *fields[3];
+  int field_len[3];
   int field_count;
   int error_code;
 } Message;
 
+/*
+ * A run of bytes in someone else's buffer, not null-terminated. Valid for
+ * as long as the buffer is.
+ */
+typedef struct {
+  const char *data;
+  int len;
+} View;
+
+// the numbers in a PLAY or OVER
+typedef struct {
+  int valid;     // the fields parsed as below, 0 if they did not
+  int player;    // PLAY: whose turn it is, OVER: the winner
+  int piles[5];
+  int clocked;   // PLAY: the clocks were sent
+  int clocks[2]; // PLAY: milliseconds left for players 1 and 2
+  int forfeit;   // OVER: the game ended by forfeit
+} Board;
+
+/*
+ * A decoded message that leaves its buffer as it was, filled in by
+ * decode_view() and frame_view(). The fields are views into the frame,
+ * and frame is the whole frame, header included, so it can be passed on
+ * as is.
+ */
+typedef struct {
+  int kind;
+  int length;
+  int field_count;
+  int error_code;
+  View frame;
+  View fields[3];
+  // the numbers, parsed in the same pass that checks them
+  struct {
+    int pile;
+    int count;
+  } move;      // MOVE, 0 if empty, -1 past INT_MAX. -1 for other types
+  Board board; // PLAY and OVER, zeroed for other types
+} MessageView;
+
+/*
+ * Where one frame sits in a buffer, as filled in by decode_messages().
+ * Unlike Message it points at nothing and the buffer is left as it was;
+ * frame_message() turns it into a Message when the frame is handled.
+ * Kept to 24 bytes so a batch of them stays in a few cache lines.
+ */
+typedef struct {
+  int at;                    // offset of the frame in the buffer
+  short size;                // whole frame, header included
+  signed char kind;          // MSG_*, -1 if the type is not known
+  unsigned char error_code;  // set if the frame is invalid, 0 otherwise
+  unsigned char field_count;
+  unsigned char field_at[3]; // offset of each field from the frame start
+  unsigned char field_len[3];
+  int move[2]; // MOVE's pile and count, 0 if empty, -1 past INT_MAX
+} FrameDesc;
+
+/*
+ * What is known of a frame that has only partly arrived, so that the next
+ * decode_next() or decode_stream() on the same connection picks up where
+ * the last one stopped instead of checking the frame from its first byte
+ * again. A frame dripping in a byte at a time is thus scanned once in all,
+ * not once per byte. Keep one per connection, zeroed (or decoder_reset())
+ * whenever its buffer starts over.
+ */
+typedef struct {
+  int scanned;      // frame bytes checked so far
+  int size;         // whole frame, once the header is in
+  int kind;         // MSG_*, once the type is in
+  uint64_t bits[2]; // delimiters found so far, bit i is content byte 5 + i
+} Decoder;
+
 /*
  * decode_message - decode a NGP message from a buffer
  *
@@ -79,6 +172,87 @@ typedef struct {
  */
 int decode_message(char *buf, int bytes_received, Message *msg);
 
+/*
+ * decode_messages - decode every complete frame at the start of a buffer
+ *
+ * @buf:      input buffer, not modified
+ * @len:      number of bytes available in buffer
+ * @frames:   output array of frame descriptors
+ * @max:      size of @frames
+ * @consumed: set to the total size of the valid frames
+ *
+ * Scans frame after frame in one pass, stopping at the first incomplete
+ * frame, after @max frames, or after an invalid frame. An invalid frame is
+ * still returned, as the last one, with error_code set; it is not counted
+ * in @consumed.
+ *
+ * Returns: the number of descriptors filled in.
+ *
+ * Example:
+ *  FrameDesc frames[16];
+ *  int consumed;
+ *  int n = decode_messages(buf, len, frames, 16, &consumed);
+ *  for (int i = 0; i < n; i++) {
+ *    if (frames[i].error_code != 0) {
+ *      // send FAIL
+ *      break;
+ *    }
+ *    Message msg;
+ *    frame_message(buf + frames[i].at, &frames[i], &msg);
+ *    ...
+ *  }
+ */
+int decode_messages(const char *buf, int len, FrameDesc *frames, int max,
+                    int *consumed);
+
+/*
+ * decode_next, decode_stream - decode_message() and decode_messages() for a
+ * connection's buffer, resuming from @st
+ *
+ * @buf must start at the frame @st was last used on, which is the case as
+ * long as the caller consumes exactly the frames it was given. A bad
+ * header, type or extra delimiter fails as soon as it arrives, rather than
+ * once the whole frame is in.
+ */
+int decode_next(Decoder *st, char *buf, int len, Message *msg);
+int decode_stream(Decoder *st, const char *buf, int len, FrameDesc *frames,
+                  int max, int *consumed);
+
+// forgets the frame @st was part way through
+void decoder_reset(Decoder *st);
+
+// fills @msg for the valid frame @d that starts at @frame, terminating its
+// fields in place the way decode_message() does
+void frame_message(char *frame, const FrameDesc *d, Message *msg);
+
+/*
+ * decode_view - decode_message() without writing to @buf
+ *
+ * Same returns as decode_message(). @st, as for decode_next(), is the
+ * connection's progress on a partial frame, or NULL to start from
+ * nothing. Unless a frame is returned only kind (-1), length, field_count
+ * (0) and error_code are set.
+ */
+int decode_view(Decoder *st, const char *buf, int len, MessageView *msg);
+
+// fills @msg for the valid frame @d that starts at @frame
+void frame_view(const char *frame, const FrameDesc *d, MessageView *msg);
+
+// whether @v holds exactly the string @s
+int view_eq(View v, const char *s);
+
+// parses @v as a decimal number into @out. Returns 0, or -1 if @v is not
+// all digits or does not fit an int
+int view_int(View v, int *out);
+
+// copies @v into @dst and null-terminates it. Returns its length, or -1
+// (and copies nothing) if it does not fit in @size
+int view_copy(View v, char *dst, int size);
+
+// which frame scanner decode_message() was built with: "sse2", "swar" or
+// "scalar"
+const char *decode_scan_path(void);
+
 /*
  * encode_message - encode an NGP message into a buffer
  *
@@ -99,7 +273,54 @@ int decode_message(char *buf, int bytes_received, Message *msg);
 int encode_message(char *buf, int bufsize, char *type, ...);
 
 /*
- * encode_fail - convenience function to encode a FAIL message
+ * Per-type encoders for what the server sends every move. They format
+ * integers and the board by hand, straight into @buf, and need @bufsize
+ * of at least FRAME_MAX whatever the values. A frame whose content would
+ * not fit the two-digit length is rejected.
+ *
+ * Returns: number of bytes written, or -1 on failure.
+ */
+#define FRAME_MAX 128
+
+// NAME: the receiver's player number and the opponent's name
+int encode_name(char *buf, int bufsize, int p_num, const char *name);
+
+/*
+ * encode_play - PLAY, optionally with the players' clocks
+ *
+ * @clocks: ms left for player 1 and 2 in a game with chess clocks, sent
+ *          as a third field ("59000 60000"), or NULL for a plain PLAY
+ *
+ * decode_message() accepts PLAY with or without the third field.
+ */
+int encode_play(char *buf, int bufsize, int turn, const int piles[5],
+                const int clocks[2]);
+
+// OVER, with "Forfeit" as the last field if @forfeit
+int encode_over(char *buf, int bufsize, int winner, const int piles[5],
+                int forfeit);
+
+// writes @v in decimal at @p (at most 11 bytes, no terminator) and
+// returns one past the last digit. For patching frames in place
+char *encode_int(char *p, int v);
+
+/*
+ * Frames that never change are kept encoded: WAIT and FAIL for each error
+ * code. The data is static, send it as is.
+ */
+typedef struct {
+  const char *data;
+  int len;
+} Frame;
+
+Frame wait_frame(void);
+
+// unknown codes get "Unknown error", like encode_fail()
+Frame fail_frame(int error_code);
+
+/*
+ * encode_fail - convenience function to encode a FAIL message, copied
+ * from the fail_frame() table
  *
  * @buf:        Output buffer
  * @bufsize:    Size of output buffer
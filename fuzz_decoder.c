@@ -0,0 +1,544 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "decoder.h"
+
+/*
+ * fuzz_decoder - fuzzing entry point for the decoder
+ *
+ * fuzz_one() takes an input the way a client could send it and decodes
+ * it every way the server does: decode_message() frame by frame,
+ * decode_view(), decode_messages() in batches and decode_view() through a
+ * Decoder with the input arriving a byte at a time. Besides crashing
+ * (the sanitizers do the rest), it aborts if the ways disagree, if a
+ * view decode wrote to its input, if a valid frame does not encode back
+ * to the same bytes, or if decoding took more than the time budget.
+ *
+ * The budget is FUZZ_BASE_NS plus FUZZ_NS_PER_BYTE for every input byte,
+ * both overridable from the environment, for all four passes together.
+ * It is loose enough for a sanitizer build on a busy machine; what it is
+ * there to catch is decode time growing faster than the input, such as
+ * the buffer being rescanned from its start every time a byte arrives.
+ * Rescanning within one frame is bounded by FRAME_MAX and too small to
+ * time here; bench_codec's drip cases measure that.
+ *
+ * Built two ways:
+ *   make fuzz_decoder    the standalone driver below. It replays files,
+ *                        directories of files or stdin, so an afl-gcc
+ *                        build of it works as an AFL target, and with -n
+ *                        it also mutates them itself.
+ *   make fuzz_libfuzzer  clang's libFuzzer calls LLVMFuzzerTestOneInput()
+ *
+ * The seed corpus in fuzz_corpus/ is the frames from test_decoder.c,
+ * plus two 4KB runs of pipelined frames to give the budget some length.
+ */
+
+#define FUZZ_BASE_NS 200000
+#define FUZZ_NS_PER_BYTE 4000
+// inputs are cut to this, a few dozen frames is plenty
+#define INPUT_MAX 4096
+#define SLOW_RETRIES 3
+
+// one frame as decode_message() saw it
+typedef struct {
+  int n;
+  int kind;
+  int error_code;
+  int field_count;
+  int field_at[3];
+  int field_len[3];
+} Seen;
+
+static long base_ns = FUZZ_BASE_NS;
+static long ns_per_byte = FUZZ_NS_PER_BYTE;
+
+// the most of its budget any input has used, for the standalone driver
+static double worst_share;
+
+// the input being run, saved by fail() in the standalone driver
+static const uint8_t *current;
+static size_t current_len;
+static const char *crash_file;
+
+static void fail(const char *what, int at) {
+  fprintf(stderr, "fuzz_decoder: %s (frame at %d, input of %zu bytes)\n",
+          what, at, current_len);
+  if (crash_file != NULL) {
+    FILE *f = fopen(crash_file, "wb");
+    if (f != NULL) {
+      fwrite(current, 1, current_len, f);
+      fclose(f);
+      fprintf(stderr, "fuzz_decoder: input saved to %s\n", crash_file);
+    }
+  }
+  abort();
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// decode_message() over a copy, frame after frame. Returns the frames seen
+static int walk(const char *data, int len, char *copy, Seen *seen) {
+  memcpy(copy, data, len);
+  int count = 0;
+  for (int at = 0; at < len;) {
+    Message msg;
+    int n = decode_message(copy + at, len - at, &msg);
+    if (n > len - at || n < -1) {
+      fail("decode_message() returned past the input", at);
+    }
+    if (n == 0) {
+      break;
+    }
+    Seen *s = &seen[count++];
+    s->n = n;
+    s->error_code = msg.error_code;
+    if (n < 0) {
+      if (msg.error_code == ERR_NONE) {
+        fail("decode_message() failed without an error code", at);
+      }
+      break;
+    }
+    if (msg.kind < 0 || msg.kind >= MSG_TYPES || msg.error_code != ERR_NONE ||
+        msg.field_count < 0 || msg.field_count > 3 || msg.length != n - 5) {
+      fail("decode_message() returned a frame that makes no sense", at);
+    }
+    s->kind = msg.kind;
+    s->field_count = msg.field_count;
+    for (int i = 0; i < msg.field_count; i++) {
+      s->field_at[i] = msg.fields[i] - (copy + at);
+      s->field_len[i] = msg.field_len[i];
+      if (s->field_at[i] < 10 || s->field_at[i] + s->field_len[i] >= n) {
+        fail("decode_message() returned a field outside its frame", at);
+      }
+    }
+    at += n;
+  }
+  return count;
+}
+
+static void same_view(const char *frame, const MessageView *v, const Seen *s,
+                      int at, const char *what) {
+  if (v->kind != s->kind || v->field_count != s->field_count ||
+      v->frame.data != frame || v->frame.len != s->n) {
+    fail(what, at);
+  }
+  for (int i = 0; i < s->field_count; i++) {
+    if (v->fields[i].data != frame + s->field_at[i] ||
+        v->fields[i].len != s->field_len[i]) {
+      fail(what, at);
+    }
+  }
+}
+
+// decode_view() frame after frame must see what walk() saw
+static void check_views(const char *data, int len, const Seen *seen,
+                        int count) {
+  int at = 0;
+  for (int i = 0; i <= count; i++) {
+    MessageView v;
+    int n = decode_view(NULL, data + at, len - at, &v);
+    if (i == count) {
+      if (n != 0 && at < len) {
+        fail("decode_view() found a frame decode_message() did not", at);
+      }
+      break;
+    }
+    if (n != seen[i].n) {
+      fail("decode_view() and decode_message() disagree", at);
+    }
+    if (n < 0) {
+      if (v.error_code != seen[i].error_code) {
+        fail("decode_view() failed with another error code", at);
+      }
+      break;
+    }
+    same_view(data + at, &v, &seen[i], at, "decode_view() fields differ");
+    at += n;
+  }
+}
+
+// decode_messages() in small batches must see what walk() saw
+static void check_batches(const char *data, int len, const Seen *seen,
+                          int count) {
+  int at = 0;
+  int i = 0;
+  for (;;) {
+    FrameDesc frames[4];
+    int consumed;
+    int n = decode_messages(data + at, len - at, frames, 4, &consumed);
+    if (n == 0) {
+      break;
+    }
+    int done = 0;
+    for (int j = 0; j < n; j++, i++) {
+      const FrameDesc *d = &frames[j];
+      if (i >= count || d->at != done) {
+        fail("decode_messages() found a frame decode_message() did not", at);
+      }
+      if (d->error_code != ERR_NONE) {
+        if (seen[i].n != -1 || d->error_code != seen[i].error_code ||
+            j != n - 1) {
+          fail("decode_messages() failed where decode_message() did not",
+               at + done);
+        }
+        return;
+      }
+      MessageView v;
+      frame_view(data + at + d->at, d, &v);
+      if (seen[i].n != d->size) {
+        fail("decode_messages() and decode_message() disagree", at + done);
+      }
+      same_view(data + at + d->at, &v, &seen[i], at + done,
+                "frame_view() fields differ");
+      done += d->size;
+    }
+    if (consumed != done) {
+      fail("decode_messages() consumed the wrong amount", at);
+    }
+    at += consumed;
+  }
+  if (i != count) {
+    fail("decode_messages() stopped early", at);
+  }
+}
+
+// the input arriving a byte at a time, decoded through a Decoder
+static void check_drip(const char *data, int len, const Seen *seen,
+                       int count) {
+  Decoder st = {0};
+  int at = 0;
+  int i = 0;
+  for (int have = 1; have <= len && i < count; have++) {
+    MessageView v;
+    int n = decode_view(&st, data + at, have - at, &v);
+    if (n == 0) {
+      continue;
+    }
+    // early failure may come before the whole frame is in
+    if (n != seen[i].n || (n > 0 && have - at != n)) {
+      fail("a frame read a byte at a time decoded differently", at);
+    }
+    if (n < 0) {
+      if (v.error_code != seen[i].error_code) {
+        fail("a frame read a byte at a time failed differently", at);
+      }
+      return;
+    }
+    same_view(data + at, &v, &seen[i], at, "a dripped frame's fields differ");
+    at += n;
+    i++;
+  }
+  if (i != count) {
+    fail("a frame read a byte at a time never decoded", at);
+  }
+}
+
+// a valid frame encodes back to itself
+static void check_round_trip(const char *frame, const Seen *s, int at) {
+  char field[3][FRAME_MAX];
+  char *f[3] = {"", "", ""};
+  for (int i = 0; i < s->field_count; i++) {
+    View v = {frame + s->field_at[i], s->field_len[i]};
+    if (memchr(v.data, '\0', v.len) != NULL) {
+      // encode_message() takes C strings
+      return;
+    }
+    view_copy(v, field[i], sizeof(field[i]));
+    f[i] = field[i];
+  }
+  static char *names[MSG_TYPES] = {"OPEN", "WAIT", "NAME", "PLAY",
+                                   "MOVE", "OVER", "FAIL"};
+  char out[FRAME_MAX];
+  int n;
+  if (s->kind == MSG_PLAY && s->field_count == 3) {
+    // the clocks are optional, which encode_message() cannot send
+    MessageView v;
+    decode_view(NULL, frame, s->n, &v);
+    if (!v.board.valid) {
+      return;
+    }
+    n = encode_play(out, sizeof(out), v.board.player, v.board.piles,
+                    v.board.clocked ? v.board.clocks : NULL);
+    MessageView again;
+    if (n < 0 || decode_view(NULL, out, n, &again) != n ||
+        memcmp(&again.board, &v.board, sizeof(Board)) != 0) {
+      fail("a PLAY board does not survive encode_play()", at);
+    }
+    return;
+  }
+  n = encode_message(out, sizeof(out), names[s->kind], f[0], f[1], f[2]);
+  if (n != s->n || memcmp(out, frame, n) != 0) {
+    fail("a valid frame does not encode back to itself", at);
+  }
+}
+
+static void decode_all(const char *data, int len, char *copy, Seen *seen) {
+  int count = walk(data, len, copy, seen);
+  check_views(data, len, seen, count);
+  check_batches(data, len, seen, count);
+  check_drip(data, len, seen, count);
+}
+
+static int fuzz_one(const uint8_t *input, size_t size) {
+  int len = size < INPUT_MAX ? size : INPUT_MAX;
+  // exact sizes, so reading past the end is caught
+  char *data = malloc(len + 1);
+  char *copy = malloc(len + 1);
+  Seen *seen = malloc((len / 5 + 1) * sizeof(Seen));
+  memcpy(data, input, len);
+  current = input;
+  current_len = len;
+
+  double best = 0;
+  for (int attempt = 0; attempt < SLOW_RETRIES; attempt++) {
+    double start = now_ns();
+    decode_all(data, len, copy, seen);
+    double took = now_ns() - start;
+    if (attempt == 0 || took < best) {
+      best = took;
+    }
+    if (best <= base_ns + (double)ns_per_byte * len) {
+      break;
+    }
+  }
+  if (memcmp(data, input, len) != 0) {
+    fail("a decode that should not write to its input did", 0);
+  }
+  double budget = base_ns + (double)ns_per_byte * len;
+  if (best > budget) {
+    fprintf(stderr, "fuzz_decoder: took %.0f ns, budget %ld + %ld/byte\n",
+            best, base_ns, ns_per_byte);
+    fail("decoding went over the time budget", 0);
+  }
+  if (best / budget > worst_share) {
+    worst_share = best / budget;
+  }
+
+  int count = walk(data, len, copy, seen);
+  for (int i = 0, at = 0; i < count && seen[i].n > 0; at += seen[i++].n) {
+    check_round_trip(data + at, &seen[i], at);
+  }
+
+  free(data);
+  free(copy);
+  free(seen);
+  return 0;
+}
+
+static void read_budget(void) {
+  const char *s = getenv("FUZZ_BASE_NS");
+  if (s != NULL) {
+    base_ns = atol(s);
+  }
+  s = getenv("FUZZ_NS_PER_BYTE");
+  if (s != NULL) {
+    ns_per_byte = atol(s);
+  }
+}
+
+#ifdef FUZZ_LIBFUZZER
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+  (void)argc;
+  (void)argv;
+  read_budget();
+  return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  return fuzz_one(data, size);
+}
+
+#else
+
+typedef struct {
+  uint8_t *data;
+  int len;
+} Input;
+
+static Input *corpus;
+static int corpus_count;
+static int corpus_cap;
+
+static void add_input(const uint8_t *data, int len) {
+  if (corpus_count == corpus_cap) {
+    corpus_cap = corpus_cap ? corpus_cap * 2 : 64;
+    corpus = realloc(corpus, corpus_cap * sizeof(Input));
+  }
+  Input *in = &corpus[corpus_count++];
+  in->data = malloc(len + 1);
+  memcpy(in->data, data, len);
+  in->len = len;
+}
+
+static int load_file(FILE *f) {
+  uint8_t buf[INPUT_MAX];
+  int len = fread(buf, 1, sizeof(buf), f);
+  add_input(buf, len);
+  return len;
+}
+
+static int load_path(const char *path) {
+  struct stat sb;
+  if (stat(path, &sb) < 0) {
+    perror(path);
+    return -1;
+  }
+  if (S_ISDIR(sb.st_mode)) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+      perror(path);
+      return -1;
+    }
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL) {
+      if (e->d_name[0] == '.') {
+        continue;
+      }
+      char sub[4096];
+      snprintf(sub, sizeof(sub), "%s/%s", path, e->d_name);
+      load_path(sub);
+    }
+    closedir(dir);
+    return 0;
+  }
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  load_file(f);
+  fclose(f);
+  return 0;
+}
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t next_random(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng >> 32;
+}
+
+// bytes the decoder cares about, picked more often than the rest
+static const char INTERESTING[] = "0123456789| AEFIKLMNOPRTVWY\n\0";
+
+// applies a few random edits to @buf, returns the new length
+static int mutate(uint8_t *buf, int len) {
+  int edits = 1 + next_random() % 4;
+  for (int e = 0; e < edits; e++) {
+    int at = len > 0 ? next_random() % len : 0;
+    switch (next_random() % 7) {
+    case 0: // replace a byte with an interesting one
+      if (len > 0) {
+        buf[at] = INTERESTING[next_random() % (sizeof(INTERESTING) - 1)];
+      }
+      break;
+    case 1: // replace a byte with anything
+      if (len > 0) {
+        buf[at] = next_random();
+      }
+      break;
+    case 2: // insert a byte
+      if (len < INPUT_MAX) {
+        memmove(buf + at + 1, buf + at, len - at);
+        buf[at] = INTERESTING[next_random() % (sizeof(INTERESTING) - 1)];
+        len++;
+      }
+      break;
+    case 3: // delete a byte
+      if (len > 0) {
+        memmove(buf + at, buf + at + 1, len - at - 1);
+        len--;
+      }
+      break;
+    case 4: // cut the input short
+      len = at;
+      break;
+    case 5: { // append another input, for pipelined frames
+      const Input *other = &corpus[next_random() % corpus_count];
+      int n = other->len;
+      if (n > INPUT_MAX - len) {
+        n = INPUT_MAX - len;
+      }
+      memcpy(buf + len, other->data, n);
+      len += n;
+      break;
+    }
+    case 6: // bump a length digit
+      if (len > 3) {
+        buf[2 + next_random() % 2] = '0' + next_random() % 10;
+      }
+      break;
+    }
+  }
+  return len;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-n mutations] [-s seed] [file or directory...]\n"
+          "  replays each input (stdin if none is given), then runs\n"
+          "  mutations of them; a failing input is saved to %s\n",
+          prog, "fuzz-crash");
+}
+
+int main(int argc, char **argv) {
+  long mutations = 0;
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0'; arg++) {
+    if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc) {
+      mutations = atol(argv[++arg]);
+    } else if (strcmp(argv[arg], "-s") == 0 && arg + 1 < argc) {
+      rng = strtoull(argv[++arg], NULL, 0) | 1;
+    } else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  read_budget();
+  crash_file = "fuzz-crash";
+
+  if (arg == argc) {
+    load_file(stdin);
+  }
+  for (; arg < argc; arg++) {
+    if (load_path(argv[arg]) < 0) {
+      return EXIT_FAILURE;
+    }
+  }
+  if (corpus_count == 0) {
+    fprintf(stderr, "fuzz_decoder: no inputs\n");
+    return EXIT_FAILURE;
+  }
+
+  for (int i = 0; i < corpus_count; i++) {
+    fuzz_one(corpus[i].data, corpus[i].len);
+  }
+
+  uint8_t buf[INPUT_MAX];
+  for (long m = 0; m < mutations; m++) {
+    const Input *in = &corpus[next_random() % corpus_count];
+    memcpy(buf, in->data, in->len);
+    int len = mutate(buf, in->len);
+    fuzz_one(buf, len);
+  }
+
+  printf("fuzz_decoder: %d inputs, %ld mutations, %s scanner, "
+         "at most %.0f%% of the time budget\n",
+         corpus_count, mutations, decode_scan_path(), worst_share * 100);
+  return EXIT_SUCCESS;
+}
+
+#endif
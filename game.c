@@ -1,9 +1,11 @@
 #define _POSIX_C_SOURCE 200809L
 #include "decoder.h"
 #include "game.h"
+#include "metrics.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,6 +20,59 @@ void init_game(Game *g) {
     g->piles[i] = i * 2 + 1;
   }
   g->curr_player = 1;
+  g->clocked = 0;
+  g->clock[0] = 0;
+  g->clock[1] = 0;
+  g->started = 0;
+  render_play(g);
+}
+
+// "0|LL|PLAY|" comes before the turn digit, the board starts after it
+#define TURN_AT 10
+#define BOARD_AT 12
+
+static void set_length(char *frame, int len) {
+  int content_len = len - 5;
+  frame[2] = '0' + content_len / 10 % 10;
+  frame[3] = '0' + content_len % 10;
+}
+
+void render_play(Game *g) {
+  g->frame_len = encode_play(g->frame, FRAME_MAX, g->curr_player, g->piles,
+                             NULL);
+  if (g->frame_len < 0) {
+    g->frame_len = 0;
+  }
+  int at = BOARD_AT;
+  for (int i = 0; i < 5; i++) {
+    g->pile_at[i] = at;
+    while (at < g->frame_len && g->frame[at] != ' ' && g->frame[at] != '|') {
+      at++;
+    }
+    at++;
+  }
+  g->clock_at = at;
+}
+
+// rewrites pile @i in the cached frame. Only when its number of digits
+// changed (10 down to 9) does the rest of the frame move and the length
+// header get fixed up
+static void patch_pile(Game *g, int i) {
+  char digits[12];
+  int len = encode_int(digits, g->piles[i]) - digits;
+  int at = g->pile_at[i];
+  int end = (i < 4 ? g->pile_at[i + 1] : g->clock_at) - 1;
+  int shift = len - (end - at);
+  if (shift != 0) {
+    memmove(g->frame + end + shift, g->frame + end, g->frame_len - end);
+    for (int j = i + 1; j < 5; j++) {
+      g->pile_at[j] += shift;
+    }
+    g->clock_at += shift;
+    g->frame_len += shift;
+    set_length(g->frame, g->frame_len);
+  }
+  memcpy(g->frame + at, digits, len);
 }
 
 int is_game_over(Game *g) {
@@ -43,6 +98,8 @@ int do_move(Game *game, int pile, int count) {
   } else {
     game->curr_player = 1;
   }
+  patch_pile(game, pile);
+  game->frame[TURN_AT] = '0' + game->curr_player;
   return ERR_NONE;
 }
 
@@ -57,83 +114,186 @@ void send_msg(int fd, const char *msg, int len) {
   }
 }
 
+void player_send(Player *p, const char *msg, int len) {
+  if (p->out == NULL && p->outs != NULL) {
+    p->out = slab_alloc(p->outs);
+    if (p->out == NULL) {
+      // no queue to be had is the same as a full one
+      p->out_full = 1;
+      return;
+    }
+  }
+  if (p->out == NULL) {
+    send_msg(p->sock, msg, len);
+    return;
+  }
+  if (p->out_size + len > OUTLEN) {
+    p->out_full = 1;
+    return;
+  }
+  int tail = (p->out_head + p->out_size) % OUTLEN;
+  int first = len < OUTLEN - tail ? len : OUTLEN - tail;
+  memcpy(p->out + tail, msg, first);
+  memcpy(p->out, msg + first, len - first);
+  p->out_size += len;
+}
+
+int player_pending(Player *p, struct iovec iov[2]) {
+  if (p->out_size == 0) {
+    return 0;
+  }
+  int first = OUTLEN - p->out_head;
+  iov[0].iov_base = p->out + p->out_head;
+  if (p->out_size <= first) {
+    iov[0].iov_len = p->out_size;
+    return 1;
+  }
+  iov[0].iov_len = first;
+  iov[1].iov_base = p->out;
+  iov[1].iov_len = p->out_size - first;
+  return 2;
+}
+
+void player_sent(Player *p, int n) {
+  p->out_head = (p->out_head + n) % OUTLEN;
+  p->out_size -= n;
+  if (p->out_size == 0) {
+    // keeps the next batch in one piece
+    p->out_head = 0;
+    if (p->outs != NULL) {
+      slab_free(p->outs, p->out);
+      p->out = NULL;
+    }
+  }
+}
+
+void player_discard(Player *p) {
+  p->out_head = 0;
+  p->out_size = 0;
+  if (p->outs != NULL && p->out != NULL) {
+    slab_free(p->outs, p->out);
+    p->out = NULL;
+  }
+}
+
+int player_flush(Player *p) {
+  while (p->out_size > 0) {
+    struct iovec iov[2];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = player_pending(p, iov);
+    // a gone peer is reported as an error, not SIGPIPE
+    ssize_t n = sendmsg(p->sock, &msg, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    player_sent(p, n);
+  }
+  return 0;
+}
+
+int player_readable(Player *p) {
+  if (p->out_size >= OUT_HIGH) {
+    p->paused = 1;
+  } else if (p->out_size <= OUT_LOW) {
+    p->paused = 0;
+  }
+  return !p->paused;
+}
+
 void send_name(Player *p1, Player *p2) {
   char buf1[BUFLEN];
-  int len1 = encode_message(buf1, BUFLEN, "NAME", "1", p2->name);
+  int len1 = encode_name(buf1, BUFLEN, 1, p2->name);
   if (len1 > 0) {
     printf("Sending NAME to P1\n");
-    send_msg(p1->sock, buf1, len1);
+    player_send(p1, buf1, len1);
   }
 
   char buf2[BUFLEN];
-  int len2 = encode_message(buf2, BUFLEN, "NAME", "2", p1->name);
+  int len2 = encode_name(buf2, BUFLEN, 2, p1->name);
   if (len2 > 0) {
     printf("Sending NAME to P2\n");
-    send_msg(p2->sock, buf2, len2);
+    player_send(p2, buf2, len2);
   }
 }
 
-void send_wait(int sock) {
-  char buf[BUFLEN];
-  int len = encode_message(buf, BUFLEN, "WAIT");
-  if (write(sock, buf, len) < 0) {
-    perror("write");
-  }
+void send_wait(Player *p) {
+  Frame f = wait_frame();
+  player_send(p, f.data, f.len);
+  metrics_since(H_ACCEPT_WAIT, p->since);
+  p->since = metrics_now_us();
 }
 
-void send_over(Game *g, Player *p1, Player *p2, int winner, int forfeit) {
-  char winner_str[8];
-  sprintf(winner_str, "%d", winner);
-
-  char board[64];
-  sprintf(board, "%d %d %d %d %d", g->piles[0], g->piles[1], g->piles[2],
-          g->piles[3], g->piles[4]);
+void send_fail(Player *p, int error_code) {
+  Frame f = fail_frame(error_code);
+  player_send(p, f.data, f.len);
+  metrics_fail(error_code);
+}
 
-  char buf[BUFLEN];
-  int len;
+void send_over(Game *g, Player *p1, Player *p2, int winner, int forfeit) {
+  // same board as the cached PLAY, only the type, digit and tail differ
+  char buf[FRAME_MAX];
+  memcpy(buf, g->frame, g->clock_at);
+  memcpy(buf + 5, "OVER", 4);
+  buf[TURN_AT] = '0' + winner;
+  int len = g->clock_at;
   if (forfeit) {
-    len = encode_message(buf, BUFLEN, "OVER", winner_str, board, "Forfeit");
+    memcpy(buf + len, "Forfeit|", 8);
+    len += 8;
   } else {
-    len = encode_message(buf, BUFLEN, "OVER", winner_str, board, "");
+    buf[len++] = '|';
   }
+  set_length(buf, len);
 
-  if (len > 0) {
-    if (p1 != NULL) {
-      send_msg(p1->sock, buf, len);
-    }
-    if (p2 != NULL) {
-      send_msg(p2->sock, buf, len);
+  if (p1 != NULL) {
+    player_send(p1, buf, len);
+  }
+  if (p2 != NULL) {
+    player_send(p2, buf, len);
+  }
+  printf("Game over.\n");
+
+  if (g->started != 0) {
+    metrics_count(M_GAMES_FINISHED);
+    if (forfeit) {
+      metrics_count(M_GAMES_FORFEITED);
     }
-    printf("Game over.\n");
+    metrics_since(H_GAME, g->started);
+    g->started = 0;
   }
 }
 
 void send_play(Player *p1, Player *p2, Game *g) {
-  char board[64];
-  sprintf(board, "%d %d %d %d %d", g->piles[0], g->piles[1], g->piles[2],
-          g->piles[3], g->piles[4]);
-
-  char turn[8];
-  sprintf(turn, "%d", g->curr_player);
-
-  char buf[BUFLEN];
-  int len = encode_message(buf, BUFLEN, "PLAY", turn, board);
-
-  if (len > 0) {
-    printf("Sending PLAY\n");
-    send_msg(p1->sock, buf, len);
-    send_msg(p2->sock, buf, len);
+  if (g->clocked) {
+    // the clocks change with every move, only they are written again
+    char *p = encode_int(g->frame + g->clock_at, g->clock[0]);
+    *p++ = ' ';
+    p = encode_int(p, g->clock[1]);
+    *p++ = '|';
+    g->frame_len = p - g->frame;
+    set_length(g->frame, g->frame_len);
   }
+
+  printf("Sending PLAY\n");
+  player_send(p1, g->frame, g->frame_len);
+  player_send(p2, g->frame, g->frame_len);
 }
 
-int openGame(Player *p) {
-  Message msg;
-  int bytes = decode_message(p->buffer, p->buffer_size, &msg);
+int open_player(Player *p) {
+  MessageView msg;
+  int bytes =
+      decode_view(&p->dec, ring_read_ptr(&p->in), ring_used(&p->in), &msg);
 
   if (bytes < 0) {
-    char buf[BUFLEN];
-    int len = encode_fail(buf, sizeof(buf), msg.error_code);
-    write(p->sock, buf, len);
+    metrics_count(M_DECODE_ERRORS);
+    send_fail(p, msg.error_code);
     return -1;
   }
   if (bytes == 0) {
@@ -141,141 +301,249 @@ int openGame(Player *p) {
   }
 
   // game not open yet
-  if (strcmp(msg.type, "OPEN") != 0) {
-    char buf[BUFLEN];
-    int len = encode_fail(buf, sizeof(buf), ERR_INVALID);
-    write(p->sock, buf, len);
+  if (msg.kind != MSG_OPEN) {
+    send_fail(p, ERR_INVALID);
     return -1;
   }
 
   // already opened
   if (p->opened) {
-    char buf[BUFLEN];
-    int len = encode_fail(buf, sizeof(buf), ERR_ALREADY_OPEN);
-    write(p->sock, buf, len);
+    send_fail(p, ERR_ALREADY_OPEN);
     return -1;
   }
 
   // invalid name
-  if (msg.fields[0] == NULL || strlen(msg.fields[0]) == 0 ||
-      strlen(msg.fields[0]) > 72) {
-    char buf[BUFLEN];
-    int len = encode_fail(buf, sizeof(buf), ERR_INVALID);
-    write(p->sock, buf, len);
+  if (msg.fields[0].len == 0 ||
+      view_copy(msg.fields[0], p->name, sizeof(p->name)) < 0) {
+    send_fail(p, ERR_INVALID);
     return -1;
   }
-
-  strncpy(p->name, msg.fields[0], sizeof(p->name) - 1);
-  p->name[sizeof(p->name) - 1] = '\0';
   p->opened = 1;
 
   printf("Player %s opened a game.\n", p->name);
-  memmove(p->buffer, p->buffer + bytes, p->buffer_size - bytes);
-  p->buffer_size -= bytes;
-
-  send_wait(p->sock);
+  ring_consume(&p->in, bytes);
   return 1;
 }
 
-void playGame(Player *p1, Player *p2) {
-  Game game;
-  init_game(&game);
+int openGame(Player *p) {
+  int result = open_player(p);
+  if (result > 0) {
+    send_wait(p);
+  }
+  return result;
+}
+
+void start_game(Game *g, Player *p1, Player *p2, int clock_ms) {
+  init_game(g);
+  if (clock_ms > 0) {
+    g->clocked = 1;
+    g->clock[0] = clock_ms;
+    g->clock[1] = clock_ms;
+  }
 
   p1->playing = 1;
   p2->playing = 1;
 
   printf("sending names\n");
   send_name(p1, p2);
+  metrics_since(H_OPEN_NAME, p1->since);
+  metrics_since(H_OPEN_NAME, p2->since);
 
-  send_play(p1, p2, &game);
-
-  while (!is_game_over(&game)) {
-    Player *current;
-    Player *waiting;
-    if (game.curr_player == 1) {
-      current = p1;
-      waiting = p2;
-    } else {
-      current = p2;
-      waiting = p1;
-    }
+  send_play(p1, p2, g);
+  metrics_count(M_GAMES_STARTED);
+  g->started = metrics_now_us();
+}
 
-    int bytes = read(current->sock, current->buffer + current->buffer_size,
-                     BUFLEN - current->buffer_size);
+int handle_message(Game *g, Player *p1, Player *p2, Player *from,
+                   const MessageView *msg) {
+  Player *current = g->curr_player == 1 ? p1 : p2;
+  Player *waiting = g->curr_player == 1 ? p2 : p1;
 
-    if (bytes < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        return;
-      }
-      printf("Player %d disconnected\n", game.curr_player);
-      send_over(&game, waiting, NULL, waiting->p_num, 1);
-      return;
-    }
+  if (msg->kind != MSG_MOVE) {
+    printf("Expected MOVE message\n");
+    send_fail(from, ERR_INVALID);
+    return 0;
+  }
 
-    if (bytes == 0) {
-      printf("Player %d disconnected\n", game.curr_player);
-      send_over(&game, waiting, NULL, waiting->p_num, 1);
-      return;
-    }
+  if (from != current) {
+    printf("Player %d moved out of turn\n", from->p_num);
+    send_fail(from, ERR_IMPATIENT);
+    return 0;
+  }
 
-    current->buffer_size += bytes;
+  // decoded already, a number too big for an int is -1 and do_move()
+  // turns it down
+  int pile = msg->move.pile;
+  int count = msg->move.count;
 
-    Message msg;
-    int msg_bytes = decode_message(current->buffer, current->buffer_size, &msg);
+  printf("Player %d MOVE pile %d count %d\n", g->curr_player, pile, count);
 
-    if (msg_bytes < 0) {
-      printf("Invalid message\n");
-      char buf[256];
-      int len = encode_fail(buf, sizeof(buf), ERR_INVALID);
-      if (len > 0) {
-        send_msg(current->sock, buf, len);
-      }
-      close(current->sock);
-    }
+  int err = do_move(g, pile, count);
 
-    if (msg_bytes == 0) {
-      continue;
+  if (err != ERR_NONE) {
+    printf("Invalid move\n");
+    send_fail(current, err);
+    return 0;
+  }
+  // answered with PLAY or OVER below
+  metrics_move();
+
+  if (is_game_over(g)) {
+    printf("OVER sent\n");
+    send_over(g, current, waiting, current->p_num, 0);
+    return 1;
+  }
+
+  send_play(p1, p2, g);
+  return 0;
+}
+
+// decodes and handles every complete frame @from has buffered.
+// returns 1 once the game is over (OVER already sent), 0 otherwise
+static int drain_input(Game *g, Player *p1, Player *p2, Player *from) {
+  Ring *in = &from->in;
+  Player *other = from == p1 ? p2 : p1;
+
+  while (ring_used(in) > 0 && player_readable(from)) {
+    FrameDesc frames[DECODE_BATCH];
+    int consumed;
+    int n = decode_stream(&from->dec, ring_read_ptr(in), ring_used(in),
+                          frames, DECODE_BATCH, &consumed);
+    if (n == 0) {
+      return 0;
     }
 
-    memmove(current->buffer, current->buffer + msg_bytes,
-            current->buffer_size - msg_bytes);
-    current->buffer_size -= msg_bytes;
+    for (int i = 0; i < n; i++) {
+      // frames not handled yet stay in the ring untouched
+      if (!player_readable(from)) {
+        return 0;
+      }
 
-    if (strcmp(msg.type, "MOVE") != 0) {
-      printf("Expected MOVE message\n");
-      char buf[256];
-      int len = encode_fail(buf, sizeof(buf), ERR_INVALID);
-      if (len > 0) {
-        send_msg(current->sock, buf, len);
+      if (frames[i].error_code != 0) {
+        metrics_count(M_DECODE_ERRORS);
+        printf("Invalid message\n");
+        send_fail(from, frames[i].error_code);
+        send_over(g, other, NULL, other->p_num, 1);
+        return 1;
       }
-      continue;
-    }
 
-    int pile = atoi(msg.fields[0]);
-    int count = atoi(msg.fields[1]);
+      // the fields stay readable, nothing is written to the ring until the
+      // next read
+      MessageView msg;
+      frame_view(ring_read_ptr(in), &frames[i], &msg);
+      ring_consume(in, frames[i].size);
 
-    printf("Player %d MOVE pile %d count %d\n", game.curr_player, pile, count);
+      if (handle_message(g, p1, p2, from, &msg)) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
 
-    int err = do_move(&game, pile, count);
+// plays until OVER has been queued, or with @wait 0 until nothing more
+// has arrived. Both players are watched so a move out of turn is answered
+// right away and a hang-up is noticed whoever's turn it is. @woke is
+// when the input being handled was read, for the MOVE -> PLAY latency
+static void play_loop(Game *g, Player *p1, Player *p2, int wait,
+                      unsigned long *woke) {
+  Player *players[2] = {p1, p2};
+  struct pollfd fds[2];
+
+  for (;;) {
+    // one read may carry several frames, all of them are answered before
+    // going back to poll(). Input held back by a full queue is taken up
+    // here once it drained, as is whatever came along with OPEN
+    for (int i = 0; i < 2; i++) {
+      if (drain_input(g, p1, p2, players[i])) {
+        return;
+      }
+    }
 
-    if (err != ERR_NONE) {
-      printf("Invalid move\n");
-      char buf[256];
-      int len = encode_fail(buf, sizeof(buf), err);
-      if (len > 0) {
-        send_msg(current->sock, buf, len);
+    // everything queued this round goes out in one sendmsg() per player
+    for (int i = 0; i < 2; i++) {
+      Player *p = players[i];
+      Player *other = players[1 - i];
+      int broken = player_flush(p) < 0;
+      if (broken || p->out_full) {
+        printf(broken ? "Player %d disconnected\n"
+                      : "Player %d is not reading\n",
+               p->p_num);
+        send_over(g, other, NULL, other->p_num, 1);
+        return;
       }
-      continue;
+      fds[i].fd = p->sock;
+      fds[i].events = (player_readable(p) ? POLLIN : 0) |
+                      (p->out_size > 0 ? POLLOUT : 0);
+      fds[i].revents = 0;
     }
+    metrics_moves_sent(*woke);
 
-    if (is_game_over(&game)) {
-      printf("OVER sent\n");
-      send_over(&game, current, waiting, current->p_num, 0);
+    int ready = poll(fds, 2, wait);
+    *woke = metrics_now_us();
+    if (ready < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ready <= 0) {
       return;
-    } else {
-      send_play(p1, p2, &game);
+    }
+
+    for (int i = 0; i < 2; i++) {
+      // a paused player's hang-up shows up as a failed write instead
+      if (!(fds[i].events & POLLIN) ||
+          !(fds[i].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))) {
+        continue;
+      }
+      Player *p = players[i];
+      Player *other = players[1 - i];
+
+      // every complete frame has been handled, so only a partial one can
+      // be left and the ring always has room
+      int bytes = read(p->sock, ring_write_ptr(&p->in), ring_space(&p->in));
+      if (bytes < 0 && (errno == EINTR || errno == EAGAIN ||
+                        errno == EWOULDBLOCK)) {
+        continue;
+      }
+      if (bytes <= 0) {
+        printf("Player %d disconnected\n", p->p_num);
+        send_over(g, other, NULL, other->p_num, 1);
+        return;
+      }
+      ring_produce(&p->in, bytes);
     }
   }
+}
 
-  // Game loop and logic would go here
+void playGame(Player *p1, Player *p2) {
+  // output is queued and written non-blocking, so a player who does not
+  // read cannot hold up the game
+  Player *players[2] = {p1, p2};
+  char out[2][OUTLEN];
+  int flags[2];
+  for (int i = 0; i < 2; i++) {
+    Player *p = players[i];
+    p->out = out[i];
+    p->out_head = 0;
+    p->out_size = 0;
+    p->out_full = 0;
+    p->paused = 0;
+    flags[i] = fcntl(p->sock, F_GETFL, 0);
+    fcntl(p->sock, F_SETFL, flags[i] | O_NONBLOCK);
+  }
+  // callers with non-blocking sockets only get what has already arrived
+  int wait = (flags[0] & O_NONBLOCK) ? 0 : -1;
+
+  Game game;
+  start_game(&game, p1, p2, 0);
+  unsigned long woke = metrics_now_us();
+  play_loop(&game, p1, p2, wait, &woke);
+
+  // what is left, OVER included, is written out the blocking way
+  for (int i = 0; i < 2; i++) {
+    Player *p = players[i];
+    fcntl(p->sock, F_SETFL, flags[i]);
+    player_flush(p);
+    p->out = NULL;
+  }
+  metrics_moves_sent(woke);
 }
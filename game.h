@@ -1,27 +1,117 @@
+#ifndef GAME_H
+#define GAME_H
+
+#include "decoder.h"
+#include "ring.h"
+#include "slab.h"
+#include <sys/uio.h>
 
 #define BUFLEN 256
+#define OUTLEN 1024 // output queue per connection, overflowing it forfeits
+#ifndef OUT_HIGH
+#define OUT_HIGH 512 // queued output at which a player's input is paused
+#endif
+#define OUT_LOW 128  // and where it is taken up again
+#define INLEN 4096 // input ring per connection, room for pipelined frames
+#define DECODE_BATCH 16 // frames decoded per pass over the input
 
 typedef struct {
     int piles[5];
     int curr_player;
+    int clocked;  // chess clocks on, PLAY reports them
+    int clock[2]; // ms of thinking time left for player 1 and 2
+    // PLAY for the current position, patched by do_move() rather than
+    // encoded again for every send
+    char frame[FRAME_MAX];
+    int frame_len;
+    int pile_at[5]; // offset of each pile's digits
+    int clock_at;   // offset just past the board, where the clocks go
+    unsigned long started; // us, when the first PLAY went out, 0 once OVER
 } Game;
 
+// one per connection, so kept small: what every read and write touches
+// comes first, the flags are bits and the name, needed on OPEN and at the
+// start of a game, comes last
 typedef struct {
   int sock;
+  unsigned p_num : 2;
+  unsigned opened : 1;   // 0 is no, 1 is yes
+  unsigned playing : 1;
+  unsigned out_full : 1; // a frame was dropped because out had no room
+  unsigned paused : 1;   // not reading input until the queue drains
+  unsigned short out_head; // offset of the first unsent byte
+  unsigned short out_size;
+  char *out; // OUTLEN circular queue of frames, NULL writes straight to sock
+  // if set, out is taken from here when a frame is queued and given back
+  // once everything is sent, so an idle player holds no queue
+  Slab *outs;
+  // us, when the connection was accepted and from WAIT on when it opened,
+  // for the latency metrics. 0 if unknown
+  unsigned long since;
+  Ring in; // received bytes not yet decoded
+  Decoder dec; // progress on a frame only partly in
+  // inline, not interned: fork and prefork copy players between processes
+  // whole, and it is about 60 of the ~530 bytes an idle player costs
   char name[73]; //max is 72 + null
-  int p_num;
-  int opened; // 0 is no, 1 is yes
-  char *buffer;
-  int buffer_size;
-  int playing;
 } Player;
 
 int openGame(Player *p);
 
+// openGame() without the WAIT reply, for callers that still have to
+// vet the name before accepting the player
+int open_player(Player *p);
+
+void send_wait(Player *p);
+
+// FAIL with @error_code, from the table of constant frames
+void send_fail(Player *p, int error_code);
+
 void playGame(Player *p1, Player *p2);
 
+// sends NAME and the opening PLAY, marks both players as playing.
+// clock_ms > 0 gives each player that much thinking time in total
+void start_game(Game *g, Player *p1, Player *p2, int clock_ms);
+
+// applies one decoded message from `from` to the game.
+// returns 1 once the game is over (OVER already sent), 0 otherwise
+int handle_message(Game *g, Player *p1, Player *p2, Player *from,
+                   const MessageView *msg);
+
+void send_msg(int fd, const char *msg, int len);
+
+// queues a frame on p->out, or writes it out right away if there is none
+void player_send(Player *p, const char *msg, int len);
+
+// the queued output as at most two pieces (it may wrap), returns how many
+int player_pending(Player *p, struct iovec iov[2]);
+
+// drops the first @n queued bytes once they have been sent
+void player_sent(Player *p, int n);
+
+// drops everything queued, for a connection that is broken or going away
+void player_discard(Player *p);
+
+// writes as much of the queue as the socket takes, one sendmsg() with
+// both pieces per attempt. Returns -1 if the connection is broken, 0
+// otherwise
+int player_flush(Player *p);
+
+// back-pressure: a player whose queue reached OUT_HIGH is not read from
+// until it is back down to OUT_LOW. Returns 1 if its input may be taken
+int player_readable(Player *p);
+
+void send_over(Game *g, Player *p1, Player *p2, int winner, int forfeit);
+
+// sends the cached PLAY frame to both players as is
+void send_play(Player *p1, Player *p2, Game *g);
+
 void init_game(Game *g);
 
+// encodes the cached PLAY from scratch, for piles that were set by hand
+void render_play(Game *g);
+
 int do_move(Game *g, int pile, int count);
 
-int is_game_over(Game *g);
\ No newline at end of file
+int is_game_over(Game *g);
+
+#endif
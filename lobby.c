@@ -0,0 +1,250 @@
+#define _POSIX_C_SOURCE 200809L
+#include "lobby.h"
+#include "decoder.h"
+#include "metrics.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INITIAL_PLAYERS 16
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+int lobby_init(Lobby *l, int handshake_ms) {
+  l->count = 0;
+  l->capacity = INITIAL_PLAYERS;
+  l->handshake_ms = handshake_ms;
+  l->entries = malloc(l->capacity * sizeof(Entry));
+  // one extra slot for the listener
+  l->fds = malloc((l->capacity + 1) * sizeof(struct pollfd));
+  if (l->entries == NULL || l->fds == NULL) {
+    free(l->entries);
+    free(l->fds);
+    return -1;
+  }
+  return 0;
+}
+
+int lobby_add(Lobby *l, int sock) {
+  if (l->count == l->capacity) {
+    int capacity = l->capacity * 2;
+    Entry *entries = realloc(l->entries, capacity * sizeof(Entry));
+    if (entries != NULL) {
+      l->entries = entries;
+    }
+    struct pollfd *fds =
+        realloc(l->fds, (capacity + 1) * sizeof(struct pollfd));
+    if (fds != NULL) {
+      l->fds = fds;
+    }
+    if (entries == NULL || fds == NULL) {
+      close(sock);
+      return -1;
+    }
+    l->capacity = capacity;
+  }
+
+  Entry *e = &l->entries[l->count];
+  memset(e, 0, sizeof(*e));
+  if (ring_init(&e->player.in, INLEN) < 0) {
+    perror("ring_init");
+    close(sock);
+    return -1;
+  }
+  l->count++;
+  e->player.sock = sock;
+  e->player.since = metrics_now_us();
+  metrics_gauge(G_SESSIONS, 1);
+  if (l->handshake_ms > 0) {
+    e->deadline = now_ms() + l->handshake_ms;
+  }
+  return 0;
+}
+
+// marks a player for removal, the slot is compacted away after the poll
+static void drop(Player *p) {
+  close(p->sock);
+  ring_free(&p->in);
+  p->sock = -1;
+  metrics_gauge(G_SESSIONS, -1);
+}
+
+static int name_taken(Lobby *l, Player *p) {
+  for (int i = 0; i < l->count; i++) {
+    Player *q = &l->entries[i].player;
+    if (q != p && q->sock >= 0 && q->opened && strcmp(q->name, p->name) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// reads what arrived and handles every complete frame
+static void handle_readable(Lobby *l, Player *p) {
+  int bytes = read(p->sock, ring_write_ptr(&p->in), ring_space(&p->in));
+  if (bytes < 0 && errno == EINTR) {
+    return;
+  }
+  if (bytes <= 0) {
+    printf("Connection %d left the queue\n", p->sock);
+    drop(p);
+    return;
+  }
+  ring_produce(&p->in, bytes);
+
+  if (!p->opened) {
+    int result = open_player(p);
+    if (result < 0) {
+      drop(p);
+      return;
+    }
+    if (result == 0) {
+      return;
+    }
+    if (name_taken(l, p)) {
+      printf("same name\n");
+      send_fail(p, ERR_ALREADY_PLAY);
+      drop(p);
+      return;
+    }
+    send_wait(p);
+  }
+
+  // nothing but the game itself may follow OPEN
+  MessageView msg;
+  int len =
+      decode_view(&p->dec, ring_read_ptr(&p->in), ring_used(&p->in), &msg);
+  if (len < 0) {
+    metrics_count(M_DECODE_ERRORS);
+    send_fail(p, msg.error_code);
+    drop(p);
+  } else if (len > 0) {
+    send_fail(p, msg.kind == MSG_OPEN ? ERR_ALREADY_OPEN
+                                               : ERR_NOT_PLAYING);
+    drop(p);
+  }
+}
+
+static void compact(Lobby *l) {
+  int kept = 0;
+  for (int i = 0; i < l->count; i++) {
+    if (l->entries[i].player.sock >= 0) {
+      l->entries[kept++] = l->entries[i];
+    }
+  }
+  l->count = kept;
+}
+
+// shortens @timeout to the earliest handshake deadline
+static int poll_timeout(Lobby *l, int timeout, long now) {
+  if (l->handshake_ms <= 0) {
+    return timeout;
+  }
+  for (int i = 0; i < l->count; i++) {
+    Entry *e = &l->entries[i];
+    if (e->player.opened) {
+      continue;
+    }
+    long left = e->deadline > now ? e->deadline - now : 0;
+    if (timeout < 0 || left < timeout) {
+      timeout = left;
+    }
+  }
+  return timeout;
+}
+
+int lobby_poll(Lobby *l, int listener, int timeout) {
+  int n = l->count;
+  for (int i = 0; i < n; i++) {
+    l->fds[i].fd = l->entries[i].player.sock;
+    l->fds[i].events = POLLIN;
+    l->fds[i].revents = 0;
+  }
+  l->fds[n].fd = listener;
+  l->fds[n].events = POLLIN;
+  l->fds[n].revents = 0;
+
+  if (poll(l->fds, n + 1, poll_timeout(l, timeout, now_ms())) < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  // hang-ups show up as readable with nothing to read
+  for (int i = 0; i < n; i++) {
+    if (l->fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+      handle_readable(l, &l->entries[i].player);
+    }
+  }
+
+  if (l->handshake_ms > 0) {
+    long now = now_ms();
+    for (int i = 0; i < n; i++) {
+      Player *p = &l->entries[i].player;
+      if (p->sock >= 0 && !p->opened && l->entries[i].deadline <= now) {
+        printf("Connection %d did not open in time\n", p->sock);
+        drop(p);
+      }
+    }
+  }
+  compact(l);
+
+  if (l->fds[n].revents & POLLIN) {
+    int sock = accept(listener, NULL, NULL);
+    if (sock < 0) {
+      perror("accept");
+    } else {
+      printf("Connected from %d\n", sock);
+      metrics_count(M_ACCEPTS);
+      lobby_add(l, sock);
+    }
+  }
+  return 0;
+}
+
+int lobby_match(Lobby *l, Player *p1, Player *p2) {
+  int first = -1;
+  for (int i = 0; i < l->count; i++) {
+    if (!l->entries[i].player.opened) {
+      continue;
+    }
+    if (first < 0) {
+      first = i;
+      continue;
+    }
+
+    *p1 = l->entries[first].player;
+    *p2 = l->entries[i].player;
+    p1->p_num = 1;
+    p2->p_num = 2;
+    l->entries[first].player.sock = -1;
+    l->entries[i].player.sock = -1;
+    compact(l);
+    // the caller plays them, or hands them on, and closes its copies
+    metrics_gauge(G_SESSIONS, -2);
+    return 1;
+  }
+  return 0;
+}
+
+void lobby_free(Lobby *l) {
+  // not drop(): a forked child frees its copy of the parent's lobby, and
+  // the sessions gauge is shared with the parent
+  for (int i = 0; i < l->count; i++) {
+    if (l->entries[i].player.sock >= 0) {
+      close(l->entries[i].player.sock);
+    }
+    ring_free(&l->entries[i].player.in);
+  }
+  free(l->entries);
+  free(l->fds);
+  l->entries = NULL;
+  l->fds = NULL;
+  l->count = 0;
+}
@@ -0,0 +1,62 @@
+#ifndef LOBBY_H
+#define LOBBY_H
+
+/*
+ * lobby.h - matchmaking queue for the fork and prefork servers
+ *
+ * Every accepted connection waits here until it has an opponent. The
+ * lobby polls all of them at once: OPEN is handled as soon as it arrives
+ * (WAIT goes out right away), a name already taken by someone in the
+ * queue gets 22 Already Playing, and a player that hangs up or sends
+ * anything else before the game starts is dropped on the spot instead of
+ * being paired with and forfeiting to the next arrival.
+ *
+ * Opened players are matched in the order they connected. A connection
+ * that has not opened within the handshake deadline is closed, so a
+ * silent client cannot sit in the queue forever.
+ */
+
+#include "game.h"
+#include <poll.h>
+
+typedef struct {
+  Player player;
+  long deadline; // ms on the monotonic clock, to open by
+} Entry;
+
+typedef struct {
+  Entry *entries; // queued connections, oldest first
+  int count;
+  int capacity;
+  int handshake_ms; // 0 waits for OPEN forever
+  struct pollfd *fds;
+} Lobby;
+
+// @handshake_ms: how long a connection gets to send OPEN, 0 for no limit
+int lobby_init(Lobby *l, int handshake_ms);
+
+// queues a freshly accepted connection. Returns -1 (socket closed) on OOM
+int lobby_add(Lobby *l, int sock);
+
+/*
+ * lobby_poll - wait up to @timeout ms for anything to happen
+ *
+ * Accepts new connections on @listener, reads from every queued player
+ * and closes the ones past their handshake deadline, waking up early for
+ * that if needed. Returns -1 if poll() failed for any reason but a
+ * signal.
+ */
+int lobby_poll(Lobby *l, int listener, int timeout);
+
+/*
+ * lobby_match - take the two longest waiting opened players
+ *
+ * Returns 1 and fills in @p1 and @p2 (the caller now owns their sockets
+ * and buffers), 0 if fewer than two have opened.
+ */
+int lobby_match(Lobby *l, Player *p1, Player *p2);
+
+// closes every queued connection
+void lobby_free(Lobby *l);
+
+#endif
@@ -0,0 +1,608 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REQUEST_MAX 1024
+#define SEGMENT_MAGIC 0x6e696d73 // "nims"
+#define NAME_MAX_LEN 256
+// spins on an odd seq before checking whether its writer is still alive
+#define SPIN_CHECK 1024
+
+typedef struct {
+  // checked by metrics_attach(), readers must agree on the layout
+  uint32_t magic;
+  uint32_t shard_size;
+  uint32_t shards;
+  // a seqlock over folding a shard into @retired, which changes two shards
+  // at once
+  unsigned folds;
+  int folder; // pid holding @folds odd
+  MetricShard retired; // exited threads, and threads that found no shard
+  MetricShard shard[METRIC_SHARDS];
+} MetricSegment;
+
+static MetricSegment *seg;
+static pthread_once_t seg_once = PTHREAD_ONCE_INIT;
+static pthread_key_t seg_key; // retires a thread's shard when it ends
+static __thread MetricShard *mine;
+
+static uint64_t load(const uint64_t *v) {
+  return __atomic_load_n(v, __ATOMIC_RELAXED);
+}
+
+// readers copy values while their writer may be storing them
+static void add(uint64_t *v, uint64_t n) {
+  __atomic_store_n(v, load(v) + n, __ATOMIC_RELAXED);
+}
+
+static int dead(int pid) {
+  return pid > 0 && kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+/*
+ * Waits for @seq to be even and returns it. A writer killed mid-update
+ * leaves it odd for good, so now and then @holder is looked at, and the
+ * odd value is returned if that process is gone.
+ */
+static unsigned wait_even(const unsigned *seq, const int *holder) {
+  for (int spins = 1;; spins++) {
+    unsigned s = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+    if (!(s & 1) || (spins % SPIN_CHECK == 0 &&
+                     dead(__atomic_load_n(holder, __ATOMIC_RELAXED)))) {
+      return s;
+    }
+    if (spins % SPIN_CHECK == 0) {
+      sched_yield();
+    }
+  }
+}
+
+// makes @seq odd for a writer that shares it with others
+static void lock(unsigned *seq, int *holder) {
+  for (;;) {
+    unsigned s = wait_even(seq, holder);
+    // a dead holder's update is over, whatever it left behind
+    unsigned next = (s & 1) ? s + 2 : s + 1;
+    if (__atomic_compare_exchange_n(seq, &s, next, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+      __atomic_store_n(holder, getpid(), __ATOMIC_RELAXED);
+      return;
+    }
+  }
+}
+
+static void unlock(unsigned *seq) {
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static void forget_shard(void) {
+  // the parent's thread owns what it pointed at
+  mine = NULL;
+  pthread_setspecific(seg_key, NULL);
+}
+
+static void retire_key(void *m) {
+  (void)m;
+  metrics_retire();
+}
+
+static void retire_at_exit(void) {
+  metrics_retire();
+}
+
+static const char *shm_name(const char *name, char *buf) {
+  // shm_open() wants a single leading slash
+  snprintf(buf, NAME_MAX_LEN, "/%s", name[0] == '/' ? name + 1 : name);
+  return buf;
+}
+
+int metrics_init(const char *name) {
+  if (seg != NULL) {
+    fprintf(stderr, "metrics: segment already mapped\n");
+    return -1;
+  }
+  void *mem;
+  if (name == NULL) {
+    mem = mmap(NULL, sizeof(MetricSegment), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  } else {
+    char buf[NAME_MAX_LEN];
+    int fd = shm_open(shm_name(name, buf), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      perror("metrics shm_open");
+      return -1;
+    }
+    if (ftruncate(fd, sizeof(MetricSegment)) < 0) {
+      perror("metrics ftruncate");
+      close(fd);
+      return -1;
+    }
+    mem = mmap(NULL, sizeof(MetricSegment), PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    close(fd);
+  }
+  if (mem == MAP_FAILED) {
+    perror("metrics mmap");
+    return -1;
+  }
+
+  // fresh pages are zero, every shard free and every seq even
+  MetricSegment *s = mem;
+  s->shard_size = sizeof(MetricShard);
+  s->shards = METRIC_SHARDS;
+  __atomic_store_n(&s->magic, SEGMENT_MAGIC, __ATOMIC_RELEASE);
+  seg = s;
+
+  pthread_key_create(&seg_key, retire_key);
+  pthread_atfork(NULL, NULL, forget_shard);
+  atexit(retire_at_exit);
+  return 0;
+}
+
+int metrics_attach(const char *name) {
+  char buf[NAME_MAX_LEN];
+  int fd = shm_open(shm_name(name, buf), O_RDONLY, 0);
+  if (fd < 0) {
+    perror("metrics shm_open");
+    return -1;
+  }
+  struct stat st;
+  void *mem = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size == sizeof(MetricSegment)) {
+    mem = mmap(NULL, sizeof(MetricSegment), PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "metrics: %s is not a segment of this build\n", name);
+    return -1;
+  }
+  MetricSegment *s = mem;
+  if (__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != SEGMENT_MAGIC ||
+      s->shard_size != sizeof(MetricShard) || s->shards != METRIC_SHARDS) {
+    fprintf(stderr, "metrics: %s is not a segment of this build\n", name);
+    munmap(mem, sizeof(MetricSegment));
+    return -1;
+  }
+  seg = s;
+  return 0;
+}
+
+static void default_segment(void) {
+  if (seg == NULL && metrics_init(NULL) < 0) {
+    exit(EXIT_FAILURE);
+  }
+}
+
+static MetricSegment *segment(void) {
+  pthread_once(&seg_once, default_segment);
+  return seg;
+}
+
+static MetricShard *claim(void) {
+  MetricSegment *s = segment();
+  int pid = getpid();
+  for (int i = 0; i < METRIC_SHARDS; i++) {
+    int none = 0;
+    if (__atomic_compare_exchange_n(&s->shard[i].owner, &none, pid, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      return &s->shard[i];
+    }
+  }
+  // a process killed without exit() left its shard behind: carry on with
+  // its counts, which are still part of the totals
+  for (int i = 0; i < METRIC_SHARDS; i++) {
+    MetricShard *m = &s->shard[i];
+    int owner = __atomic_load_n(&m->owner, __ATOMIC_RELAXED);
+    if (dead(owner) && __atomic_compare_exchange_n(&m->owner, &owner, pid, 0,
+                                                   __ATOMIC_ACQUIRE,
+                                                   __ATOMIC_RELAXED)) {
+      if (m->seq & 1) {
+        unlock(&m->seq);
+      }
+      return m;
+    }
+  }
+  return &s->retired;
+}
+
+static MetricShard *shard(void) {
+  if (mine == NULL) {
+    mine = claim();
+    pthread_setspecific(seg_key, mine);
+  }
+  return mine;
+}
+
+// every update is one write section, so readers never see half of one
+static MetricShard *write_begin(void) {
+  MetricShard *m = shard();
+  if (m == &seg->retired) {
+    lock(&m->seq, &m->owner);
+  } else {
+    __atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+  return m;
+}
+
+static void write_end(MetricShard *m) {
+  unlock(&m->seq);
+}
+
+/*
+ * Adds every value of @from to @to, and zeroes @from's with @clear. @to is
+ * either private or written under its seqlock.
+ */
+static void merge(MetricShard *to, MetricShard *from, int clear) {
+  uint64_t *pairs[][2] = {{to->counters, from->counters},
+                          {to->gauges, from->gauges},
+                          {to->fails, from->fails},
+                          {&to->moves, &from->moves}};
+  int lens[] = {M_COUNTERS, G_GAUGES, 100, 1};
+  for (int p = 0; p < 4; p++) {
+    for (int i = 0; i < lens[p]; i++) {
+      add(&pairs[p][0][i], load(&pairs[p][1][i]));
+      if (clear) {
+        __atomic_store_n(&pairs[p][1][i], 0, __ATOMIC_RELAXED);
+      }
+    }
+  }
+  for (int h = 0; h < H_HISTOGRAMS; h++) {
+    for (int i = 0; i <= HIST_BUCKETS; i++) {
+      add(&to->hists[h].buckets[i], load(&from->hists[h].buckets[i]));
+      if (clear) {
+        __atomic_store_n(&from->hists[h].buckets[i], 0, __ATOMIC_RELAXED);
+      }
+    }
+    add(&to->hists[h].sum, load(&from->hists[h].sum));
+    if (clear) {
+      __atomic_store_n(&from->hists[h].sum, 0, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+void metrics_retire(void) {
+  MetricShard *m = mine;
+  if (m == NULL) {
+    return;
+  }
+  forget_shard();
+  if (m == &seg->retired) {
+    return;
+  }
+
+  // readers retry across the fold, they must not count the shard twice or
+  // not at all
+  lock(&seg->folds, &seg->folder);
+  lock(&seg->retired.seq, &seg->retired.owner);
+  __atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  merge(&seg->retired, m, 1);
+  unlock(&m->seq);
+  unlock(&seg->retired.seq);
+  unlock(&seg->folds);
+  __atomic_store_n(&m->owner, 0, __ATOMIC_RELEASE);
+}
+
+unsigned long metrics_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+void metrics_count(int counter) {
+  MetricShard *m = write_begin();
+  add(&m->counters[counter], 1);
+  write_end(m);
+}
+
+void metrics_gauge(int gauge, long delta) {
+  MetricShard *m = write_begin();
+  add(&m->gauges[gauge], (uint64_t)delta);
+  write_end(m);
+}
+
+void metrics_fail(int code) {
+  if (code > 0 && code < 100) {
+    MetricShard *m = write_begin();
+    add(&m->fails[code], 1);
+    write_end(m);
+  }
+}
+
+int hist_bucket(unsigned long us) {
+  if (us < HIST_SUB) {
+    return us;
+  }
+  int e = 63 - __builtin_clzl(us);
+  if (e >= HIST_BITS) {
+    return HIST_BUCKETS;
+  }
+  // the bits below the leading one pick the step within its power of two
+  int shift = e - HIST_SUB_BITS;
+  return (shift + 1) * HIST_SUB + (int)((us >> shift) & (HIST_SUB - 1));
+}
+
+unsigned long hist_upper(int i) {
+  if (i < HIST_SUB) {
+    return i;
+  }
+  int shift = i / HIST_SUB - 1;
+  unsigned long step = i % HIST_SUB;
+  return ((HIST_SUB + step + 1) << shift) - 1;
+}
+
+static void observe(MetricShard *m, int hist, unsigned long us, uint64_t n) {
+  Histogram *h = &m->hists[hist];
+  add(&h->buckets[hist_bucket(us)], n);
+  add(&h->sum, us * n);
+}
+
+void metrics_observe(int hist, unsigned long us) {
+  MetricShard *m = write_begin();
+  observe(m, hist, us, 1);
+  write_end(m);
+}
+
+void metrics_since(int hist, unsigned long since_us) {
+  if (since_us != 0) {
+    unsigned long now = metrics_now_us();
+    metrics_observe(hist, now > since_us ? now - since_us : 0);
+  }
+}
+
+void metrics_move(void) {
+  MetricShard *m = write_begin();
+  add(&m->counters[M_MOVES], 1);
+  add(&m->moves, 1);
+  write_end(m);
+}
+
+void metrics_moves_sent(unsigned long woke_us) {
+  MetricShard *m = shard();
+  // only this thread adds to its own, the retired shard's are shared
+  if (m != &seg->retired && load(&m->moves) == 0) {
+    return;
+  }
+  unsigned long now = metrics_now_us();
+  m = write_begin();
+  uint64_t n = load(&m->moves);
+  observe(m, H_MOVE_PLAY, now > woke_us ? now - woke_us : 0, n);
+  add(&m->moves, -n);
+  write_end(m);
+}
+
+// copies @m as it was between two of its updates
+static void snapshot(MetricShard *m, MetricShard *copy) {
+  for (;;) {
+    unsigned s = wait_even(&m->seq, &m->owner);
+    memset(copy, 0, sizeof(*copy));
+    merge(copy, m, 0);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&m->seq, __ATOMIC_RELAXED) == s) {
+      return;
+    }
+  }
+}
+
+void metrics_sum(MetricShard *out) {
+  MetricSegment *s = segment();
+  MetricShard copy;
+  for (;;) {
+    unsigned folds = wait_even(&s->folds, &s->folder);
+    memset(out, 0, sizeof(*out));
+    snapshot(&s->retired, &copy);
+    merge(out, &copy, 0);
+    for (int i = 0; i < METRIC_SHARDS; i++) {
+      // a free shard is all zeroes
+      if (__atomic_load_n(&s->shard[i].owner, __ATOMIC_ACQUIRE) != 0) {
+        snapshot(&s->shard[i], &copy);
+        merge(out, &copy, 0);
+      }
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->folds, __ATOMIC_RELAXED) == folds) {
+      return;
+    }
+  }
+}
+
+static const struct {
+  const char *name;
+  const char *help;
+} counter_info[M_COUNTERS] = {
+    {"nim_accepts_total", "Connections accepted."},
+    {"nim_refused_total", "Connections closed at once, the pool was full."},
+    {"nim_games_started_total", "Games started."},
+    {"nim_games_finished_total", "Games that ended with OVER."},
+    {"nim_games_forfeited_total", "Games that ended with OVER Forfeit."},
+    {"nim_decode_errors_total", "Frames that did not decode."},
+    {"nim_moves_total", "MOVEs applied."},
+};
+
+static const struct {
+  const char *name;
+  const char *help;
+} gauge_info[G_GAUGES] = {
+    {"nim_sessions", "Connections held, opened or not."},
+};
+
+static const struct {
+  const char *name;
+  const char *help;
+} hist_info[H_HISTOGRAMS] = {
+    {"nim_accept_to_wait_seconds", "From accept to WAIT queued."},
+    {"nim_open_to_name_seconds", "From OPEN to NAME queued."},
+    {"nim_move_to_play_seconds", "From reading a MOVE to writing its answer."},
+    {"nim_game_duration_seconds", "From the first PLAY to OVER."},
+};
+
+static void render_histogram(FILE *f, int h, const Histogram *hist) {
+  const char *name = hist_info[h].name;
+  fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, hist_info[h].help,
+          name);
+  uint64_t total = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    total += hist->buckets[i];
+    unsigned long le = hist_upper(i);
+    fprintf(f, "%s_bucket{le=\"%lu.%06lu\"} %llu\n", name, le / 1000000,
+            le % 1000000, (unsigned long long)total);
+  }
+  total += hist->buckets[HIST_BUCKETS];
+  fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+          (unsigned long long)total);
+  fprintf(f, "%s_sum %llu.%06llu\n", name,
+          (unsigned long long)hist->sum / 1000000,
+          (unsigned long long)hist->sum % 1000000);
+  fprintf(f, "%s_count %llu\n", name, (unsigned long long)total);
+}
+
+int metrics_render(FILE *f) {
+  MetricShard sum;
+  metrics_sum(&sum);
+
+  for (int i = 0; i < M_COUNTERS; i++) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+            counter_info[i].name, counter_info[i].help, counter_info[i].name,
+            counter_info[i].name, (unsigned long long)sum.counters[i]);
+  }
+  fprintf(f, "# HELP nim_fails_total FAIL frames sent, by error code.\n"
+             "# TYPE nim_fails_total counter\n");
+  for (int code = 0; code < 100; code++) {
+    if (sum.fails[code] != 0) {
+      fprintf(f, "nim_fails_total{code=\"%d\"} %llu\n", code,
+              (unsigned long long)sum.fails[code]);
+    }
+  }
+  for (int i = 0; i < G_GAUGES; i++) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", gauge_info[i].name,
+            gauge_info[i].help, gauge_info[i].name, gauge_info[i].name,
+            (long long)sum.gauges[i]);
+  }
+  // both from one snapshot, so a game is never finished before it started
+  fprintf(f, "# HELP nim_games_in_flight Games started and not over yet.\n"
+             "# TYPE nim_games_in_flight gauge\nnim_games_in_flight %lld\n",
+          (long long)(sum.counters[M_GAMES_STARTED] -
+                      sum.counters[M_GAMES_FINISHED]));
+  for (int h = 0; h < H_HISTOGRAMS; h++) {
+    render_histogram(f, h, &sum.hists[h]);
+  }
+  return ferror(f) ? -1 : 0;
+}
+
+// answers one scrape, whatever the client sends it is done with after
+static void serve_one(int sock) {
+  // a client that never sends its request must not stall the next one
+  struct timeval tv = {1, 0};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  char req[REQUEST_MAX + 1];
+  int len = 0;
+  while (len < REQUEST_MAX) {
+    int n = read(sock, req + len, REQUEST_MAX - len);
+    if (n <= 0) {
+      break;
+    }
+    len += n;
+    req[len] = '\0';
+    if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL) {
+      break;
+    }
+  }
+  req[len] = '\0';
+
+  FILE *f = fdopen(sock, "w");
+  if (f == NULL) {
+    close(sock);
+    return;
+  }
+  if (strncmp(req, "GET /metrics ", 13) == 0 ||
+      strncmp(req, "GET / ", 6) == 0) {
+    fprintf(f, "HTTP/1.0 200 OK\r\n"
+               "Content-Type: text/plain; version=0.0.4\r\n"
+               "Connection: close\r\n\r\n");
+    metrics_render(f);
+  } else {
+    fprintf(f, "HTTP/1.0 404 Not Found\r\n"
+               "Content-Type: text/plain\r\n"
+               "Connection: close\r\n\r\nGET /metrics\n");
+  }
+  fclose(f);
+}
+
+static void *admin_main(void *arg) {
+  int listener = (int)(intptr_t)arg;
+  for (;;) {
+    int sock = accept(listener, NULL, NULL);
+    if (sock < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        perror("metrics accept");
+        sleep(1);
+      }
+      continue;
+    }
+    serve_one(sock);
+  }
+  return NULL;
+}
+
+int metrics_serve(const char *port) {
+  char *end;
+  long num = strtol(port, &end, 10);
+  if (*port == '\0' || *end != '\0' || num < 0 || num > 65535) {
+    fprintf(stderr, "metrics: bad port %s\n", port);
+    return -1;
+  }
+
+  int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0) {
+    perror("metrics socket");
+    return -1;
+  }
+  int one = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(num);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+  if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listener, 16) < 0 ||
+      getsockname(listener, (struct sockaddr *)&addr, &addr_len) < 0) {
+    perror("metrics listen");
+    close(listener);
+    return -1;
+  }
+
+  // the new thread starts with the mask it is created under
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  pthread_t thread;
+  int err = pthread_create(&thread, NULL, admin_main,
+                           (void *)(intptr_t)listener);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err != 0) {
+    errno = err;
+    perror("metrics thread");
+    close(listener);
+    return -1;
+  }
+  pthread_detach(thread);
+  return ntohs(addr.sin_port);
+}
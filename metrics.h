@@ -0,0 +1,161 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * metrics.h - counters, gauges and latency histograms for nimd
+ *
+ * Every thread that records something gets a MetricShard of its own the
+ * first time it does, and is the only one ever writing to it: an update is
+ * a few loads and stores to memory no other thread writes, no lock and no
+ * atomic read-modify-write, so instrumenting the move path costs a few
+ * instructions.
+ *
+ * The shards live in one shared memory segment, mapped before any fork, so
+ * the game children of the fork and prefork modes record into the same
+ * place as the parent and the parent's admin port, or nimstat from outside
+ * with -S, sees every process. Each shard is a seqlock: its writer makes
+ * seq odd around an update and readers copy the shard until they see the
+ * same even seq before and after, so a snapshot of a shard is consistent,
+ * a histogram's buckets with its sum and games started with finished. No
+ * syscall either way. A thread's shard is freed when it exits, a process's
+ * when it calls exit(), after its counts have been folded into a shard
+ * kept for the retired ones, so a child's games outlive it. Should more
+ * threads record than there are shards, the extra ones share the retired
+ * shard and take turns on it.
+ *
+ * Histograms are log-linear in the style of HdrHistogram: values in
+ * microseconds, exact up to HIST_SUB, then HIST_SUB buckets per power of
+ * two, so any value is off by at most a quarter. They cover 1 us to a
+ * bit over an hour, longer values only count towards +Inf.
+ *
+ * metrics_serve() exposes the sum in the Prometheus text format on a
+ * local admin port.
+ */
+
+#define METRIC_SHARDS 256 // threads and processes recording at once
+#define HIST_SUB_BITS 2
+#define HIST_SUB (1 << HIST_SUB_BITS) // linear steps per power of two
+#define HIST_BITS 32 // values below 2^32 us get a bucket of their own
+#define HIST_BUCKETS ((HIST_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum {
+  M_ACCEPTS,         // connections accepted
+  M_REFUSED,         // closed right away, the session pool was full
+  M_GAMES_STARTED,   // NAME and the first PLAY sent
+  M_GAMES_FINISHED,  // OVER sent, whatever the reason
+  M_GAMES_FORFEITED, // of those, OVER with Forfeit
+  M_DECODE_ERRORS,   // frames that did not decode
+  M_MOVES,           // MOVEs applied
+  M_COUNTERS
+};
+
+enum {
+  G_SESSIONS, // connections the process holds, opened or not
+  G_GAUGES
+};
+
+enum {
+  H_ACCEPT_WAIT, // accepted until WAIT is queued
+  H_OPEN_NAME,   // OPEN handled until NAME is queued, time in matchmaking
+  H_MOVE_PLAY,   // a MOVE read until its PLAY or OVER is written
+  H_GAME,        // first PLAY until OVER
+  H_HISTOGRAMS
+};
+
+typedef struct {
+  uint64_t buckets[HIST_BUCKETS + 1]; // the last one is past HIST_BITS
+  uint64_t sum;                       // us
+} Histogram;
+
+typedef struct {
+  unsigned seq; // odd while the shard is being written
+  int owner;    // pid of the process whose thread writes it, 0 if free
+  uint64_t counters[M_COUNTERS];
+  uint64_t gauges[G_GAUGES]; // two's complement, summed as signed
+  uint64_t fails[100];       // FAIL frames sent, by error code
+  Histogram hists[H_HISTOGRAMS];
+  uint64_t moves; // applied MOVEs whose answer is not written yet
+} __attribute__((aligned(64))) MetricShard;
+
+/*
+ * metrics_init - map the segment the shards live in
+ *
+ * Called once before anything records and before the first fork. With a
+ * @name the segment is a POSIX shared memory object others can attach to,
+ * created anew or truncated if one is left over, and it stays behind after
+ * exit for a last look. Without one it is anonymous, shared with children
+ * only, and that is also what the first update makes if nobody called this.
+ * Returns 0, or -1 with the reason printed.
+ */
+int metrics_init(const char *name);
+
+/*
+ * metrics_attach - map a segment nimd made with metrics_init(@name)
+ *
+ * For readers in other processes, instead of metrics_init(): the mapping is
+ * read-only and the process must not record. Returns 0, or -1 if there is
+ * no such segment or it was laid out by a different build.
+ */
+int metrics_attach(const char *name);
+
+/*
+ * metrics_retire - fold the calling thread's counts into the retired shard
+ * and free its own
+ *
+ * Runs by itself when a thread ends and when a process calls exit().
+ */
+void metrics_retire(void);
+
+// CLOCK_MONOTONIC in us, comparable across processes
+unsigned long metrics_now_us(void);
+
+void metrics_count(int counter);
+void metrics_gauge(int gauge, long delta);
+void metrics_fail(int code);
+
+// records one sample of @us
+void metrics_observe(int hist, unsigned long us);
+// records the time since @since_us, unless it is 0 (never stamped)
+void metrics_since(int hist, unsigned long since_us);
+
+/*
+ * MOVE -> PLAY latency. handle_message() calls metrics_move() for every
+ * move it applies, and the loop that read the MOVEs calls
+ * metrics_moves_sent() once it has written the answers, with the time it
+ * woke up to read them. Every pending move is recorded with that delay,
+ * and no clock is read for a batch without moves.
+ */
+void metrics_move(void);
+void metrics_moves_sent(unsigned long woke_us);
+
+// the bucket holding @us, HIST_BUCKETS for values out of range
+int hist_bucket(unsigned long us);
+// the largest value bucket @i holds
+unsigned long hist_upper(int i);
+
+/*
+ * metrics_sum - add a snapshot of every shard into @out
+ */
+void metrics_sum(MetricShard *out);
+
+/*
+ * metrics_render - write the summed metrics in the Prometheus text format
+ *
+ * Returns 0, or -1 if writing to @f failed.
+ */
+int metrics_render(FILE *f);
+
+/*
+ * metrics_serve - answer HTTP scrapes on 127.0.0.1:@port
+ *
+ * Starts a thread that serves GET /metrics, one connection at a time. It
+ * runs with every signal blocked, so shutdown signals still reach the
+ * thread that waits for them. Returns the port it listens on (useful when
+ * @port is "0"), or -1.
+ */
+int metrics_serve(const char *port);
+
+#endif
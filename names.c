@@ -0,0 +1,112 @@
+#define _POSIX_C_SOURCE 200809L
+#include "names.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_SLOTS 64
+
+// marks a slot whose name was released, probing continues past it
+static char tombstone[1];
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char **slots;
+static size_t capacity;
+static size_t used; // live names plus tombstones
+
+// FNV-1a
+static size_t hash_name(const char *name) {
+  size_t h = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+    h ^= *p;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// returns the slot holding name, or NULL
+static char **lookup(const char *name) {
+  size_t mask = capacity - 1;
+  for (size_t i = hash_name(name) & mask;; i = (i + 1) & mask) {
+    if (slots[i] == NULL) {
+      return NULL;
+    }
+    if (slots[i] != tombstone && strcmp(slots[i], name) == 0) {
+      return &slots[i];
+    }
+  }
+}
+
+static void insert(char **table, size_t cap, char *name) {
+  size_t mask = cap - 1;
+  size_t i = hash_name(name) & mask;
+  while (table[i] != NULL) {
+    i = (i + 1) & mask;
+  }
+  table[i] = name;
+}
+
+// rebuilds the table, dropping tombstones and doubling when mostly live
+static int rehash(void) {
+  size_t live = 0;
+  for (size_t i = 0; i < capacity; i++) {
+    if (slots[i] != NULL && slots[i] != tombstone) {
+      live++;
+    }
+  }
+
+  size_t cap = capacity ? capacity : INITIAL_SLOTS;
+  while (live * 2 >= cap) {
+    cap *= 2;
+  }
+
+  char **table = calloc(cap, sizeof(char *));
+  if (table == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < capacity; i++) {
+    if (slots[i] != NULL && slots[i] != tombstone) {
+      insert(table, cap, slots[i]);
+    }
+  }
+
+  free(slots);
+  slots = table;
+  capacity = cap;
+  used = live;
+  return 0;
+}
+
+int name_claim(const char *name) {
+  int result = 1;
+  pthread_mutex_lock(&lock);
+
+  if ((used + 1) * 4 > capacity * 3 && rehash() < 0) {
+    result = -1;
+  } else if (lookup(name) != NULL) {
+    result = 0;
+  } else {
+    char *copy = strdup(name);
+    if (copy == NULL) {
+      result = -1;
+    } else {
+      insert(slots, capacity, copy);
+      used++;
+    }
+  }
+
+  pthread_mutex_unlock(&lock);
+  return result;
+}
+
+void name_release(const char *name) {
+  pthread_mutex_lock(&lock);
+  if (capacity > 0) {
+    char **slot = lookup(name);
+    if (slot != NULL) {
+      free(*slot);
+      *slot = tombstone;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
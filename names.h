@@ -0,0 +1,25 @@
+#ifndef NAMES_H
+#define NAMES_H
+
+/*
+ * names.h - registry of player names currently in use
+ *
+ * NGP requires a name to be unique among everyone connected. With the
+ * reactor mode that spans threads, so the table sits behind a mutex. It is
+ * only touched on OPEN and on disconnect, never on the move path.
+ */
+
+/*
+ * name_claim - reserve a name for a newly opened player
+ *
+ * Returns 1 if the name was free and is now reserved, 0 if someone else
+ * holds it, -1 if the table could not grow.
+ */
+int name_claim(const char *name);
+
+/*
+ * name_release - give a claimed name back
+ */
+void name_release(const char *name);
+
+#endif
@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <errno.h>
 #include <netdb.h>
 #include <signal.h>
@@ -11,8 +11,18 @@
 #include <fcntl.h>
 #include "decoder.h"
 #include "game.h"
+#include "lobby.h"
+#include "metrics.h"
+#include "pool.h"
+#include "server.h"
 
 #define QUEUE_SIZE 8
+// the event loop modes take connections in bursts, e.g. at tournament start
+#define BURST_QUEUE_SIZE 4096
+// how long a connection gets to send OPEN, unless -d says otherwise
+#define HANDSHAKE_MS 30000
+// sessions the event loop modes hold at once, unless -s says otherwise
+#define MAX_SESSIONS 4096
 
 volatile int active = 1;
 
@@ -83,7 +93,7 @@ int connect_inet(char *host, char *service) {
   return sock;
 }
 
-int open_listener(char *service, int queue_size) {
+int open_listener(char *service, int queue_size, int reuseport) {
   struct addrinfo hint, *info_list, *info;
   int error, sock;
 
@@ -108,6 +118,16 @@ int open_listener(char *service, int queue_size) {
     if (sock == -1)
       continue;
 
+    // let several sockets share the port, the kernel balances between them
+    if (reuseport) {
+      int one = 1;
+      error = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+      if (error) {
+        close(sock);
+        continue;
+      }
+    }
+
     // bind socket to requested port
     error = bind(sock, info->ai_addr, info->ai_addrlen);
     if (error) {
@@ -152,122 +172,218 @@ void read_buf(int sock, char *buf, int bufsize) {
   }
 }
 
-void handle_game(int p1_sock, int p2_sock) {
-  Player p1 = {p1_sock, "", 1, 0, malloc(BUFLEN), 0};
-  Player p2 = {p2_sock, "", 1, 0, malloc(BUFLEN), 0};
-  
-  // Wait for both players to open
-  while (!p1.opened || !p2.opened) {
-    if (!p1.opened) {
-      int p1_bytes = read(p1.sock, p1.buffer + p1.buffer_size, BUFLEN - p1.buffer_size);
-      if (p1_bytes <= 0) {
-        printf("Player 1 disconnected\n");
-        free(p1.buffer);
-        free(p2.buffer);
-        close(p1.sock);
-        close(p2.sock);
-        exit(EXIT_SUCCESS);
-      }
-      p1.buffer_size += p1_bytes;
-
-      int result = openGame(&p1);
-      if (result < 0) {
-        printf("P1 open err\n");
-        free(p1.buffer);
-        free(p2.buffer);
-        close(p1.sock);
-        close(p2.sock);
-        exit(EXIT_FAILURE);
-      }
+// plays a matched pair to the end and closes both sockets, in a forked
+// child or on a worker thread
+void play_match(Player *p1, Player *p2) {
+  // the lobby stopped counting them when it let go, with the shared segment
+  // every process's sessions add up
+  metrics_gauge(G_SESSIONS, 2);
+  playGame(p1, p2);
+  metrics_gauge(G_SESSIONS, -2);
+
+  ring_free(&p1->in);
+  ring_free(&p2->in);
+  close(p1->sock);
+  close(p2->sock);
+}
+
+static void usage(char *prog) {
+  fprintf(stderr,
+          "usage: %s [-m fork|prefork|epoll|reactor] [-n threads] "
+          "[-b epoll|uring] [-d handshake_ms] [-i idle_ms] [-t turn_ms] "
+          "[-c clock_ms] [-s max_sessions] [-H] [-a admin_port] "
+          "[-S stats_name] port\n",
+          prog);
+  exit(EXIT_FAILURE);
+}
+
+// serves the metrics on 127.0.0.1:@port if one was given
+static void start_admin(char *port) {
+  if (port == NULL) {
+    return;
+  }
+  int bound = metrics_serve(port);
+  if (bound < 0) {
+    exit(EXIT_FAILURE);
+  }
+  printf("Metrics on 127.0.0.1:%d\n", bound);
+}
+
+// one per cpu unless -n says otherwise
+static int default_count(int n) {
+  if (n <= 0) {
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n <= 0) {
+      n = 1;
     }
-    
-    if (!p2.opened) {
-      int p2_bytes = read(p2.sock, p2.buffer + p2.buffer_size, BUFLEN - p2.buffer_size);
-      if (p2_bytes <= 0) {
-        printf("Player 2 disconnected\n");
-        free(p1.buffer);
-        free(p2.buffer);
-        close(p1.sock);
-        close(p2.sock);
-        exit(EXIT_SUCCESS);
+  }
+  return n;
+}
+
+static int serve_reactors(char *service, int threads,
+                          const ServerConfig *cfg) {
+  threads = default_count(threads);
+
+  int *listeners = malloc(threads * sizeof(int));
+  if (listeners == NULL) {
+    perror("malloc");
+    return -1;
+  }
+
+  int opened = 0;
+  while (opened < threads) {
+    listeners[opened] = open_listener(service, BURST_QUEUE_SIZE, 1);
+    if (listeners[opened] < 0) {
+      break;
+    }
+    opened++;
+  }
+
+  int err = -1;
+  if (opened == threads) {
+    err = run_reactors(listeners, threads, cfg, &active);
+  }
+  for (int i = 0; i < opened; i++) {
+    close(listeners[i]);
+  }
+  free(listeners);
+  return err;
+}
+
+int main(int argc, char **argv) {
+  char *mode = "fork";
+  char *admin = NULL;
+  char *stats = NULL;
+  int threads = 0;
+  ServerConfig cfg = {BACKEND_EPOLL, HANDSHAKE_MS, 0, 0, 0, MAX_SESSIONS, 0};
+  int opt;
+  while ((opt = getopt(argc, argv, "m:n:b:d:i:t:c:s:Ha:S:")) != -1) {
+    switch (opt) {
+    case 'm':
+      mode = optarg;
+      break;
+    case 'n':
+      threads = atoi(optarg);
+      break;
+    case 'd':
+      cfg.handshake_ms = atoi(optarg);
+      break;
+    case 'i':
+      cfg.idle_ms = atoi(optarg);
+      break;
+    case 't':
+      cfg.turn_ms = atoi(optarg);
+      break;
+    case 'c':
+      cfg.clock_ms = atoi(optarg);
+      break;
+    case 's':
+      cfg.max_sessions = atoi(optarg);
+      if (cfg.max_sessions <= 0) {
+        usage(argv[0]);
       }
-      p2.buffer_size += p2_bytes;
-
-      int result = openGame(&p2);
-      if (result < 0) {
-        printf("P2 open err\n");
-        free(p1.buffer);
-        free(p2.buffer);
-        close(p1.sock);
-        close(p2.sock);
-        exit(EXIT_FAILURE);
+      break;
+    case 'H':
+      cfg.huge_pages = 1;
+      break;
+    case 'a':
+      admin = optarg;
+      break;
+    case 'S':
+      stats = optarg;
+      break;
+    case 'b':
+      if (strcmp(optarg, "uring") == 0) {
+        cfg.backend = BACKEND_URING;
+      } else if (strcmp(optarg, "epoll") != 0) {
+        usage(argv[0]);
       }
+      break;
+    default:
+      usage(argv[0]);
     }
   }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+  }
+  if (strcmp(mode, "fork") != 0 && strcmp(mode, "prefork") != 0 &&
+      strcmp(mode, "epoll") != 0 && strcmp(mode, "reactor") != 0) {
+    usage(argv[0]);
+  }
 
-  // both players opened
-
-  if (strcmp(p1.name, p2.name) == 0) {
-    printf("same name\n");
-    char buf[BUFLEN];
-    int len = encode_fail(buf, BUFLEN, ERR_ALREADY_PLAY);
-    write(p2.sock, buf, len);
-    free(p1.buffer);
-    free(p2.buffer);
-    close(p1.sock);
-    close(p2.sock);
+  // before any fork, so games played in children are counted in it too
+  if (metrics_init(stats) < 0) {
     exit(EXIT_FAILURE);
   }
+  install_handlers();
 
-  playGame(&p1, &p2);
-
-  free(p1.buffer);
-  free(p2.buffer);
-  close(p1.sock);
-  close(p2.sock);
-}
+  if (strcmp(mode, "reactor") == 0) {
+    start_admin(admin);
+    int err = serve_reactors(argv[optind], threads, &cfg);
+    fprintf(stderr, "Shutting down\n");
+    return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
 
-int main(int argc, char **argv) {
-  if (argc != 2) {
-    perror("no port number given");
+  // forked before the listener exists so workers never hold it
+  Pool pool = {0, NULL, NULL};
+  int prefork = strcmp(mode, "prefork") == 0;
+  if (prefork && pool_start(&pool, default_count(threads), play_match) < 0) {
     exit(EXIT_FAILURE);
   }
-  struct sockaddr_storage remote_host;
-  socklen_t remote_host_len;
+  start_admin(admin);
 
-  int listener = open_listener(argv[1], QUEUE_SIZE);
+  int listener = open_listener(argv[optind],
+                               strcmp(mode, "epoll") == 0 ? BURST_QUEUE_SIZE
+                                                          : QUEUE_SIZE,
+                               0);
   if (listener < 0) {
+    pool_stop(&pool);
     exit(EXIT_FAILURE);
   }
 
-  int waiting_sock = -1;
+  if (strcmp(mode, "epoll") == 0) {
+    int err = run_event_loop(listener, &cfg, &active);
+    fprintf(stderr, "Shutting down\n");
+    close(listener);
+    return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
 
-  while (active) {
-    remote_host_len = sizeof(remote_host);
-    int sock = accept(listener, (struct sockaddr *)&remote_host, &remote_host_len);
+  Lobby lobby;
+  if (lobby_init(&lobby, cfg.handshake_ms) < 0) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
 
-    if (sock < 0) {
-      perror("accept");
-      continue;
+  while (active) {
+    if (lobby_poll(&lobby, listener, -1) < 0) {
+      perror("poll");
+      break;
     }
-    if (waiting_sock == -1) {
-      waiting_sock = sock;
-      printf("Connected from %d\nWaiting for opponent\n", waiting_sock);
-    } else {
-      if (fork() == 0) {
+
+    Player p1, p2;
+    while (lobby_match(&lobby, &p1, &p2)) {
+      if (prefork) {
+        if (pool_dispatch(&pool, &p1, &p2) < 0) {
+          fprintf(stderr, "No worker for %d and %d\n", p1.sock, p2.sock);
+        }
+      } else if (fork() == 0) {
         close(listener);
-        printf("Starting game between %d and %d\n", waiting_sock, sock);
-        handle_game(waiting_sock, sock);
+        lobby_free(&lobby);
+        printf("Starting game between %d and %d\n", p1.sock, p2.sock);
+        play_match(&p1, &p2);
         exit(EXIT_SUCCESS);
       }
-      close(waiting_sock);
-      close(sock);
-      waiting_sock = -1;
+      ring_free(&p1.in);
+      ring_free(&p2.in);
+      close(p1.sock);
+      close(p2.sock);
     }
   }
 
+  lobby_free(&lobby);
   fprintf(stderr, "Shutting down\n");
   close(listener);
+  pool_stop(&pool);
 
   return EXIT_SUCCESS;
 }
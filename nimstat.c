@@ -0,0 +1,104 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+/*
+ * nimstat - live numbers from a running nimd, read from its shared segment
+ *
+ * nimd -S name keeps its metrics in a POSIX shared memory object. This maps
+ * it read-only and sums the shards the way the admin port does, nothing is
+ * asked of nimd and no syscall is made per read. Prints one line, or one
+ * every -i seconds with the move and game rates over the interval, or with
+ * -p everything in the Prometheus text format.
+ */
+
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s [-i seconds] [-n lines] [-p] stats_name\n",
+          prog);
+  exit(EXIT_FAILURE);
+}
+
+static double rate(uint64_t now, uint64_t then, unsigned long us) {
+  return us == 0 ? 0 : (double)(now - then) * 1000000 / us;
+}
+
+static void print_line(const MetricShard *m, const MetricShard *prev,
+                       unsigned long us) {
+  printf("%8lld %9lld %10llu %10llu %12llu", (long long)m->gauges[G_SESSIONS],
+         (long long)(m->counters[M_GAMES_STARTED] -
+                     m->counters[M_GAMES_FINISHED]),
+         (unsigned long long)m->counters[M_GAMES_STARTED],
+         (unsigned long long)m->counters[M_GAMES_FINISHED],
+         (unsigned long long)m->counters[M_MOVES]);
+  if (prev != NULL) {
+    printf(" %10.1f %9.1f",
+           rate(m->counters[M_MOVES], prev->counters[M_MOVES], us),
+           rate(m->counters[M_GAMES_FINISHED],
+                prev->counters[M_GAMES_FINISHED], us));
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  double interval = 0;
+  int lines = 0;
+  int prometheus = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "i:n:p")) != -1) {
+    switch (opt) {
+    case 'i':
+      interval = atof(optarg);
+      if (interval <= 0) {
+        usage(argv[0]);
+      }
+      break;
+    case 'n':
+      lines = atoi(optarg);
+      break;
+    case 'p':
+      prometheus = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+  }
+  if (metrics_attach(argv[optind]) < 0) {
+    return EXIT_FAILURE;
+  }
+
+  if (prometheus) {
+    return metrics_render(stdout) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  static MetricShard now, prev;
+  printf("%8s %9s %10s %10s %12s%s\n", "sessions", "in_flight", "started",
+         "finished", "moves", interval > 0 ? "    moves/s   games/s" : "");
+  metrics_sum(&now);
+  unsigned long at = metrics_now_us();
+  if (interval <= 0) {
+    print_line(&now, NULL, 0);
+    return EXIT_SUCCESS;
+  }
+
+  struct timespec ts;
+  ts.tv_sec = (time_t)interval;
+  ts.tv_nsec = (long)((interval - ts.tv_sec) * 1e9);
+  for (int n = 0; lines <= 0 || n < lines; n++) {
+    nanosleep(&ts, NULL);
+    memcpy(&prev, &now, sizeof(now));
+    unsigned long before = at;
+    metrics_sum(&now);
+    at = metrics_now_us();
+    print_line(&now, &prev, at - before);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,387 @@
+#define _GNU_SOURCE
+#include "pool.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// what a player brings along besides its socket. The message goes on
+// with the buffered input of both, buffer_size[0] then buffer_size[1]
+// bytes, so a pair that sent nothing ahead costs only this much
+typedef struct {
+  char name[2][73];
+  unsigned long since[2]; // CLOCK_MONOTONIC is the same in every process
+  int buffer_size[2];
+} Handoff;
+
+typedef struct {
+  GameFunc game;
+  int channel;
+  Player players[2];
+} Job;
+
+// sends both sockets of a pair in one message. Returns 0, or -1 with
+// errno set
+static int send_pair(int channel, Player *p1, Player *p2) {
+  Handoff h;
+  Player *players[2] = {p1, p2};
+  // the rings are mirrored, what is buffered is one run
+  struct iovec iov[3] = {{&h, sizeof(h)}};
+  size_t len = sizeof(h);
+  for (int i = 0; i < 2; i++) {
+    memcpy(h.name[i], players[i]->name, sizeof(h.name[i]));
+    h.since[i] = players[i]->since;
+    Ring *in = &players[i]->in;
+    h.buffer_size[i] = ring_used(in);
+    iov[i + 1].iov_base = ring_read_ptr(in);
+    iov[i + 1].iov_len = ring_used(in);
+    len += ring_used(in);
+  }
+  union {
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 3;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+  int socks[2] = {p1->sock, p2->sock};
+  memcpy(CMSG_DATA(cmsg), socks, sizeof(socks));
+
+  int n;
+  do {
+    n = sendmsg(channel, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  if (n >= 0 && (size_t)n != len) {
+    // a datagram goes whole or not at all, this is not expected
+    errno = EMSGSIZE;
+    return -1;
+  }
+  return n < 0 ? -1 : 0;
+}
+
+// returns 1 with both players filled in, 0 once the parent is gone
+static int recv_pair(int channel, Player players[2]) {
+  for (;;) {
+    struct {
+      Handoff h;
+      char buffer[2 * INLEN];
+    } m;
+    struct iovec iov = {&m, sizeof(m)};
+    union {
+      char buf[CMSG_SPACE(2 * sizeof(int))];
+      struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    int n = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return 0;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+      fprintf(stderr, "worker: pair without sockets\n");
+      continue;
+    }
+    int socks[2];
+    memcpy(socks, CMSG_DATA(cmsg), sizeof(socks));
+    Handoff *h = &m.h;
+    if (n < (int)sizeof(*h) || h->buffer_size[0] < 0 ||
+        h->buffer_size[1] < 0 || h->buffer_size[0] > INLEN ||
+        h->buffer_size[1] > INLEN ||
+        n != (int)sizeof(*h) + h->buffer_size[0] + h->buffer_size[1]) {
+      fprintf(stderr, "worker: short handoff\n");
+      close(socks[0]);
+      close(socks[1]);
+      continue;
+    }
+
+    for (int i = 0; i < 2; i++) {
+      Player *p = &players[i];
+      memset(p, 0, sizeof(*p));
+      p->sock = socks[i];
+      p->p_num = i + 1;
+      p->opened = 1;
+      memcpy(p->name, h->name[i], sizeof(p->name));
+      p->name[sizeof(p->name) - 1] = '\0';
+      p->since = h->since[i];
+      if (ring_init(&p->in, INLEN) == 0) {
+        ring_write(&p->in, m.buffer + (i == 0 ? 0 : h->buffer_size[0]),
+                   h->buffer_size[i]);
+      }
+    }
+    if (players[0].in.data == NULL || players[1].in.data == NULL) {
+      perror("ring_init");
+      for (int i = 0; i < 2; i++) {
+        close(players[i].sock);
+        ring_free(&players[i].in);
+      }
+      continue;
+    }
+    return 1;
+  }
+}
+
+static void *run_job(void *arg) {
+  Job *job = arg;
+  job->game(&job->players[0], &job->players[1]);
+
+  // tell the parent this worker has one game less
+  char done = 'd';
+  if (write(job->channel, &done, 1) < 0) {
+    perror("write");
+  }
+  free(job);
+  return NULL;
+}
+
+static void worker_main(int channel, GameFunc game) {
+  // shutdown signals end the worker, and a player hanging up must not
+  // take the other games of this worker down with it
+  signal(SIGINT, SIG_DFL);
+  signal(SIGHUP, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGPIPE, SIG_IGN);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  Player players[2];
+  while (recv_pair(channel, players)) {
+    Job *job = malloc(sizeof(Job));
+    if (job == NULL) {
+      perror("malloc");
+      for (int i = 0; i < 2; i++) {
+        close(players[i].sock);
+        ring_free(&players[i].in);
+      }
+      continue;
+    }
+    job->game = game;
+    job->channel = channel;
+    job->players[0] = players[0];
+    job->players[1] = players[1];
+
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, run_job, job) != 0) {
+      // run it here rather than drop it
+      run_job(job);
+    }
+  }
+
+  // the parent closed the channel, finish the running games and go
+  pthread_attr_destroy(&attr);
+  pthread_exit(NULL);
+}
+
+static int spawn(Pool *pool, int i) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+    perror("socketpair");
+    return -1;
+  }
+
+  int pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    // a worker keeps only its own channel. Other workers must see EOF
+    // when the parent goes, and one forked by replace() would otherwise
+    // hold the listener and every player the parent had, keeping their
+    // connections up after the games that own them close them
+    if (sv[1] > 3) {
+      close_range(3, sv[1] - 1, 0);
+    }
+    close_range(sv[1] + 1, ~0U, 0);
+    worker_main(sv[1], pool->game);
+    exit(EXIT_SUCCESS);
+  }
+
+  close(sv[1]);
+  fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+  fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+  pool->workers[i].pid = pid;
+  pool->workers[i].channel = sv[0];
+  pool->workers[i].games = 0;
+  return 0;
+}
+
+// a worker died, its games went with it
+static void replace(Pool *pool, int i) {
+  Worker *w = &pool->workers[i];
+  fprintf(stderr, "worker %d exited with %d games, restarting\n", w->pid,
+          w->games);
+  close(w->channel);
+  w->channel = -1;
+  waitpid(w->pid, NULL, WNOHANG);
+  spawn(pool, i);
+}
+
+// picks up done reports and dead workers
+static void collect(Pool *pool) {
+  for (int i = 0; i < pool->count; i++) {
+    Worker *w = &pool->workers[i];
+    if (w->channel < 0) {
+      spawn(pool, i);
+      continue;
+    }
+    for (;;) {
+      char done;
+      int n = read(w->channel, &done, 1);
+      if (n > 0) {
+        w->games--;
+        continue;
+      }
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      // nothing to read is the usual case, only a closed channel means
+      // the worker is gone
+      if (n == 0 || errno == ECONNRESET) {
+        replace(pool, i);
+      }
+      break;
+    }
+  }
+}
+
+int pool_start(Pool *pool, int count, GameFunc game) {
+  pool->count = count;
+  pool->game = game;
+  pool->workers = malloc(count * sizeof(Worker));
+  if (pool->workers == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  for (int i = 0; i < count; i++) {
+    pool->workers[i].pid = -1;
+    pool->workers[i].channel = -1;
+    pool->workers[i].games = 0;
+    pool->workers[i].full = 0;
+  }
+
+  int started = 0;
+  for (int i = 0; i < count; i++) {
+    if (spawn(pool, i) == 0) {
+      started++;
+    }
+  }
+  if (started == 0) {
+    free(pool->workers);
+    pool->workers = NULL;
+    return -1;
+  }
+  printf("Started %d workers\n", started);
+  return 0;
+}
+
+// waits until some worker's channel has room again. Returns 1 if one
+// does, 0 on timeout
+static int wait_writable(Pool *pool) {
+  struct pollfd *fds = malloc(pool->count * sizeof(struct pollfd));
+  if (fds == NULL) {
+    return 0;
+  }
+  for (int i = 0; i < pool->count; i++) {
+    fds[i].fd = pool->workers[i].channel;
+    fds[i].events = POLLOUT;
+  }
+  int n;
+  do {
+    n = poll(fds, pool->count, DISPATCH_WAIT_MS);
+  } while (n < 0 && errno == EINTR);
+  free(fds);
+  return n > 0;
+}
+
+int pool_dispatch(Pool *pool, Player *p1, Player *p2) {
+  // a full channel only means that worker is behind on its games: the
+  // pair goes to the next least loaded one, and if every one is full
+  // the parent waits for one of them once before giving up
+  for (int pass = 0; pass < 2; pass++) {
+    collect(pool);
+    for (int i = 0; i < pool->count; i++) {
+      pool->workers[i].full = 0;
+    }
+
+    for (;;) {
+      int best = -1;
+      for (int i = 0; i < pool->count; i++) {
+        Worker *w = &pool->workers[i];
+        if (w->channel >= 0 && !w->full &&
+            (best < 0 || w->games < pool->workers[best].games)) {
+          best = i;
+        }
+      }
+      if (best < 0) {
+        break;
+      }
+
+      Worker *w = &pool->workers[best];
+      if (send_pair(w->channel, p1, p2) == 0) {
+        w->games++;
+        printf("Starting game between %d and %d on worker %d\n", p1->sock,
+               p2->sock, w->pid);
+        return 0;
+      }
+      if (errno == EPIPE || errno == ECONNRESET) {
+        replace(pool, best);
+      } else {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          perror("sendmsg");
+        }
+        w->full = 1;
+      }
+    }
+
+    if (pass == 0 && !wait_writable(pool)) {
+      break;
+    }
+  }
+  return -1;
+}
+
+void pool_stop(Pool *pool) {
+  for (int i = 0; i < pool->count; i++) {
+    if (pool->workers[i].channel >= 0) {
+      close(pool->workers[i].channel);
+    }
+  }
+  free(pool->workers);
+  pool->workers = NULL;
+  pool->count = 0;
+}
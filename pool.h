@@ -0,0 +1,62 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "game.h"
+
+/*
+ * pool.h - pre-forked worker processes for the fork server
+ *
+ * Instead of forking a child per game in the accept loop, the workers are
+ * forked once at startup. The parent matches players in its lobby and
+ * passes both sockets to a worker with SCM_RIGHTS over a Unix socket,
+ * along with the names and whatever input was already buffered. A
+ * worker runs each game it receives on its own thread and reports back
+ * when it is done, so the parent always knows how many games every worker
+ * has and dispatches to the least loaded one.
+ *
+ * A crash still only takes down the games of one worker. The parent
+ * notices the closed channel and forks a replacement.
+ */
+
+// how long pool_dispatch() waits for a backed up worker before giving up
+#define DISPATCH_WAIT_MS 1000
+
+// plays a matched pair, then closes both sockets and frees the buffers
+typedef void (*GameFunc)(Player *p1, Player *p2);
+
+typedef struct {
+  int pid;
+  int channel; // parent end of the Unix socket
+  int games;   // handed over and not reported done yet
+  int full;    // its channel took no more during this dispatch
+} Worker;
+
+typedef struct {
+  int count;
+  Worker *workers;
+  GameFunc game;
+} Pool;
+
+/*
+ * pool_start - fork @count workers that run @game for every pair
+ *
+ * Workers close every descriptor they inherit but their channel, so the
+ * listener and the lobby's players are never held open by one.
+ * Returns 0 on success, -1 if no worker could be started.
+ */
+int pool_start(Pool *pool, int count, GameFunc game);
+
+/*
+ * pool_dispatch - hand a matched pair to the least loaded worker
+ *
+ * The caller keeps its own copies of the players and should close and
+ * free them afterwards. A worker whose channel is full is passed over,
+ * and if all of them are the call waits up to DISPATCH_WAIT_MS for one.
+ * Returns 0 on success, -1 if no worker took them.
+ */
+int pool_dispatch(Pool *pool, Player *p1, Player *p2);
+
+// closes every channel, workers exit once their running games finish
+void pool_stop(Pool *pool);
+
+#endif
@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+#include "ring.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static unsigned page_round(unsigned size) {
+  long page = sysconf(_SC_PAGESIZE);
+  if (page <= 0) {
+    page = 4096;
+  }
+  return (size + page - 1) / page * page;
+}
+
+// address space for @len bytes that nothing is mapped in yet
+static char *reserve(size_t len) {
+  char *at = mmap(NULL, len, PROT_NONE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return at == MAP_FAILED ? NULL : at;
+}
+
+/* maps @count mirrored rings of @size bytes from a new memfd at @at, which
+ * is reserved for 2 * @count * @size bytes. Returns 0, or -1 with errno
+ * set and the reservation as it was */
+static int map_rings(char *at, unsigned size, unsigned count) {
+  size_t len = (size_t)size * count;
+  int fd = memfd_create("ring", MFD_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  if (ftruncate(fd, len) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  // the same pages in both halves of each ring
+  for (size_t half = 0; half < 2 * (size_t)count; half++) {
+    if (mmap(at + half * size, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, half / 2 * size) == MAP_FAILED) {
+      int err = errno;
+      mmap(at, 2 * len, PROT_NONE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+      close(fd);
+      errno = err;
+      return -1;
+    }
+  }
+  // the mappings keep the memory alive
+  close(fd);
+  return 0;
+}
+
+int ring_init(Ring *r, unsigned size) {
+  memset(r, 0, sizeof(*r));
+  size = page_round(size);
+  char *base = reserve(2 * (size_t)size);
+  if (base == NULL) {
+    return -1;
+  }
+  if (map_rings(base, size, 1) < 0) {
+    int err = errno;
+    munmap(base, 2 * (size_t)size);
+    errno = err;
+    return -1;
+  }
+  r->data = base;
+  r->size = size;
+  return 0;
+}
+
+void ring_free(Ring *r) {
+  if (r->data != NULL) {
+    munmap(r->data, 2 * (size_t)r->size);
+  }
+  memset(r, 0, sizeof(*r));
+}
+
+unsigned ring_write(Ring *r, const char *data, unsigned len) {
+  unsigned room = ring_space(r);
+  if (len > room) {
+    len = room;
+  }
+  memcpy(ring_write_ptr(r), data, len);
+  ring_produce(r, len);
+  return len;
+}
+
+int ringset_init(RingSet *rs, unsigned size, unsigned count) {
+  memset(rs, 0, sizeof(*rs));
+  size = page_round(size);
+  rs->free = malloc(count * sizeof(unsigned));
+  if (rs->free == NULL) {
+    return -1;
+  }
+  rs->base = reserve(2 * (size_t)size * count);
+  if (rs->base == NULL) {
+    free(rs->free);
+    rs->free = NULL;
+    return -1;
+  }
+  pthread_mutex_init(&rs->lock, NULL);
+  rs->size = size;
+  rs->count = count;
+  return 0;
+}
+
+int ringset_get(RingSet *rs, Ring *r) {
+  unsigned i;
+  pthread_mutex_lock(&rs->lock);
+  if (rs->nfree > 0) {
+    i = rs->free[--rs->nfree];
+  } else {
+    if (rs->fresh == rs->mapped) {
+      unsigned n = rs->count - rs->mapped;
+      if (n > RINGSET_CHUNK) {
+        n = RINGSET_CHUNK;
+      }
+      if (n == 0) {
+        pthread_mutex_unlock(&rs->lock);
+        errno = ENOBUFS;
+        return -1;
+      }
+      if (map_rings(rs->base + 2 * (size_t)rs->mapped * rs->size, rs->size,
+                    n) < 0) {
+        pthread_mutex_unlock(&rs->lock);
+        return -1;
+      }
+      rs->mapped += n;
+    }
+    i = rs->fresh++;
+  }
+  pthread_mutex_unlock(&rs->lock);
+
+  r->data = rs->base + 2 * (size_t)i * rs->size;
+  r->size = rs->size;
+  r->head = 0;
+  r->used = 0;
+  return 0;
+}
+
+void ringset_put(RingSet *rs, Ring *r) {
+  if (r->data == NULL) {
+    return;
+  }
+  // both halves are the same pages, removing them from one is enough
+  madvise(r->data, rs->size, MADV_REMOVE);
+  unsigned i = (r->data - rs->base) / (2 * (size_t)rs->size);
+  memset(r, 0, sizeof(*r));
+
+  pthread_mutex_lock(&rs->lock);
+  rs->free[rs->nfree++] = i;
+  pthread_mutex_unlock(&rs->lock);
+}
+
+void ringset_free(RingSet *rs) {
+  if (rs->base != NULL) {
+    munmap(rs->base, 2 * (size_t)rs->size * rs->count);
+    pthread_mutex_destroy(&rs->lock);
+  }
+  free(rs->free);
+  memset(rs, 0, sizeof(*rs));
+}
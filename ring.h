@@ -0,0 +1,101 @@
+#ifndef RING_H
+#define RING_H
+
+#include <pthread.h>
+
+/*
+ * ring.h - mirrored input ring
+ *
+ * Connection input is read into a ring buffer whose memory is mapped
+ * twice, back to back, so data[i] and data[i + size] are the same byte.
+ * Whatever is buffered is therefore always one contiguous run starting at
+ * ring_read_ptr(), even when it wraps past the end, and decode_message()
+ * can parse it in place. Consuming a frame only moves the head; nothing
+ * is ever shifted down.
+ *
+ * The free space is contiguous the same way, so one read() can fill all
+ * of it.
+ *
+ * A frame decoded from the ring stays valid until the ring is written to
+ * again, consuming it does not overwrite it.
+ */
+
+typedef struct {
+  char *data;    // size bytes, mapped twice
+  unsigned size; // a multiple of the page size
+  unsigned head; // offset of the first buffered byte, < size
+  unsigned used; // bytes buffered
+} Ring;
+
+// @size is rounded up to whole pages. Returns 0, or -1 with errno set
+int ring_init(Ring *r, unsigned size);
+
+// safe on a ring that failed to init or was already freed
+void ring_free(Ring *r);
+
+static inline char *ring_read_ptr(const Ring *r) { return r->data + r->head; }
+
+static inline unsigned ring_used(const Ring *r) { return r->used; }
+
+static inline char *ring_write_ptr(const Ring *r) {
+  return r->data + r->head + r->used;
+}
+
+static inline unsigned ring_space(const Ring *r) { return r->size - r->used; }
+
+// marks @n bytes written at ring_write_ptr() as buffered
+static inline void ring_produce(Ring *r, unsigned n) { r->used += n; }
+
+// drops the first @n buffered bytes
+static inline void ring_consume(Ring *r, unsigned n) {
+  r->head += n;
+  if (r->head >= r->size) {
+    r->head -= r->size;
+  }
+  r->used -= n;
+}
+
+// copies in as much of @data as fits, returns how much that was
+unsigned ring_write(Ring *r, const char *data, unsigned len);
+
+/*
+ * Rings for a pool of connections: room for @count rings of @size bytes,
+ * each mirrored like a ring_init() one, handed out and taken back without
+ * a system call once they have been mapped.
+ *
+ * Every mirrored ring takes a mapping of its own, and a process may only
+ * have vm.max_map_count (65530 by default) of those. So the set reserves
+ * address space for all of them but maps rings RINGSET_CHUNK at a time, as
+ * they are first wanted, and a connection should only hold one while it
+ * has input buffered or is in a game. A set can then be far larger than
+ * the mapping limit as long as most of its connections sit idle.
+ */
+#define RINGSET_CHUNK 64 // rings mapped from one memfd at a time
+
+typedef struct {
+  pthread_mutex_t lock;
+  char *base;     // ring i is at base + 2 * i * size
+  unsigned size;  // of each ring, a multiple of the page size
+  unsigned count;
+  unsigned mapped; // rings below this index are mapped
+  unsigned fresh;  // mapped rings at and past this one were never handed out
+  unsigned *free;  // rings handed back, a stack of indices
+  unsigned nfree;
+} RingSet;
+
+// Returns 0, or -1 with errno set
+int ringset_init(RingSet *rs, unsigned size, unsigned count);
+
+// points @r at an empty ring of the set, mapping more if need be. Returns
+// 0, or -1 with errno set. The ring still belongs to the set, do not
+// ring_free() it
+int ringset_get(RingSet *rs, Ring *r);
+
+// hands @r back, its memory is given back to the system too and @r is
+// left empty with no data. Any thread may put a ring back
+void ringset_put(RingSet *rs, Ring *r);
+
+// safe on a set that failed to init or was already freed
+void ringset_free(RingSet *rs);
+
+#endif
@@ -0,0 +1,1351 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include "decoder.h"
+#include "game.h"
+#include "metrics.h"
+#include "names.h"
+#include "slab.h"
+#include "timer.h"
+#include "uring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 1024 // provided read buffers per shard, power of two
+
+enum { STATE_HANDSHAKE, STATE_WAITING, STATE_PLAYING, STATE_OVER };
+
+// what an io_uring completion was for, kept in the low bits of user_data
+enum { OP_ACCEPT = 1, OP_WAKE, OP_RECV, OP_SEND, OP_CANCEL };
+#define OP_MASK 7
+
+typedef struct Server Server;
+
+// kept for every connection, however idle, so it holds no buffers: the
+// output queue comes from the pool while frames are queued, and the input
+// ring only while there is input or the session is in a game (in.data is
+// NULL otherwise)
+typedef struct Session {
+  Player player;
+  unsigned state : 2;
+  unsigned claimed : 1;     // holds its name in the registry
+  unsigned dirty : 1;
+  // io_uring: operations still in flight against this session
+  unsigned recv_armed : 1;
+  unsigned cancelling : 1;
+  unsigned events : 8;      // epoll: what the socket is registered for
+  int sending;
+  Game *game;  // shared with the opponent, owned by player 1
+  struct Session *opponent;
+  struct Session **list; // sessions or limbo, whichever it is on
+  struct Session *prev;
+  struct Session *next;
+  struct Session *next_waiting; // matchmaking queue FIFO, or a shard inbox
+  struct Session *next_dead;    // closed, freed after the current batch
+  struct Session *next_dirty;   // has output to flush this iteration
+  Server *moving_to; // handed to this shard once nothing is in flight
+  Timer timer;       // whichever deadline the current state has
+  unsigned long clock_mark; // when the clock was last charged
+  struct msghdr send_hdr;   // io_uring: the send in flight
+  struct iovec send_iov[2];
+} Session;
+
+// every session, game and input ring comes from here, reserved for
+// cfg->max_sessions at startup. The slabs take their own locks, as a
+// session may be freed by another shard than the one that took it
+typedef struct {
+  Slab sessions;
+  Slab games;
+  Slab outs;     // output queues, held only while frames are queued
+  RingSet rings; // input rings, mapped as they are first wanted
+} SessionPool;
+
+// glue between reactor shards. Each shard owns its sessions outright, the
+// only shared state is which shard has a lone waiter and the inboxes used
+// to hand a session from one shard to another, all under one lock that is
+// taken at most once per OPEN.
+typedef struct {
+  pthread_mutex_t lock;
+  int lobby; // shard holding a lone waiter, -1 if none
+  int count;
+  Server *shards;
+  SessionPool pool;
+} ShardSet;
+
+struct Server {
+  int id;
+  ShardSet *set;
+  const ServerConfig *cfg;
+  TimerWheel wheel;
+  unsigned long now;    // ms, taken once per loop iteration
+  unsigned long now_us; // the same moment in us, for the metrics
+  int epfd;
+  int uring; // using ring below instead of epfd
+  Uring ring;
+  int listener;
+  int wake_fd;    // eventfd, signalled on handoff and shutdown
+  Session *inbox; // handed over by other shards, under set->lock
+  Session *sessions;
+  Session *limbo; // io_uring: closed or moving, waiting on the kernel
+  Session *wait_head;
+  Session *wait_tail;
+  Session *dead;
+  Session *dirty;
+  volatile int *running;
+};
+
+static int process_input(Server *srv, Session *s);
+static void settle(Server *srv, Session *s);
+
+static int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) {
+    return -1;
+  }
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// one clock read per loop iteration serves the timers and the metrics
+static void take_time(Server *srv) {
+  srv->now_us = metrics_now_us();
+  srv->now = srv->now_us / 1000;
+}
+
+static uint64_t op_data(Session *s, int op) {
+  return (uint64_t)(uintptr_t)s | op;
+}
+
+static void list_add(Session **head, Session *s) {
+  s->list = head;
+  s->prev = NULL;
+  s->next = *head;
+  if (*head != NULL) {
+    (*head)->prev = s;
+  }
+  *head = s;
+}
+
+static void list_del(Session *s) {
+  if (s->list == NULL) {
+    return;
+  }
+  if (s->prev != NULL) {
+    s->prev->next = s->next;
+  } else {
+    *s->list = s->next;
+  }
+  if (s->next != NULL) {
+    s->next->prev = s->prev;
+  }
+  s->list = NULL;
+  s->prev = NULL;
+  s->next = NULL;
+}
+
+// output was queued on the session, flush it at the end of this iteration
+static void mark_dirty(Server *srv, Session *s) {
+  if (s == NULL || s->dirty) {
+    return;
+  }
+  s->dirty = 1;
+  s->next_dirty = srv->dirty;
+  srv->dirty = s;
+}
+
+// a session and its opponent are the only ones an event can produce
+// output for
+static void touch(Server *srv, Session *s) {
+  mark_dirty(srv, s);
+  mark_dirty(srv, s->opponent);
+}
+
+// arms the session's timer @ms from now, or cancels it for 0
+static void set_timer(Server *srv, Session *s, int ms) {
+  if (ms > 0) {
+    timer_add(&srv->wheel, &s->timer, srv->now + ms);
+  } else {
+    timer_cancel(&srv->wheel, &s->timer);
+  }
+}
+
+// the session is to move: the turn limit and its clock both start now
+static void begin_turn(Server *srv, Session *s) {
+  Game *g = s->game;
+  int ms = srv->cfg->turn_ms;
+  if (g->clocked) {
+    int left = g->clock[s->player.p_num - 1];
+    if (ms <= 0 || left < ms) {
+      // 0 left has to expire right away, not mean no limit
+      ms = left > 0 ? left : 1;
+    }
+  }
+  s->clock_mark = srv->now;
+  set_timer(srv, s, ms);
+}
+
+// takes the time since the last charge off the player's clock
+static void charge_clock(Server *srv, Session *s) {
+  Game *g = s->game;
+  if (!g->clocked) {
+    return;
+  }
+  int *left = &g->clock[s->player.p_num - 1];
+  unsigned long used = srv->now - s->clock_mark;
+  *left = used >= (unsigned long)*left ? 0 : *left - (int)used;
+  s->clock_mark = srv->now;
+}
+
+static int arm_recv(Server *srv, Session *s) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&srv->ring);
+  if (sqe == NULL) {
+    return -1;
+  }
+  uring_prep_recv_multishot(sqe, s->player.sock, op_data(s, OP_RECV));
+  s->recv_armed = 1;
+  return 0;
+}
+
+// registers the session with this shard's event source and session list
+static int attach(Server *srv, Session *s) {
+  if (srv->uring) {
+    if (arm_recv(srv, s) < 0) {
+      return -1;
+    }
+  } else {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    s->events = EPOLLIN;
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, s->player.sock, &ev) < 0) {
+      perror("epoll_ctl");
+      return -1;
+    }
+  }
+  list_add(&srv->sessions, s);
+  return 0;
+}
+
+static Session *session_new(Server *srv, int sock) {
+  SessionPool *pool = &srv->set->pool;
+  Session *s = slab_alloc(&pool->sessions);
+  if (s == NULL) {
+    printf("Session limit reached, refusing %d\n", sock);
+    metrics_count(M_REFUSED);
+    return NULL;
+  }
+  s->player.sock = sock;
+  s->player.outs = &pool->outs;
+  s->player.since = srv->now_us;
+  s->state = STATE_HANDSHAKE;
+  timer_init(&s->timer, s);
+
+  if (attach(srv, s) < 0) {
+    slab_free(&pool->sessions, s);
+    return NULL;
+  }
+  set_timer(srv, s, srv->cfg->handshake_ms);
+  metrics_gauge(G_SESSIONS, 1);
+  return s;
+}
+
+// gives the session an input ring before a read. Returns 0, or -1 if the
+// pool could not map one
+static int hold_input(Server *srv, Session *s) {
+  if (s->player.in.data != NULL) {
+    return 0;
+  }
+  if (ringset_get(&srv->set->pool.rings, &s->player.in) < 0) {
+    perror("input ring");
+    return -1;
+  }
+  return 0;
+}
+
+// hands the session's input ring back to the pool, whatever is in it
+static void release_input(Server *srv, Session *s) {
+  if (s->player.in.data != NULL) {
+    ringset_put(&srv->set->pool.rings, &s->player.in);
+  }
+}
+
+// called after input was handled: a session in the matchmaking queue with
+// nothing buffered does not need a ring until it is sent something. A
+// player whose turn has passed keeps its ring until INPUT_REST_MS later,
+// see expire(), so taking turns costs no system call.
+static void rest_input(Server *srv, Session *s) {
+  if (s->state == STATE_WAITING && ring_used(&s->player.in) == 0 &&
+      s->moving_to == NULL) {
+    release_input(srv, s);
+  }
+}
+
+// returns everything the session holds to the pool
+static void session_put(Server *srv, Session *s) {
+  metrics_gauge(G_SESSIONS, -1);
+  player_discard(&s->player);
+  release_input(srv, s);
+  slab_free(&srv->set->pool.sessions, s);
+}
+
+static void unqueue(Server *srv, Session *s) {
+  Session **link = &srv->wait_head;
+  Session *prev = NULL;
+  while (*link != NULL && *link != s) {
+    prev = *link;
+    link = &(*link)->next_waiting;
+  }
+  if (*link == NULL) {
+    return;
+  }
+  *link = s->next_waiting;
+  if (srv->wait_tail == s) {
+    srv->wait_tail = prev;
+  }
+  s->next_waiting = NULL;
+
+  if (srv->wait_head == NULL && srv->set->count > 1) {
+    pthread_mutex_lock(&srv->set->lock);
+    if (srv->set->lobby == srv->id) {
+      srv->set->lobby = -1;
+    }
+    pthread_mutex_unlock(&srv->set->lock);
+  }
+}
+
+// writes as much pending output as the socket takes. Input is watched
+// unless the session is paused, EPOLLOUT only while output is left over
+static void flush_epoll(Server *srv, Session *s) {
+  Player *p = &s->player;
+  if (player_flush(p) < 0) {
+    // the read side notices the broken connection
+    player_discard(p);
+  }
+
+  unsigned events =
+      (p->paused ? 0 : EPOLLIN) | (p->out_size > 0 ? EPOLLOUT : 0);
+  if (events != s->events && s->state != STATE_OVER) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = s;
+    epoll_ctl(srv->epfd, EPOLL_CTL_MOD, p->sock, &ev);
+    s->events = events;
+  }
+}
+
+// queues one sendmsg() of everything pending, at most one in flight at a
+// time so completions consume the queue in order
+static void flush_uring(Server *srv, Session *s) {
+  Player *p = &s->player;
+  if (s->sending > 0 || p->out_size == 0) {
+    return;
+  }
+  struct io_uring_sqe *sqe = uring_get_sqe(&srv->ring);
+  if (sqe == NULL) {
+    mark_dirty(srv, s); // ring is full, try again next iteration
+    return;
+  }
+  memset(&s->send_hdr, 0, sizeof(s->send_hdr));
+  s->send_hdr.msg_iov = s->send_iov;
+  s->send_hdr.msg_iovlen = player_pending(p, s->send_iov);
+  uring_prep_sendmsg(sqe, p->sock, &s->send_hdr, op_data(s, OP_SEND));
+  s->sending = p->out_size;
+}
+
+// closes the socket (after a last attempt to get pending output out), the
+// memory is released once the current batch of events has been handled so
+// stale events can still be skipped
+static void session_close(Server *srv, Session *s) {
+  if (s->state == STATE_OVER) {
+    return;
+  }
+  if (s->state == STATE_WAITING) {
+    unqueue(srv, s);
+  }
+  s->state = STATE_OVER;
+  timer_cancel(&srv->wheel, &s->timer);
+  if (s->claimed) {
+    name_release(s->player.name);
+    s->claimed = 0;
+  }
+  list_del(s);
+
+  if (srv->uring) {
+    list_add(&srv->limbo, s);
+    settle(srv, s);
+    return;
+  }
+
+  flush_epoll(srv, s);
+  close(s->player.sock);
+  s->next_dead = srv->dead;
+  srv->dead = s;
+}
+
+static void session_free(Server *srv, Session *s) {
+  // the game is owned by player 1 but outlives whichever closes first
+  if (s->game != NULL &&
+      (s->opponent == NULL || s->opponent->state == STATE_OVER)) {
+    if (s->opponent != NULL) {
+      s->opponent->game = NULL;
+    }
+    slab_free(&srv->set->pool.games, s->game);
+  }
+  if (s->opponent != NULL) {
+    s->opponent->opponent = NULL;
+  }
+  session_put(srv, s);
+}
+
+static void free_dead(Server *srv) {
+  while (srv->dead != NULL) {
+    Session *s = srv->dead;
+    srv->dead = s->next_dead;
+    session_free(srv, s);
+  }
+}
+
+// ends the game both players are in, closing both connections
+static void end_game(Server *srv, Session *s) {
+  Session *opp = s->opponent;
+  session_close(srv, s);
+  if (opp != NULL) {
+    session_close(srv, opp);
+  }
+}
+
+// the session went away mid-game, its opponent wins by forfeit
+static void forfeit(Server *srv, Session *s) {
+  Session *opp = s->opponent;
+  if (opp != NULL && opp->state == STATE_PLAYING) {
+    printf("Player %d disconnected\n", s->player.p_num);
+    send_over(s->game, &opp->player, NULL, opp->player.p_num, 1);
+  }
+  end_game(srv, s);
+}
+
+// the peer hung up or broke the protocol
+static void disconnect(Server *srv, Session *s) {
+  if (s->state == STATE_PLAYING) {
+    forfeit(srv, s);
+  } else {
+    printf("Connection %d closed\n", s->player.sock);
+    session_close(srv, s);
+  }
+}
+
+static int try_match(Server *srv) {
+  if (srv->wait_head == NULL || srv->wait_head->next_waiting == NULL) {
+    return 0;
+  }
+
+  Session *s1 = srv->wait_head;
+  Session *s2 = s1->next_waiting;
+  srv->wait_head = s2->next_waiting;
+  if (srv->wait_head == NULL) {
+    srv->wait_tail = NULL;
+  }
+  s1->next_waiting = NULL;
+  s2->next_waiting = NULL;
+
+  Game *g = slab_alloc(&srv->set->pool.games);
+  if (g == NULL) {
+    printf("Game limit reached\n");
+    session_close(srv, s1);
+    session_close(srv, s2);
+    return 1;
+  }
+
+  s1->game = g;
+  s2->game = g;
+  s1->opponent = s2;
+  s2->opponent = s1;
+  s1->player.p_num = 1;
+  s2->player.p_num = 2;
+  s1->state = STATE_PLAYING;
+  s2->state = STATE_PLAYING;
+
+  printf("Starting game between %d and %d\n", s1->player.sock,
+         s2->player.sock);
+  start_game(g, &s1->player, &s2->player, srv->cfg->clock_ms);
+  begin_turn(srv, s1);
+  set_timer(srv, s2, INPUT_REST_MS);
+  touch(srv, s1);
+  return 1;
+}
+
+// has shard @to drain its inbox
+static void wake(Server *to) {
+  uint64_t one = 1;
+  if (write(to->wake_fd, &one, sizeof(one)) < 0) {
+    perror("write");
+  }
+}
+
+static void push_inbox(Server *srv, Session *s, Server *to) {
+  pthread_mutex_lock(&srv->set->lock);
+  s->next_waiting = to->inbox;
+  to->inbox = s;
+  pthread_mutex_unlock(&srv->set->lock);
+  wake(to);
+}
+
+// moves a waiting session to another shard. With epoll it goes right away,
+// with io_uring once its pending output is sent and its read cancelled, so
+// no completion for it can land on this shard after the move
+static void handoff(Server *srv, Session *s, Server *to) {
+  list_del(s);
+  // the other shard has its own wheel
+  timer_cancel(&srv->wheel, &s->timer);
+  if (srv->uring) {
+    s->moving_to = to;
+    list_add(&srv->limbo, s);
+    settle(srv, s);
+    return;
+  }
+  epoll_ctl(srv->epfd, EPOLL_CTL_DEL, s->player.sock, NULL);
+  push_inbox(srv, s, to);
+}
+
+// io_uring only: drives a closed or moving session towards having nothing
+// in flight, then closes it or hands it over
+static void settle(Server *srv, Session *s) {
+  if (s->list != &srv->limbo || s->sending > 0) {
+    return;
+  }
+  if (s->player.out_size > 0) {
+    flush_uring(srv, s);
+    return;
+  }
+  if (s->recv_armed) {
+    if (!s->cancelling) {
+      struct io_uring_sqe *sqe = uring_get_sqe(&srv->ring);
+      if (sqe == NULL) {
+        mark_dirty(srv, s);
+        return;
+      }
+      uring_prep_cancel(sqe, op_data(s, OP_RECV), op_data(NULL, OP_CANCEL));
+      s->cancelling = 1;
+    }
+    return;
+  }
+
+  list_del(s);
+  if (s->state == STATE_OVER) {
+    close(s->player.sock);
+    s->next_dead = srv->dead;
+    srv->dead = s;
+    if (s->moving_to != NULL) {
+      // closed on its way over, the shard it was going to has to offer
+      // its own waiter again
+      wake(s->moving_to);
+      s->moving_to = NULL;
+    }
+  } else {
+    Server *to = s->moving_to;
+    s->moving_to = NULL;
+    s->cancelling = 0;
+    push_inbox(srv, s, to);
+  }
+}
+
+// a lone waiter has to be able to meet a lone waiter on another shard,
+// whichever of them arrives second travels to the first. Call whenever
+// the shard's queue may have changed. Returns 1 if its waiter left
+static int offer_waiter(Server *srv) {
+  ShardSet *set = srv->set;
+  if (set->count == 1) {
+    return 0;
+  }
+  int target = -1;
+  pthread_mutex_lock(&set->lock);
+  if (srv->wait_head == NULL) {
+    if (set->lobby == srv->id) {
+      set->lobby = -1;
+    }
+  } else if (set->lobby == -1 || set->lobby == srv->id) {
+    set->lobby = srv->id;
+  } else {
+    target = set->lobby;
+    set->lobby = -1;
+  }
+  pthread_mutex_unlock(&set->lock);
+
+  if (target < 0) {
+    return 0;
+  }
+  Session *s = srv->wait_head;
+  srv->wait_head = NULL;
+  srv->wait_tail = NULL;
+  handoff(srv, s, &set->shards[target]);
+  return 1;
+}
+
+// adds an opened player to the matchmaking queue. Returns 0 if the
+// session is leaving for another shard and must not be processed further.
+static int enqueue(Server *srv, Session *s) {
+  s->state = STATE_WAITING;
+  set_timer(srv, s, srv->cfg->idle_ms);
+  if (srv->wait_tail != NULL) {
+    srv->wait_tail->next_waiting = s;
+  } else {
+    srv->wait_head = s;
+  }
+  srv->wait_tail = s;
+
+  while (try_match(srv))
+    ;
+
+  Session *lone = srv->wait_head;
+  return !(offer_waiter(srv) && lone == s);
+}
+
+// frees a waiting session that never made it into a shard
+static void discard(Server *srv, Session *s) {
+  close(s->player.sock);
+  if (s->claimed) {
+    name_release(s->player.name);
+  }
+  session_put(srv, s);
+}
+
+// a waiter whose peer hung up while it was on its way from another shard,
+// it would only be matched to forfeit right away
+static int hung_up(Session *s) {
+  char byte;
+  int n = recv(s->player.sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                    errno != EINTR);
+}
+
+// takes in sessions other shards handed over
+static void drain_inbox(Server *srv) {
+  uint64_t count;
+  if (read(srv->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    perror("read");
+  }
+
+  pthread_mutex_lock(&srv->set->lock);
+  Session *list = srv->inbox;
+  srv->inbox = NULL;
+  pthread_mutex_unlock(&srv->set->lock);
+
+  while (list != NULL) {
+    Session *s = list;
+    list = s->next_waiting;
+    s->next_waiting = NULL;
+    if (hung_up(s) || attach(srv, s) < 0) {
+      printf("Connection %d lost on its way over\n", s->player.sock);
+      discard(srv, s);
+      continue;
+    }
+    if (enqueue(srv, s) && process_input(srv, s)) {
+      touch(srv, s);
+    }
+  }
+  // a session lost on its way here took the lobby with it, so whoever
+  // still waits on this shard has to be offered again
+  offer_waiter(srv);
+}
+
+// decodes every complete frame in the session buffer. Returns 0 if the
+// session left for another shard and must not be touched any more.
+static int process_input(Server *srv, Session *s) {
+  Player *p = &s->player;
+  // frames decoded ahead, handled one per pass of the loop
+  FrameDesc frames[DECODE_BATCH];
+  int decoded = 0;
+  int next = 0;
+
+  // a session whose output backs up stops being served until it drains
+  while (s->state != STATE_OVER && ring_used(&p->in) > 0 &&
+         player_readable(p)) {
+    if (s->moving_to != NULL) {
+      return 0;
+    }
+    if (s->state == STATE_HANDSHAKE) {
+      int result = open_player(p);
+      if (result < 0) {
+        session_close(srv, s);
+        return 1;
+      }
+      if (result == 0) {
+        return 1;
+      }
+      int claim = name_claim(p->name);
+      if (claim < 0) {
+        // the name may well be free, so no 22 for it
+        fprintf(stderr, "name registry: out of memory, closing %d\n",
+                p->sock);
+        session_close(srv, s);
+        return 1;
+      }
+      if (claim == 0) {
+        printf("same name\n");
+        send_fail(p, ERR_ALREADY_PLAY);
+        session_close(srv, s);
+        return 1;
+      }
+      s->claimed = 1;
+      send_wait(p);
+      if (!enqueue(srv, s)) {
+        return 0;
+      }
+      continue;
+    }
+
+    if (next == decoded) {
+      int consumed;
+      decoded = decode_stream(&p->dec, ring_read_ptr(&p->in),
+                              ring_used(&p->in), frames, DECODE_BATCH,
+                              &consumed);
+      next = 0;
+      if (decoded == 0) {
+        return 1;
+      }
+    }
+    const FrameDesc *d = &frames[next++];
+    if (d->error_code != 0) {
+      metrics_count(M_DECODE_ERRORS);
+      printf("Invalid message\n");
+      send_fail(p, d->error_code);
+      disconnect(srv, s);
+      return 1;
+    }
+    MessageView msg;
+    frame_view(ring_read_ptr(&p->in), d, &msg);
+
+    if (s->state == STATE_WAITING) {
+      // only OPEN is legal before the game starts, and it was already sent
+      send_fail(p, msg.kind == MSG_OPEN ? ERR_ALREADY_OPEN
+                                        : ERR_NOT_PLAYING);
+      session_close(srv, s);
+      return 1;
+    }
+
+    Session *opp = s->opponent;
+    Player *p1 = p->p_num == 1 ? p : &opp->player;
+    Player *p2 = p->p_num == 1 ? &opp->player : p;
+    int turn = s->game->curr_player;
+    if (turn == p->p_num) {
+      // PLAY has to report the clock as of this move
+      charge_clock(srv, s);
+    }
+    int over = handle_message(s->game, p1, p2, p, &msg);
+    ring_consume(&p->in, d->size);
+
+    if (over) {
+      end_game(srv, s);
+    } else if (s->game->curr_player != turn) {
+      set_timer(srv, s, INPUT_REST_MS);
+      begin_turn(srv, opp);
+    }
+  }
+  return s->moving_to == NULL;
+}
+
+// a full buffer that still does not decode is never going to
+static void input_overflow(Server *srv, Session *s) {
+  send_fail(&s->player, ERR_INVALID);
+  disconnect(srv, s);
+  touch(srv, s);
+}
+
+static void handle_readable(Server *srv, Session *s) {
+  Player *p = &s->player;
+
+  if (hold_input(srv, s) < 0) {
+    disconnect(srv, s);
+    touch(srv, s);
+    return;
+  }
+  if (ring_space(&p->in) == 0) {
+    input_overflow(srv, s);
+    return;
+  }
+
+  int bytes = read(p->sock, ring_write_ptr(&p->in), ring_space(&p->in));
+  if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINTR)) {
+    return;
+  }
+  if (bytes <= 0) {
+    disconnect(srv, s);
+    touch(srv, s);
+    return;
+  }
+
+  ring_produce(&p->in, bytes);
+  if (process_input(srv, s)) {
+    touch(srv, s);
+    rest_input(srv, s);
+  }
+}
+
+// the deadline of whatever the session was waiting for passed
+static void expire(Server *srv, Session *s) {
+  switch (s->state) {
+  case STATE_HANDSHAKE:
+    printf("Connection %d did not open in time\n", s->player.sock);
+    session_close(srv, s);
+    break;
+  case STATE_WAITING:
+    printf("Connection %d idle for too long\n", s->player.sock);
+    session_close(srv, s);
+    break;
+  case STATE_PLAYING: {
+    if (s->game->curr_player != s->player.p_num) {
+      // INPUT_REST_MS with the turn passed, the ring can go
+      if (ring_used(&s->player.in) == 0) {
+        release_input(srv, s);
+      }
+      break;
+    }
+    Session *opp = s->opponent;
+    charge_clock(srv, s);
+    printf("Player %d ran out of time\n", s->player.p_num);
+    send_over(s->game, &s->player, &opp->player, opp->player.p_num, 1);
+    touch(srv, s);
+    end_game(srv, s);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+static void run_timers(Server *srv) {
+  wheel_advance(&srv->wheel, srv->now);
+  Timer *t;
+  while ((t = wheel_pop(&srv->wheel)) != NULL) {
+    expire(srv, t->data);
+  }
+}
+
+// takes up input held back while the session's output was backed up
+static void resume_input(Server *srv, Session *s) {
+  if (s->state == STATE_OVER || s->moving_to != NULL || !s->player.paused ||
+      !player_readable(&s->player)) {
+    return;
+  }
+  if (process_input(srv, s)) {
+    touch(srv, s);
+  }
+}
+
+// sends what this iteration produced: one write, or one queued send, per
+// session no matter how many frames it got
+static void flush_output(Server *srv) {
+  while (srv->dirty != NULL) {
+    Session *s = srv->dirty;
+    srv->dirty = s->next_dirty;
+    s->dirty = 0;
+
+    if (s->player.out_full && s->state != STATE_OVER) {
+      // cannot keep up with its own game
+      s->player.out_full = 0;
+      disconnect(srv, s);
+    }
+
+    if (!srv->uring) {
+      if (s->state != STATE_OVER) {
+        flush_epoll(srv, s);
+        resume_input(srv, s);
+      }
+    } else if (s->state == STATE_OVER || s->moving_to != NULL) {
+      settle(srv, s);
+    } else {
+      flush_uring(srv, s);
+    }
+  }
+}
+
+static void handle_accept(Server *srv) {
+  // level triggered, so taking a bounded number per wakeup is fine
+  for (int i = 0; i < MAX_EVENTS; i++) {
+    int sock = accept(srv->listener, NULL, NULL);
+    if (sock < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("accept");
+      }
+      return;
+    }
+    metrics_count(M_ACCEPTS);
+    if (set_nonblocking(sock) < 0 || session_new(srv, sock) == NULL) {
+      close(sock);
+      continue;
+    }
+    printf("Connected from %d\n", sock);
+  }
+}
+
+static void epoll_run(Server *srv) {
+  struct epoll_event events[MAX_EVENTS];
+  while (*srv->running) {
+    int n = epoll_wait(srv->epfd, events, MAX_EVENTS,
+                       wheel_timeout(&srv->wheel));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      break;
+    }
+    take_time(srv);
+
+    for (int i = 0; i < n; i++) {
+      Session *s = events[i].data.ptr;
+      if (s == NULL) {
+        handle_accept(srv);
+      } else if (events[i].data.ptr == srv) {
+        drain_inbox(srv);
+      } else if (s->state != STATE_OVER) {
+        if (events[i].events & EPOLLOUT) {
+          mark_dirty(srv, s);
+        }
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+          handle_readable(srv, s);
+        }
+      }
+    }
+    run_timers(srv);
+    flush_output(srv);
+    metrics_moves_sent(srv->now_us);
+    free_dead(srv);
+  }
+}
+
+static int arm_accept(Server *srv) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&srv->ring);
+  if (sqe == NULL) {
+    return -1;
+  }
+  uring_prep_accept_multishot(sqe, srv->listener, op_data(NULL, OP_ACCEPT));
+  return 0;
+}
+
+static int arm_wake(Server *srv) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&srv->ring);
+  if (sqe == NULL) {
+    return -1;
+  }
+  uring_prep_poll_multishot(sqe, srv->wake_fd, op_data(NULL, OP_WAKE));
+  return 0;
+}
+
+// copies a completed read into the session and decodes it
+static void feed(Server *srv, Session *s, const char *data, int len) {
+  Player *p = &s->player;
+  while (len > 0 && s->state != STATE_OVER) {
+    if (hold_input(srv, s) < 0 || ring_space(&p->in) == 0) {
+      if (s->moving_to != NULL) {
+        // the new shard would have to decode it, give up on the player
+        session_close(srv, s);
+      } else if (p->in.data == NULL) {
+        disconnect(srv, s);
+        touch(srv, s);
+      } else {
+        input_overflow(srv, s);
+      }
+      return;
+    }
+    int n = ring_write(&p->in, data, len);
+    data += n;
+    len -= n;
+    if (process_input(srv, s)) {
+      touch(srv, s);
+      rest_input(srv, s);
+    }
+  }
+}
+
+static void handle_recv(Server *srv, Session *s, int res, unsigned flags) {
+  if (res > 0) {
+    int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    feed(srv, s, uring_buffer(&srv->ring, bid), res);
+    uring_recycle(&srv->ring, bid);
+  }
+  if (flags & IORING_CQE_F_MORE) {
+    return;
+  }
+
+  s->recv_armed = 0;
+  if (s->state == STATE_OVER || s->cancelling) {
+    settle(srv, s);
+  } else if (res == 0 || (res < 0 && res != -ENOBUFS)) {
+    disconnect(srv, s);
+    touch(srv, s);
+  } else if (s->moving_to != NULL) {
+    settle(srv, s);
+  } else if (arm_recv(srv, s) < 0) {
+    disconnect(srv, s);
+    touch(srv, s);
+  }
+}
+
+static void handle_send(Server *srv, Session *s, int res) {
+  Player *p = &s->player;
+  s->sending = 0;
+  if (res < 0) {
+    // the read side notices the broken connection
+    player_discard(p);
+  } else {
+    player_sent(p, res);
+  }
+
+  if (s->state == STATE_OVER || s->moving_to != NULL) {
+    settle(srv, s);
+    return;
+  }
+  resume_input(srv, s);
+  if (p->out_size > 0) {
+    mark_dirty(srv, s);
+  }
+}
+
+static void uring_run(Server *srv) {
+  while (*srv->running) {
+    // queued now, on their way with the io_uring_enter() below
+    flush_output(srv);
+    metrics_moves_sent(srv->now_us);
+    free_dead(srv);
+
+    int err = uring_submit_and_wait(&srv->ring, 1,
+                                    wheel_timeout(&srv->wheel));
+    if (err < 0 && err != -EINTR && err != -EAGAIN && err != -EBUSY &&
+        err != -ETIME) {
+      errno = -err;
+      perror("io_uring_enter");
+      break;
+    }
+    take_time(srv);
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&srv->ring)) != NULL) {
+      uint64_t data = cqe->user_data;
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      uring_cqe_seen(&srv->ring);
+
+      Session *s = (Session *)(uintptr_t)(data & ~(uint64_t)OP_MASK);
+      switch (data & OP_MASK) {
+      case OP_ACCEPT:
+        if (res >= 0) {
+          metrics_count(M_ACCEPTS);
+          if (session_new(srv, res) == NULL) {
+            close(res);
+          } else {
+            printf("Connected from %d\n", res);
+          }
+        } else if (res != -EINTR && res != -EAGAIN) {
+          errno = -res;
+          perror("accept");
+        }
+        if (!(flags & IORING_CQE_F_MORE)) {
+          arm_accept(srv);
+        }
+        break;
+      case OP_WAKE:
+        drain_inbox(srv);
+        if (!(flags & IORING_CQE_F_MORE)) {
+          arm_wake(srv);
+        }
+        break;
+      case OP_RECV:
+        handle_recv(srv, s, res, flags);
+        break;
+      case OP_SEND:
+        handle_send(srv, s, res);
+        break;
+      default:
+        break;
+      }
+    }
+    run_timers(srv);
+  }
+}
+
+static int uring_start(Server *srv) {
+  int err = uring_init(&srv->ring, URING_ENTRIES);
+  if (err == 0) {
+    err = uring_setup_buffers(&srv->ring, URING_BUFFERS, BUFLEN);
+  }
+  if (err == 0 && (arm_accept(srv) < 0 || arm_wake(srv) < 0)) {
+    err = -EBUSY;
+  }
+  if (err < 0) {
+    uring_free(&srv->ring);
+    errno = -err;
+    return -1;
+  }
+  srv->uring = 1;
+  return 0;
+}
+
+static int pool_init(SessionPool *pool, const ServerConfig *cfg) {
+  memset(pool, 0, sizeof(*pool));
+  unsigned count = cfg->max_sessions;
+  // only what is touched is committed, and freed slots are reused first,
+  // so memory follows the peak number of connections, not the ceiling
+  int flags = cfg->huge_pages ? SLAB_HUGE : 0;
+  if (slab_init(&pool->sessions, sizeof(Session), count, flags) < 0 ||
+      slab_init(&pool->games, sizeof(Game), count / 2 + 1, flags) < 0 ||
+      slab_init(&pool->outs, OUTLEN, count, flags) < 0 ||
+      ringset_init(&pool->rings, INLEN, count) < 0) {
+    perror("session pool");
+    slab_destroy(&pool->sessions);
+    slab_destroy(&pool->games);
+    slab_destroy(&pool->outs);
+    return -1;
+  }
+  return 0;
+}
+
+static void pool_report(SessionPool *pool) {
+  static const char *pages[] = {"small", "transparent huge", "huge"};
+  const char *names[] = {"Sessions", "Games", "Output queues"};
+  Slab *slabs[] = {&pool->sessions, &pool->games, &pool->outs};
+  for (int i = 0; i < 3; i++) {
+    SlabStats st;
+    slab_stats(slabs[i], &st);
+    printf("%s: %u in use, peak %u of %u, %lu taken, %lu refused, "
+           "%zu KB of %s pages\n",
+           names[i], st.in_use, st.peak, st.capacity, st.allocs, st.refused,
+           st.reserved / 1024, pages[st.huge]);
+  }
+}
+
+static void pool_free(SessionPool *pool) {
+  slab_destroy(&pool->sessions);
+  slab_destroy(&pool->games);
+  slab_destroy(&pool->outs);
+  ringset_free(&pool->rings);
+}
+
+static int shard_init(Server *srv, ShardSet *set, int id, int listener,
+                      const ServerConfig *cfg, volatile int *running) {
+  memset(srv, 0, sizeof(*srv));
+  srv->id = id;
+  srv->set = set;
+  srv->cfg = cfg;
+  take_time(srv);
+  wheel_init(&srv->wheel, srv->now);
+  srv->listener = listener;
+  srv->running = running;
+  srv->epfd = -1;
+
+  srv->wake_fd = eventfd(0, EFD_NONBLOCK);
+  if (srv->wake_fd < 0) {
+    perror("eventfd");
+    return -1;
+  }
+
+  if (cfg->backend == BACKEND_URING) {
+    if (uring_start(srv) == 0) {
+      return 0;
+    }
+    fprintf(stderr, "io_uring unavailable (%s), falling back to epoll\n",
+            strerror(errno));
+  }
+
+  srv->epfd = epoll_create1(0);
+  if (srv->epfd < 0) {
+    perror("epoll_create1");
+    close(srv->wake_fd);
+    return -1;
+  }
+
+  set_nonblocking(listener);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  int err = epoll_ctl(srv->epfd, EPOLL_CTL_ADD, listener, &ev);
+  ev.data.ptr = srv;
+  if (err == 0) {
+    err = epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->wake_fd, &ev);
+  }
+  if (err < 0) {
+    perror("epoll_ctl");
+    close(srv->wake_fd);
+    close(srv->epfd);
+    return -1;
+  }
+  return 0;
+}
+
+static void shard_run(Server *srv) {
+  if (srv->uring) {
+    uring_run(srv);
+  } else {
+    epoll_run(srv);
+  }
+}
+
+static void shard_cleanup(Server *srv) {
+  if (srv->uring) {
+    // tearing down the ring cancels everything still in flight, after
+    // that nothing refers to the sessions any more
+    uring_free(&srv->ring);
+    srv->uring = 0;
+    while (srv->limbo != NULL) {
+      Session *s = srv->limbo;
+      list_del(s);
+      close(s->player.sock);
+      if (s->claimed) {
+        name_release(s->player.name);
+        s->claimed = 0;
+      }
+      s->state = STATE_OVER;
+      s->next_dead = srv->dead;
+      srv->dead = s;
+    }
+    srv->dirty = NULL;
+  }
+  while (srv->sessions != NULL) {
+    session_close(srv, srv->sessions);
+  }
+  free_dead(srv);
+  // handed over after this shard stopped looking
+  while (srv->inbox != NULL) {
+    Session *s = srv->inbox;
+    srv->inbox = s->next_waiting;
+    discard(srv, s);
+  }
+  close(srv->wake_fd);
+  if (srv->epfd >= 0) {
+    close(srv->epfd);
+  }
+}
+
+int run_event_loop(int listener, const ServerConfig *cfg,
+                   volatile int *running) {
+  ShardSet set;
+  Server srv;
+  pthread_mutex_init(&set.lock, NULL);
+  set.lobby = -1;
+  set.count = 1;
+  set.shards = &srv;
+
+  // a peer hanging up mid-write must not take every other game down
+  signal(SIGPIPE, SIG_IGN);
+
+  if (pool_init(&set.pool, cfg) < 0) {
+    return -1;
+  }
+  if (shard_init(&srv, &set, 0, listener, cfg, running) < 0) {
+    pool_free(&set.pool);
+    return -1;
+  }
+  shard_run(&srv);
+  shard_cleanup(&srv);
+  pool_report(&set.pool);
+  pool_free(&set.pool);
+  pthread_mutex_destroy(&set.lock);
+  return 0;
+}
+
+static void *reactor_main(void *arg) {
+  Server *srv = arg;
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(srv->id % CPU_SETSIZE, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+    fprintf(stderr, "reactor %d: could not pin to a cpu\n", srv->id);
+  }
+
+  shard_run(srv);
+  return NULL;
+}
+
+int run_reactors(int *listeners, int count, const ServerConfig *cfg,
+                 volatile int *running) {
+  ShardSet set;
+  pthread_mutex_init(&set.lock, NULL);
+  set.lobby = -1;
+  set.count = count;
+  set.shards = calloc(count, sizeof(Server));
+  pthread_t *threads = calloc(count, sizeof(pthread_t));
+  if (set.shards == NULL || threads == NULL) {
+    perror("calloc");
+    free(set.shards);
+    free(threads);
+    return -1;
+  }
+  if (pool_init(&set.pool, cfg) < 0) {
+    free(set.shards);
+    free(threads);
+    return -1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  int ready = 0;
+  while (ready < count) {
+    if (shard_init(&set.shards[ready], &set, ready, listeners[ready], cfg,
+                   running) < 0) {
+      break;
+    }
+    ready++;
+  }
+
+  // shutdown signals are left to this thread, which then wakes the shards.
+  // they stay blocked outside sigsuspend() so none can slip in unnoticed
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGHUP);
+  sigaddset(&block, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &block, &old);
+
+  int started = 0;
+  if (ready == count) {
+    while (started < count) {
+      if (pthread_create(&threads[started], NULL, reactor_main,
+                         &set.shards[started]) != 0) {
+        perror("pthread_create");
+        break;
+      }
+      started++;
+    }
+  }
+
+  printf("Started %d reactors\n", started);
+  while (started == count && *running) {
+    sigsuspend(&old);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  *running = 0;
+  uint64_t one = 1;
+  for (int i = 0; i < ready; i++) {
+    if (write(set.shards[i].wake_fd, &one, sizeof(one)) < 0) {
+      perror("write");
+    }
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  for (int i = 0; i < ready; i++) {
+    shard_cleanup(&set.shards[i]);
+  }
+  pool_report(&set.pool);
+  pool_free(&set.pool);
+
+  free(threads);
+  free(set.shards);
+  pthread_mutex_destroy(&set.lock);
+  return started == count ? 0 : -1;
+}
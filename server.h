@@ -0,0 +1,84 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+/*
+ * server.h - single-process event loop for nimd
+ *
+ * Instead of forking a child per game, every connection is a non-blocking
+ * session driven by epoll readiness (or io_uring completions). A session
+ * moves through
+ *
+ *   HANDSHAKE -> WAITING -> PLAYING -> OVER
+ *
+ * HANDSHAKE until a valid OPEN arrives (WAIT is sent), WAITING in the
+ * matchmaking queue until an opponent has opened too, PLAYING while the
+ * game runs, and OVER once it has been closed and is waiting to be freed.
+ * All games share the one process. Each state's deadline is a timer in
+ * the loop's timer wheel (timer.h).
+ */
+
+enum { BACKEND_EPOLL, BACKEND_URING };
+
+// how long a player keeps its input ring once the turn has passed to the
+// opponent, so that taking turns does not hand rings back and forth
+#define INPUT_REST_MS 1000
+
+typedef struct {
+  // BACKEND_URING drives each loop from one io_uring instead of epoll:
+  // multishot accept and recv into a provided buffer ring, and all output
+  // of an iteration queued as sends that go out with the single
+  // io_uring_enter() that also waits for the next completions. Falls back
+  // to epoll if the kernel does not allow it.
+  int backend;
+  // deadlines in ms, 0 for none. A connection gets handshake_ms to send
+  // OPEN and may then wait idle_ms for an opponent. A player who takes
+  // longer than turn_ms for a move forfeits.
+  int handshake_ms;
+  int idle_ms;
+  int turn_ms;
+  // chess clocks: each player has clock_ms of thinking time for the whole
+  // game, running out forfeits. PLAY then reports both clocks.
+  int clock_ms;
+  // the most sessions held at once, across all reactors. Sessions, games
+  // and input rings for that many are reserved at startup and reused,
+  // connections past it are refused
+  int max_sessions;
+  int huge_pages; // back the session pool with huge pages if there are any
+} ServerConfig;
+
+/*
+ * run_event_loop - serve games on an already listening socket
+ *
+ * @listener: socket returned by open_listener()
+ * @cfg:      backend and limits
+ * @running:  loop keeps going while *running is non-zero, the signal
+ *            handlers clear it
+ *
+ * Returns 0 on a clean shutdown, -1 if epoll or the session pool could
+ * not be set up.
+ */
+int run_event_loop(int listener, const ServerConfig *cfg,
+                   volatile int *running);
+
+/*
+ * run_reactors - one event loop thread per listener
+ *
+ * @listeners: SO_REUSEPORT sockets bound to the same port, one per thread
+ * @count:     number of listeners, and so of reactor threads
+ * @cfg:       as for run_event_loop(), shared by every reactor
+ * @running:   as for run_event_loop()
+ *
+ * Each reactor is pinned to a cpu and owns its sessions and its own
+ * matchmaking queue, so accepts and moves never contend. The kernel spreads
+ * new connections across the listeners. A player left waiting alone on one
+ * reactor is handed to whichever reactor has the other lone waiter, so
+ * nobody waits forever because of how connections were hashed. Player
+ * names are unique across all reactors.
+ *
+ * The calling thread waits for a shutdown signal, then stops and joins the
+ * reactors. Returns 0 on a clean shutdown, -1 if they could not be started.
+ */
+int run_reactors(int *listeners, int count, const ServerConfig *cfg,
+                 volatile int *running);
+
+#endif
@@ -0,0 +1,113 @@
+#define _GNU_SOURCE
+#include "slab.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define CACHE_LINE 64
+#define HUGE_PAGE (2UL << 20)
+
+static size_t round_up(size_t n, size_t to) { return (n + to - 1) / to * to; }
+
+// maps the region, huge pages first if asked. Sets stats.huge
+static char *map_region(Slab *s, size_t *len, int flags) {
+  int populate = flags & SLAB_PREFAULT ? MAP_POPULATE : 0;
+  char *base;
+
+  if (flags & SLAB_HUGE) {
+    // only works if the administrator reserved hugetlbfs pages
+    size_t huge_len = round_up(*len, HUGE_PAGE);
+    base = mmap(NULL, huge_len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+    if (base != MAP_FAILED) {
+      *len = huge_len;
+      s->stats.huge = SLAB_PAGES_HUGETLB;
+      return base;
+    }
+  }
+
+  base = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | populate, -1, 0);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+#ifdef MADV_HUGEPAGE
+  if ((flags & SLAB_HUGE) && madvise(base, *len, MADV_HUGEPAGE) == 0) {
+    s->stats.huge = SLAB_PAGES_THP;
+  }
+#endif
+  return base;
+}
+
+int slab_init(Slab *s, size_t size, unsigned capacity, int flags) {
+  memset(s, 0, sizeof(*s));
+  if (size == 0 || capacity == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  // room for the free list link, and no two objects sharing a line
+  size = round_up(size < sizeof(void *) ? sizeof(void *) : size, CACHE_LINE);
+
+  long page = sysconf(_SC_PAGESIZE);
+  size_t len = round_up(size * capacity, page > 0 ? page : 4096);
+  s->base = map_region(s, &len, flags);
+  if (s->base == NULL) {
+    return -1;
+  }
+
+  pthread_mutex_init(&s->lock, NULL);
+  s->stats.capacity = capacity;
+  s->stats.object_size = size;
+  s->stats.reserved = len;
+  return 0;
+}
+
+void *slab_alloc(Slab *s) {
+  pthread_mutex_lock(&s->lock);
+  void *obj = s->free_list;
+  if (obj != NULL) {
+    s->free_list = *(void **)obj;
+  } else if (s->fresh < s->stats.capacity) {
+    obj = s->base + (size_t)s->fresh++ * s->stats.object_size;
+  } else {
+    s->stats.refused++;
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+  }
+  s->stats.allocs++;
+  if (++s->stats.in_use > s->stats.peak) {
+    s->stats.peak = s->stats.in_use;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  memset(obj, 0, s->stats.object_size);
+  return obj;
+}
+
+void slab_free(Slab *s, void *obj) {
+  pthread_mutex_lock(&s->lock);
+  *(void **)obj = s->free_list;
+  s->free_list = obj;
+  s->stats.in_use--;
+  pthread_mutex_unlock(&s->lock);
+}
+
+unsigned slab_index(const Slab *s, const void *obj) {
+  return ((const char *)obj - s->base) / s->stats.object_size;
+}
+
+void slab_stats(Slab *s, SlabStats *out) {
+  pthread_mutex_lock(&s->lock);
+  *out = s->stats;
+  pthread_mutex_unlock(&s->lock);
+}
+
+void slab_destroy(Slab *s) {
+  if (s->base == NULL) {
+    return;
+  }
+  munmap(s->base, s->stats.reserved);
+  pthread_mutex_destroy(&s->lock);
+  memset(s, 0, sizeof(*s));
+}
@@ -0,0 +1,72 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * slab.h - fixed-size object pools
+ *
+ * A Slab hands out objects of one size from a region mapped once, up
+ * front, for a fixed number of them. Freed objects go on a free list and
+ * are handed out again first, so both alloc and free are O(1) and a busy
+ * server stops touching new memory once it has reached its peak. The
+ * capacity is a hard ceiling: past it slab_alloc() returns NULL rather
+ * than growing.
+ *
+ * Objects are cache line aligned and come back zeroed. Any thread may
+ * alloc or free, a mutex held for a few instructions keeps the lists.
+ */
+
+#define SLAB_HUGE 1     // back the region with huge pages if the system has any
+#define SLAB_PREFAULT 2 // fault every page in at init, not on first use
+
+// how the region ended up backed, for SlabStats.huge
+enum { SLAB_PAGES_SMALL, SLAB_PAGES_THP, SLAB_PAGES_HUGETLB };
+
+typedef struct {
+  unsigned capacity;
+  unsigned in_use;
+  unsigned peak;          // most objects in use at once
+  unsigned long allocs;   // successful slab_alloc() calls
+  unsigned long refused;  // slab_alloc() calls that hit the ceiling
+  size_t object_size;     // after rounding up to a cache line
+  size_t reserved;        // bytes mapped for the region
+  int huge;               // SLAB_PAGES_*
+} SlabStats;
+
+typedef struct {
+  pthread_mutex_t lock;
+  char *base;
+  unsigned fresh;  // objects at and past this index were never handed out
+  void *free_list; // freed objects, linked through their first word
+  SlabStats stats;
+} Slab;
+
+/*
+ * slab_init - reserve room for @capacity objects of @size bytes
+ *
+ * @flags: SLAB_HUGE, SLAB_PREFAULT or 0. SLAB_HUGE uses hugetlbfs pages
+ *         when some are reserved, and asks for transparent huge pages
+ *         otherwise.
+ *
+ * Returns 0, or -1 with errno set.
+ */
+int slab_init(Slab *s, size_t size, unsigned capacity, int flags);
+
+// a zeroed object, or NULL once capacity objects are in use
+void *slab_alloc(Slab *s);
+
+// @obj must have come from slab_alloc() on @s
+void slab_free(Slab *s, void *obj);
+
+// position of @obj in the region, 0 to capacity - 1, fixed for its life
+unsigned slab_index(const Slab *s, const void *obj);
+
+// a consistent copy of the counters
+void slab_stats(Slab *s, SlabStats *out);
+
+// unmaps the region, whatever is still allocated goes with it
+void slab_destroy(Slab *s);
+
+#endif
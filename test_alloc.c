@@ -0,0 +1,393 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "decoder.h"
+#include "game.h"
+
+/*
+ * test_alloc - the game path runs without the heap
+ *
+ * Linked with -Wl,--wrap for malloc, calloc, realloc, free and memmove, so
+ * every call from the objects of this binary (game.o, decoder.o, ring.o,
+ * slab.o and the tests) lands in the counters below first. Calls libc makes
+ * internally, stdio's buffers for one, are not seen, which is what we want:
+ * the question is whether our code reaches for the heap.
+ *
+ * After one warm-up game, whole games are played through openGame() and
+ * playGame() over socketpairs, and through start_game()/handle_message()
+ * with output queues from a slab as the event loop does, and every one of
+ * them has to make no allocation and move no more than one frame's worth
+ * of bytes with memmove().
+ */
+
+#define GAMES 5
+
+static int tests_passed = 0;
+static int tests_failed = 0;
+
+static void assert_test(int condition, const char *test_name,
+                        const char *message) {
+  if (condition) {
+    printf("  PASS: %s\n", test_name);
+    tests_passed++;
+  } else {
+    printf("  FAIL: %s - %s\n", test_name, message);
+    tests_failed++;
+  }
+}
+
+/* counted only between start_counting() and stop_counting(), from any
+ * thread */
+typedef struct {
+  long allocs;      // malloc, calloc and realloc
+  long frees;       // free of anything but NULL
+  long moves;       // memmove of any size
+  long large_moves; // memmove of more than FRAME_MAX bytes
+} Counts;
+
+static volatile int counting = 0;
+static Counts counts;
+static pthread_mutex_t counts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+void *__real_memmove(void *dst, const void *src, size_t n);
+
+static void count(long *field) {
+  if (counting) {
+    pthread_mutex_lock(&counts_lock);
+    (*field)++;
+    pthread_mutex_unlock(&counts_lock);
+  }
+}
+
+void *__wrap_malloc(size_t size) {
+  count(&counts.allocs);
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  count(&counts.allocs);
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  count(&counts.allocs);
+  return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+  if (ptr != NULL) {
+    count(&counts.frees);
+  }
+  __real_free(ptr);
+}
+
+void *__wrap_memmove(void *dst, const void *src, size_t n) {
+  count(&counts.moves);
+  if (n > FRAME_MAX) {
+    count(&counts.large_moves);
+  }
+  return __real_memmove(dst, src, n);
+}
+
+static void start_counting(void) {
+  memset(&counts, 0, sizeof(counts));
+  counting = 1;
+}
+
+static Counts stop_counting(void) {
+  counting = 0;
+  return counts;
+}
+
+static int heap_free(const Counts *c) {
+  return c->allocs == 0 && c->frees == 0 && c->large_moves == 0;
+}
+
+/* the game logs every move, kept out of the results while games run */
+static int saved_stdout = -1;
+
+static void quiet(void) {
+  fflush(stdout);
+  saved_stdout = dup(STDOUT_FILENO);
+  if (freopen("/dev/null", "w", stdout) == NULL) {
+    perror("freopen");
+  }
+}
+
+static void loud(void) {
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+  clearerr(stdout);
+}
+
+static void report(const char *what, const Counts *c) {
+  printf("    %s: %ld allocs, %ld frees, %ld memmoves (%ld large)\n", what,
+         c->allocs, c->frees, c->moves, c->large_moves);
+}
+
+static int create_test_player(Player *p, int p_num) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    perror("socketpair");
+    return -1;
+  }
+  memset(p, 0, sizeof(*p));
+  p->sock = sv[0];
+  p->p_num = p_num;
+  ring_init(&p->in, INLEN);
+  decoder_reset(&p->dec);
+  return sv[1];
+}
+
+static void cleanup_test_player(Player *p, int peer_sock) {
+  ring_free(&p->in);
+  close(p->sock);
+  close(peer_sock);
+}
+
+static void write_frame(int sock, const char *frame) {
+  int len = strlen(frame);
+  if (write(sock, frame, len) != len) {
+    perror("write");
+  }
+}
+
+/* the far end of one player's socket: answers every PLAY that gives it the
+ * turn by taking one stone from the first pile that has any, so a game is
+ * 25 moves long, and stops at OVER */
+typedef struct {
+  int sock;
+  int p_num;
+  int moves; // MOVEs sent
+  int over;  // OVER seen
+} Peer;
+
+static void *peer_play(void *arg) {
+  Peer *peer = arg;
+  char buf[4 * BUFLEN];
+  int len = 0;
+  while (!peer->over) {
+    int n = read(peer->sock, buf + len, sizeof(buf) - 1 - len);
+    if (n <= 0) {
+      break;
+    }
+    len += n;
+
+    int at = 0;
+    Message msg;
+    int used;
+    while ((used = decode_message(buf + at, len - at, &msg)) > 0) {
+      at += used;
+      if (strcmp(msg.type, "OVER") == 0) {
+        peer->over = 1;
+      } else if (strcmp(msg.type, "PLAY") == 0 &&
+                 atoi(msg.fields[0]) == peer->p_num) {
+        int piles[5] = {0};
+        sscanf(msg.fields[1], "%d %d %d %d %d", &piles[0], &piles[1],
+               &piles[2], &piles[3], &piles[4]);
+        int pile = 0;
+        while (pile < 4 && piles[pile] == 0) {
+          pile++;
+        }
+        char move[BUFLEN];
+        snprintf(move, sizeof(move), "0|09|MOVE|%d|1|", pile);
+        write_frame(peer->sock, move);
+        peer->moves++;
+      }
+    }
+    if (used < 0) {
+      break;
+    }
+    // a partial frame moves to the front, byte by byte so that the test's
+    // own copying stays out of the memmove() count
+    for (int i = at; i < len; i++) {
+      buf[i - at] = buf[i];
+    }
+    len -= at;
+  }
+  return NULL;
+}
+
+/* one whole game through openGame() and playGame(), the peers played by
+ * two threads. Returns 1 if it ran to OVER with every stone taken */
+static int play_blocking_game(void) {
+  Player p1, p2;
+  int peer1 = create_test_player(&p1, 1);
+  int peer2 = create_test_player(&p2, 2);
+
+  // OPEN as it would be left in the ring by the lobby
+  ring_write(&p1.in, "0|11|OPEN|Alice|", 16);
+  ring_write(&p2.in, "0|09|OPEN|Bob|", 14);
+  char wait[BUFLEN];
+  int opened = openGame(&p1) > 0 && openGame(&p2) > 0 &&
+               read(peer1, wait, sizeof(wait)) > 0 &&
+               read(peer2, wait, sizeof(wait)) > 0;
+
+  Peer peers[2] = {{peer1, 1, 0, 0}, {peer2, 2, 0, 0}};
+  pthread_t threads[2];
+  for (int i = 0; i < 2; i++) {
+    pthread_create(&threads[i], NULL, peer_play, &peers[i]);
+  }
+  playGame(&p1, &p2);
+  for (int i = 0; i < 2; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  cleanup_test_player(&p1, peer1);
+  cleanup_test_player(&p2, peer2);
+  return opened && peers[0].over && peers[1].over &&
+         peers[0].moves + peers[1].moves == 25;
+}
+
+/* one whole game the way the event loop plays it: frames decoded from the
+ * ring one read at a time, handle_message(), output queued in a queue
+ * lent by @outs and flushed. Returns 1 if it ran to OVER */
+static int play_pooled_game(Slab *outs) {
+  Player p1, p2;
+  int peer1 = create_test_player(&p1, 1);
+  int peer2 = create_test_player(&p2, 2);
+  Player *players[2] = {&p1, &p2};
+  int peers[2] = {peer1, peer2};
+  for (int i = 0; i < 2; i++) {
+    fcntl(peers[i], F_SETFL, fcntl(peers[i], F_GETFL, 0) | O_NONBLOCK);
+  }
+  p1.outs = outs;
+  p2.outs = outs;
+  strcpy(p1.name, "Alice");
+  strcpy(p2.name, "Bob");
+  p1.opened = 1;
+  p2.opened = 1;
+
+  Game g;
+  start_game(&g, &p1, &p2, 0);
+  int over = 0;
+  char buf[4 * BUFLEN];
+  for (int turn = 0; turn < 30 && !over; turn++) {
+    for (int i = 0; i < 2; i++) {
+      player_flush(players[i]);
+      // nothing to be learnt from the frames, the board is in @g
+      while (read(peers[i], buf, sizeof(buf)) > 0) {
+      }
+    }
+
+    Player *from = players[g.curr_player - 1];
+    int pile = 0;
+    while (pile < 4 && g.piles[pile] == 0) {
+      pile++;
+    }
+    char move[] = "0|09|MOVE|0|1|";
+    move[10] = '0' + pile;
+    ring_write(&from->in, move, sizeof(move) - 1);
+
+    MessageView msg;
+    int n = decode_view(&from->dec, ring_read_ptr(&from->in),
+                        ring_used(&from->in), &msg);
+    if (n <= 0) {
+      break;
+    }
+    over = handle_message(&g, &p1, &p2, from, &msg);
+    ring_consume(&from->in, n);
+  }
+  for (int i = 0; i < 2; i++) {
+    player_flush(players[i]);
+    player_discard(players[i]);
+  }
+
+  cleanup_test_player(&p1, peer1);
+  cleanup_test_player(&p2, peer2);
+  return over && is_game_over(&g);
+}
+
+void test_harness() {
+  printf("\n--- Harness Tests ---\n");
+
+  /* the wrappers see calls from this binary */
+  {
+    char big[2 * FRAME_MAX];
+    volatile size_t size = sizeof(big);
+    start_counting();
+    void *p = malloc(16);
+    free(p);
+    memmove(big, big + 1, size - 1);
+    memmove(big, big + 1, 8);
+    Counts c = stop_counting();
+    int pass = c.allocs == 1 && c.frees == 1 && c.moves >= 1 &&
+               c.large_moves == 1;
+    report("malloc, free, large memmove", &c);
+    assert_test(pass, "wrap_active",
+                "malloc, free and memmove should be counted");
+  }
+}
+
+void test_steady_state() {
+  printf("\n--- Steady State Tests ---\n");
+
+  // lazy setup on the first game (stdio, the first thread) is not counted
+  quiet();
+  int warm = play_blocking_game();
+  loud();
+  assert_test(warm, "warmup_game", "the warm-up game should run to OVER");
+
+  /* openGame() and playGame() */
+  {
+    quiet();
+    start_counting();
+    int played = 0;
+    for (int i = 0; i < GAMES; i++) {
+      played += play_blocking_game();
+    }
+    Counts c = stop_counting();
+    loud();
+    report("playGame", &c);
+    assert_test(played == GAMES && heap_free(&c), "blocking_games",
+                "a game through playGame() should not touch the heap");
+  }
+
+  /* start_game() and handle_message() with pooled output queues */
+  {
+    Slab outs;
+    slab_init(&outs, OUTLEN, 2, 0);
+    quiet();
+    play_pooled_game(&outs);
+    start_counting();
+    int played = 0;
+    for (int i = 0; i < GAMES; i++) {
+      played += play_pooled_game(&outs);
+    }
+    Counts c = stop_counting();
+    loud();
+    SlabStats st;
+    slab_stats(&outs, &st);
+    report("pooled", &c);
+    assert_test(played == GAMES && heap_free(&c) && st.in_use == 0,
+                "pooled_games",
+                "a game with pooled queues should not touch the heap");
+    slab_destroy(&outs);
+  }
+}
+
+int main() {
+  printf("==============================================\n");
+  printf("   Allocation Test Suite\n");
+  printf("==============================================\n");
+
+  test_harness();
+  test_steady_state();
+
+  printf("\n==============================================\n");
+  printf("   Results: %d passed, %d failed\n", tests_passed, tests_failed);
+  printf("==============================================\n");
+
+  return (tests_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -86,6 +86,20 @@ void test_valid_messages() {
     assert_test(pass, "valid_PLAY", "Should parse PLAY with 2 fields");
   }
 
+  {
+    char buf[] = "0|29|PLAY|2|1 3 5 7 9|59500 60000|";
+    Message msg = {0};
+    int result = decode_message(buf, strlen(buf), &msg);
+
+    int pass =
+        (result == 34 && strcmp(msg.type, "PLAY") == 0 &&
+         msg.field_count == 3 && strcmp(msg.fields[1], "1 3 5 7 9") == 0 &&
+         strcmp(msg.fields[2], "59500 60000") == 0 && msg.error_code == 0);
+
+    assert_test(pass, "valid_PLAY_clocks",
+                "Should parse PLAY with the optional clock field");
+  }
+
   {
     char buf[] = "0|09|MOVE|2|3|";
     Message msg = {0};
@@ -275,6 +289,16 @@ void test_invalid_format() {
                 "Should reject unknown message type");
   }
 
+  {
+    char buf[] = "0|11|OPENXAlice|";
+    Message msg = {0};
+    int result = decode_message(buf, strlen(buf), &msg);
+
+    int pass = (result == -1 && msg.error_code == ERR_INVALID);
+    assert_test(pass, "invalid_type_separator",
+                "Should reject a type not followed by '|'");
+  }
+
   {
     char buf[] = "1|05|WAIT|";
     Message msg = {0};
@@ -454,6 +478,17 @@ void test_encoder() {
     assert_test(pass, "encode_PLAY", "Should encode PLAY correctly");
   }
 
+  {
+    char buf[FRAME_MAX];
+    int piles[5] = {1, 3, 5, 7, 9};
+    int clocks[2] = {59500, 60000};
+    int n = encode_play(buf, sizeof(buf), 2, piles, clocks);
+
+    int pass = (n == 34 && strcmp(buf, "0|29|PLAY|2|1 3 5 7 9|59500 60000|") == 0);
+    assert_test(pass, "encode_PLAY_clocks",
+                "Should encode PLAY with clocks correctly");
+  }
+
   {
     char buf[100];
     int n = encode_message(buf, sizeof(buf), "OVER", "1", "0 0 0 0 0", "");
@@ -503,6 +538,121 @@ void test_encoder() {
   }
 }
 
+void test_typed_encoders() {
+  printf("\n--- Typed Encoder Tests ---\n");
+
+  {
+    char buf[FRAME_MAX];
+    int n = encode_name(buf, sizeof(buf), 1, "Alice");
+
+    int pass = (n == 18 && strcmp(buf, "0|13|NAME|1|Alice|") == 0);
+    assert_test(pass, "encode_name", "Should match encode_message() NAME");
+  }
+
+  {
+    char buf[FRAME_MAX];
+    char name[74];
+    memset(name, 'a', 73);
+    name[73] = '\0';
+    int n = encode_name(buf, sizeof(buf), 2, name);
+
+    assert_test(n == -1, "encode_name_too_long",
+                "Should refuse a name over 72 characters");
+  }
+
+  {
+    char buf[FRAME_MAX];
+    int piles[5] = {1, 3, 5, 7, 9};
+    int n = encode_play(buf, sizeof(buf), 1, piles, NULL);
+
+    int pass = (n == 22 && strcmp(buf, "0|17|PLAY|1|1 3 5 7 9|") == 0);
+    assert_test(pass, "encode_play_board", "Should write the board in place");
+  }
+
+  {
+    char buf[FRAME_MAX];
+    int piles[5] = {10, 0, 123, 7, 4096};
+    int clocks[2] = {0, 2147483647};
+    int n = encode_play(buf, sizeof(buf), 2, piles, clocks);
+
+    int pass =
+        (n > 0 && strcmp(buf, "0|36|PLAY|2|10 0 123 7 4096|0 2147483647|") == 0);
+    assert_test(pass, "encode_play_digits",
+                "Should format multi-digit values and zero");
+  }
+
+  {
+    char buf[FRAME_MAX];
+    int piles[5] = {0, 0, 0, 0, 0};
+    int n1 = encode_over(buf, sizeof(buf), 1, piles, 0);
+    int pass1 = (n1 == 23 && strcmp(buf, "0|18|OVER|1|0 0 0 0 0||") == 0);
+    int n2 = encode_over(buf, sizeof(buf), 2, piles, 1);
+    int pass2 =
+        (n2 == 30 && strcmp(buf, "0|25|OVER|2|0 0 0 0 0|Forfeit|") == 0);
+    assert_test(pass1 && pass2, "encode_over",
+                "Should encode OVER with and without Forfeit");
+  }
+
+  {
+    char buf[FRAME_MAX - 1];
+    int piles[5] = {1, 3, 5, 7, 9};
+    int n = encode_play(buf, sizeof(buf), 1, piles, NULL);
+
+    assert_test(n == -1, "encode_play_small_buffer",
+                "Should refuse a buffer under FRAME_MAX");
+  }
+
+  {
+    char buf[FRAME_MAX];
+    int piles[5] = {-2147483647 - 1, -2147483647 - 1, -2147483647 - 1,
+                    -2147483647 - 1, -2147483647 - 1};
+    int clocks[2] = {-2147483647 - 1, -2147483647 - 1};
+    int n = encode_play(buf, sizeof(buf), -2147483647 - 1, piles, clocks);
+
+    assert_test(n == -1, "encode_play_overlong",
+                "Should refuse content over 99 bytes");
+  }
+
+  {
+    Frame f = wait_frame();
+    char buf[100];
+    int n = encode_message(buf, sizeof(buf), "WAIT");
+
+    int pass = (f.len == n && memcmp(f.data, buf, n) == 0);
+    assert_test(pass, "wait_frame", "Table WAIT should match encode_message()");
+  }
+
+  {
+    int codes[] = {ERR_INVALID,     ERR_LONG_NAME,  ERR_ALREADY_PLAY,
+                   ERR_ALREADY_OPEN, ERR_NOT_PLAYING, ERR_IMPATIENT,
+                   ERR_PILE_INDEX,  ERR_QUANTITY,   99};
+    const char *names[] = {"10 Invalid",      "21 Long Name",
+                           "22 Already Playing", "23 Already Open",
+                           "24 Not Playing",  "31 Impatient",
+                           "32 Pile Index",   "33 Quantity",
+                           "Unknown error"};
+    int pass = 1;
+    for (int i = 0; i < 9; i++) {
+      Frame f = fail_frame(codes[i]);
+      char buf[100];
+      int n = encode_message(buf, sizeof(buf), "FAIL", names[i]);
+      if (f.len != n || memcmp(f.data, buf, n) != 0) {
+        pass = 0;
+      }
+    }
+    assert_test(pass, "fail_frames",
+                "Every table FAIL should match encode_message()");
+  }
+
+  {
+    char buf[10];
+    int n = encode_fail(buf, sizeof(buf), ERR_INVALID);
+
+    assert_test(n == -1, "encode_fail_small_buffer",
+                "Should fail if the frame does not fit");
+  }
+}
+
 void test_encode_fail() {
   printf("\n--- encode_fail() Tests ---\n");
 
@@ -532,9 +682,426 @@ void test_encode_fail() {
   }
 }
 
+void test_message_kind() {
+  printf("\n--- Message Kind Tests ---\n");
+
+  {
+    const char *frames[MSG_TYPES] = {
+        [MSG_OPEN] = "0|07|OPEN|A|",   [MSG_WAIT] = "0|05|WAIT|",
+        [MSG_NAME] = "0|09|NAME|1|A|", [MSG_PLAY] = "0|13|PLAY|1|1 3 5|",
+        [MSG_MOVE] = "0|09|MOVE|1|2|", [MSG_OVER] = "0|13|OVER|1|1 3|x|",
+        [MSG_FAIL] = "0|08|FAIL|10|",
+    };
+    int pass = 1;
+    for (int kind = 0; kind < MSG_TYPES; kind++) {
+      char buf[32];
+      strcpy(buf, frames[kind]);
+      Message msg;
+      if (decode_message(buf, strlen(buf), &msg) <= 0 || msg.kind != kind) {
+        pass = 0;
+      }
+    }
+    assert_test(pass, "kind_all_types", "Every type should map to its MSG_*");
+  }
+
+  {
+    char buf[] = "0|12|MOVE|12|345|";
+    Message msg;
+    int result = decode_message(buf, strlen(buf), &msg);
+    int pass = (result == 17 && msg.field_len[0] == 2 &&
+                msg.field_len[1] == 3);
+    assert_test(pass, "field_len", "Field lengths should be recorded");
+  }
+
+  {
+    char buf[] = "0|05|move|";
+    Message msg;
+    int result = decode_message(buf, strlen(buf), &msg);
+    assert_test(result == -1 && msg.error_code == ERR_INVALID,
+                "kind_lowercase", "Type words are case sensitive");
+  }
+
+  {
+    char buf[] = "0|17|PLAY|1|1 3 5|9 8|";
+    Message msg;
+    int result = decode_message(buf, strlen(buf), &msg);
+    int pass = (result == 22 && msg.kind == MSG_PLAY && msg.field_count == 3 &&
+                msg.field_len[2] == 3);
+    assert_test(pass, "kind_play_optional",
+                "PLAY's optional clock field should get a length too");
+  }
+}
+
+void test_scanning() {
+  printf("\n--- Frame Scanning Tests ---\n");
+
+  {
+    // a digit run long enough for every scanner width, broken at each spot
+    int pass = 1;
+    for (int bad = 0; bad < 40; bad++) {
+      char buf[64];
+      char digits[41];
+      memset(digits, '7', 40);
+      digits[40] = '\0';
+      digits[bad] = bad % 2 ? 'a' : (char)0xb7;
+      int n = snprintf(buf, sizeof(buf), "0|%02d|MOVE|1|%s|", 48, digits);
+      Message msg;
+      if (decode_message(buf, n, &msg) != -1 ||
+          msg.error_code != ERR_INVALID) {
+        pass = 0;
+      }
+    }
+    assert_test(pass, "scan_move_digits",
+                "A non-digit anywhere in a long MOVE field should be caught");
+  }
+
+  {
+    char buf[128];
+    char name[73];
+    memset(name, 'n', 72);
+    name[72] = '\0';
+    name[63] = ' ';
+    name[64] = ' ';
+    int n = snprintf(buf, sizeof(buf), "0|80|NAME|2|%s|", name);
+    Message msg;
+    int result = decode_message(buf, n, &msg);
+    int pass = (result == 85 && msg.field_count == 2 &&
+                msg.field_len[1] == 72 && strcmp(msg.fields[1], name) == 0);
+    assert_test(pass, "scan_past_64",
+                "Delimiters past the first 64 bytes should be found");
+  }
+
+  {
+    char buf[128];
+    char name[81];
+    memset(name, 'x', 80);
+    name[80] = '\0';
+    name[70] = '|';
+    int n = snprintf(buf, sizeof(buf), "0|88|NAME|2|%s|", name);
+    Message msg;
+    int result = decode_message(buf, n, &msg);
+    assert_test(result == -1 && msg.error_code == ERR_INVALID, "scan_extra_bar",
+                "A stray delimiter late in the frame should be rejected");
+  }
+
+  {
+    const char *headers[] = {"1|05|WAIT|", "0:05|WAIT|", "0|0a|WAIT|",
+                             "0|\xb5|WAIT|", "0|05:WAIT|", "0|04|WAIT|"};
+    int pass = 1;
+    for (int i = 0; i < 6; i++) {
+      char buf[16];
+      strcpy(buf, headers[i]);
+      Message msg;
+      if (decode_message(buf, strlen(buf), &msg) != -1) {
+        pass = 0;
+      }
+    }
+    assert_test(pass, "scan_header", "Each malformed header byte is caught");
+  }
+}
+
+void test_batch() {
+  printf("\n--- decode_messages() Tests ---\n");
+
+  {
+    const char in[] = "0|09|MOVE|2|3|0|05|WAIT|0|11|OPEN|Alice|0|09|MO";
+    char buf[sizeof(in)];
+    memcpy(buf, in, sizeof(in));
+    FrameDesc frames[8];
+    int consumed;
+    int n = decode_messages(buf, strlen(buf), frames, 8, &consumed);
+    int pass = (n == 3 && consumed == 40 && frames[0].at == 0 &&
+                frames[1].at == 14 && frames[2].at == 24 &&
+                frames[0].kind == MSG_MOVE && frames[1].kind == MSG_WAIT &&
+                frames[2].kind == MSG_OPEN && frames[2].field_count == 1 &&
+                frames[2].field_at[0] == 10 && frames[2].field_len[0] == 5 &&
+                memcmp(buf, in, sizeof(in)) == 0);
+    assert_test(pass, "batch_stops_incomplete",
+                "Should return every complete frame and leave the buffer be");
+  }
+
+  {
+    char buf[] = "0|09|MOVE|2|3|0|09|MOVE|x|3|0|05|WAIT|";
+    FrameDesc frames[8];
+    int consumed;
+    int n = decode_messages(buf, strlen(buf), frames, 8, &consumed);
+    int pass = (n == 2 && consumed == 14 && frames[0].error_code == 0 &&
+                frames[1].error_code == ERR_INVALID && frames[1].at == 14);
+    assert_test(pass, "batch_stops_invalid",
+                "An invalid frame should come last and not be consumed");
+  }
+
+  {
+    char buf[] = "0|05|WAIT|0|05|WAIT|0|05|WAIT|";
+    FrameDesc frames[2];
+    int consumed;
+    int n = decode_messages(buf, strlen(buf), frames, 2, &consumed);
+    assert_test(n == 2 && consumed == 20, "batch_max",
+                "Should stop once the array is full");
+  }
+
+  {
+    char buf[] = "0|0";
+    FrameDesc frames[2];
+    int consumed = -1;
+    int n = decode_messages(buf, strlen(buf), frames, 2, &consumed);
+    assert_test(n == 0 && consumed == 0, "batch_empty",
+                "Nothing complete should give no frames");
+  }
+
+  {
+    char a[] = "0|17|PLAY|1|1 3 5|9 8|";
+    char b[sizeof(a)];
+    memcpy(b, a, sizeof(a));
+    Message one;
+    Message two;
+    decode_message(a, strlen(a), &one);
+    FrameDesc frame;
+    int consumed;
+    decode_messages(b, strlen(b), &frame, 1, &consumed);
+    frame_message(b, &frame, &two);
+    int pass = (one.kind == two.kind && one.length == two.length &&
+                strcmp(one.type, two.type) == 0 &&
+                one.field_count == two.field_count &&
+                two.fields[0] - b == one.fields[0] - a &&
+                strcmp(two.fields[2], "9 8") == 0 && two.fields[2][3] == '\0');
+    assert_test(pass, "frame_message",
+                "frame_message() should match decode_message()");
+  }
+}
+
+void test_streaming() {
+  printf("\n--- Streaming Decoder Tests ---\n");
+
+  {
+    // each frame fed a byte at a time must decode as it does whole
+    const char *in[] = {"0|05|WAIT|", "0|11|OPEN|Alice|", "0|09|MOVE|2|3|",
+                        "0|21|PLAY|2|1 3 5 7 9|9 8|",
+                        "0|18|OVER|1|1 3 5 7 9||"};
+    int pass = 1;
+    for (int f = 0; f < 5; f++) {
+      char whole[64];
+      char drip[64];
+      int len = strlen(in[f]);
+      strcpy(whole, in[f]);
+      strcpy(drip, in[f]);
+      Message a;
+      Message b;
+      int expect = decode_message(whole, len, &a);
+      Decoder st = {0};
+      int n = 0;
+      for (int have = 0; have <= len && n == 0; have++) {
+        n = decode_next(&st, drip, have, &b);
+        if (n == 0 && have == len) {
+          n = -2;
+        }
+      }
+      if (n != expect || a.kind != b.kind || a.field_count != b.field_count ||
+          st.scanned != 0) {
+        pass = 0;
+      }
+      for (int i = 0; i < a.field_count && pass; i++) {
+        pass = strcmp(a.fields[i], b.fields[i]) == 0;
+      }
+    }
+    assert_test(pass, "stream_drip",
+                "A frame fed byte by byte should decode the same");
+  }
+
+  {
+    char buf[] = "0|09|MOVE|2|3|";
+    Decoder st = {0};
+    Message msg;
+    int n = decode_next(&st, buf, 12, &msg);
+    int pass = (n == 0 && st.scanned == 12 && st.kind == MSG_MOVE &&
+                st.size == 14);
+    n = decode_next(&st, buf, 14, &msg);
+    pass = pass && n == 14 && strcmp(msg.fields[1], "3") == 0 &&
+           st.scanned == 0;
+    assert_test(pass, "stream_resume",
+                "Progress should be kept until the frame is complete");
+  }
+
+  {
+    char buf[] = "0|40|NOPE|";
+    Decoder st = {0};
+    Message msg;
+    int n = decode_next(&st, buf, 9, &msg);
+    assert_test(n == -1 && msg.error_code == ERR_INVALID && st.scanned == 0,
+                "stream_early_type",
+                "A bad type should fail before the rest arrives");
+  }
+
+  {
+    char buf[] = "0|40|MOVE|1|2|3|";
+    Decoder st = {0};
+    Message msg;
+    int n = decode_next(&st, buf, strlen(buf), &msg);
+    assert_test(n == -1 && msg.error_code == ERR_INVALID, "stream_early_bars",
+                "Too many fields should fail before the rest arrives");
+  }
+
+  {
+    char buf[] = "0|09|MOVE|2|3|0|09|MOVE|1|1|";
+    Decoder st = {0};
+    FrameDesc frames[4];
+    int consumed;
+    int n = decode_stream(&st, buf, 20, frames, 4, &consumed);
+    int pass = (n == 1 && consumed == 14 && st.scanned == 0);
+    // the second frame was not remembered, it starts over from its header
+    n = decode_stream(&st, buf + 14, 12, frames, 4, &consumed);
+    pass = pass && n == 0 && st.scanned == 12;
+    n = decode_stream(&st, buf + 14, 14, frames, 4, &consumed);
+    pass = pass && n == 1 && consumed == 14 && frames[0].kind == MSG_MOVE;
+    assert_test(pass, "stream_batch",
+                "decode_stream() should resume the frame at the start");
+  }
+}
+
+void test_views() {
+  printf("\n--- View Decoder Tests ---\n");
+
+  {
+    const char in[] = "0|21|PLAY|2|1 3 5 7 9|9 8|";
+    char buf[sizeof(in)];
+    memcpy(buf, in, sizeof(in));
+    MessageView msg;
+    int n = decode_view(NULL, buf, strlen(buf), &msg);
+    int pass = (n == 26 && msg.kind == MSG_PLAY && msg.length == 21 &&
+                msg.field_count == 3 && view_eq(msg.fields[0], "2") &&
+                view_eq(msg.fields[1], "1 3 5 7 9") &&
+                view_eq(msg.fields[2], "9 8") && msg.frame.data == buf &&
+                msg.frame.len == 26 && memcmp(buf, in, sizeof(in)) == 0);
+    assert_test(pass, "view_untouched",
+                "Should return views and leave the buffer as it was");
+  }
+
+  {
+    char buf[] = "0|11|OPEN|Al";
+    Decoder st = {0};
+    MessageView msg;
+    int n = decode_view(&st, buf, strlen(buf), &msg);
+    assert_test(n == 0 && st.scanned == 12, "view_partial",
+                "A partial frame should be remembered in the decoder");
+  }
+
+  {
+    char buf[] = "0|09|MOVE|a|3|";
+    MessageView msg;
+    int n = decode_view(NULL, buf, strlen(buf), &msg);
+    assert_test(n == -1 && msg.error_code == ERR_INVALID && msg.kind == -1,
+                "view_invalid", "Should report errors like decode_message()");
+  }
+
+  {
+    View empty = {"x", 0};
+    View word = {"Alice|", 5};
+    int pass = (view_eq(word, "Alice") && !view_eq(word, "Alic") &&
+                !view_eq(word, "Alice|") && view_eq(empty, ""));
+    assert_test(pass, "view_eq", "Should compare by length and bytes");
+  }
+
+  {
+    int v = -5;
+    View max = {"2147483647", 10};
+    View over = {"2147483648", 10};
+    View zeros = {"0007", 4};
+    View empty = {"", 0};
+    View sign = {"-1", 2};
+    int pass = (view_int(max, &v) == 0 && v == 2147483647);
+    pass = pass && view_int(zeros, &v) == 0 && v == 7;
+    v = 99;
+    pass = pass && view_int(over, &v) == -1 && view_int(empty, &v) == -1 &&
+           view_int(sign, &v) == -1 && v == 99;
+    assert_test(pass, "view_int",
+                "Should parse digits only, refusing what overflows an int");
+  }
+
+  {
+    char small[4];
+    char big[8];
+    View name = {"Bob|", 3};
+    int pass = (view_copy(name, small, sizeof(small)) == 3 &&
+                strcmp(small, "Bob") == 0);
+    View longer = {"Alice", 5};
+    pass = pass && view_copy(longer, small, sizeof(small)) == -1 &&
+           view_copy(longer, big, sizeof(big)) == 5;
+    assert_test(pass, "view_copy", "Should copy and terminate if it fits");
+  }
+}
+
+void test_payloads() {
+  printf("\n--- Typed Payload Tests ---\n");
+
+  {
+    char buf[] = "0|11|MOVE|4|123|";
+    MessageView msg;
+    int n = decode_view(NULL, buf, strlen(buf), &msg);
+    assert_test(n == 16 && msg.move.pile == 4 && msg.move.count == 123,
+                "payload_move", "MOVE should come with pile and count");
+  }
+
+  {
+    char buf[] = "0|27|MOVE|2147483647|2147483648|";
+    MessageView msg;
+    int n = decode_view(NULL, buf, strlen(buf), &msg);
+    assert_test(n == 32 && msg.move.pile == 2147483647 &&
+                    msg.move.count == -1,
+                "payload_move_overflow",
+                "A number past INT_MAX should be -1, not wrap");
+  }
+
+  {
+    char buf[] = "0|07|MOVE|||";
+    MessageView msg;
+    int n = decode_view(NULL, buf, strlen(buf), &msg);
+    assert_test(n == 12 && msg.move.pile == 0 && msg.move.count == 0,
+                "payload_move_empty", "Empty numbers should be 0, as atoi()");
+  }
+
+  {
+    char buf[] = "0|30|PLAY|2|1 0 5 17 9|59500 60000|";
+    MessageView msg;
+    decode_view(NULL, buf, strlen(buf), &msg);
+    Board *b = &msg.board;
+    int pass = (b->valid && b->player == 2 && b->piles[0] == 1 &&
+                b->piles[1] == 0 && b->piles[3] == 17 && b->piles[4] == 9 &&
+                b->clocked && b->clocks[0] == 59500 &&
+                b->clocks[1] == 60000 && msg.move.pile == -1);
+    assert_test(pass, "payload_play", "PLAY should come with the board");
+  }
+
+  {
+    char buf[] = "0|25|OVER|1|0 0 0 0 0|Forfeit|";
+    MessageView msg;
+    decode_view(NULL, buf, strlen(buf), &msg);
+    Board *b = &msg.board;
+    int pass = (b->valid && b->player == 1 && b->piles[2] == 0 &&
+                b->forfeit && !b->clocked);
+    assert_test(pass, "payload_over", "OVER should come with the winner");
+  }
+
+  {
+    const char *bad[] = {"0|13|PLAY|1|1 3 5|", "0|19|PLAY|1|1 3 5 7 9 1|",
+                         "0|16|PLAY|1|1 3  5 7|", "0|17|PLAY|x|1 3 5 7 9|",
+                         "0|19|PLAY|1|1 3 5 7 9|1|"};
+    int pass = 1;
+    for (int i = 0; i < 5; i++) {
+      char buf[32];
+      strcpy(buf, bad[i]);
+      MessageView msg;
+      if (decode_view(NULL, buf, strlen(buf), &msg) <= 0 || msg.board.valid) {
+        pass = 0;
+      }
+    }
+    assert_test(pass, "payload_bad_board",
+                "A malformed board should decode but not be valid");
+  }
+}
+
 int main() {
   printf("==============================================\n");
-  printf("   NGP Message Decoder Test Suite\n");
+  printf("   NGP Message Decoder Test Suite (%s)\n", decode_scan_path());
   printf("==============================================\n");
 
   test_valid_messages();
@@ -543,7 +1110,14 @@ int main() {
   test_invalid_format();
   test_edge_cases();
   test_encoder();
+  test_typed_encoders();
   test_encode_fail();
+  test_message_kind();
+  test_scanning();
+  test_batch();
+  test_streaming();
+  test_views();
+  test_payloads();
 
   printf("\n==============================================\n");
   printf("   Results: %d passed, %d failed\n", tests_passed, tests_failed);
@@ -8,6 +8,7 @@
 
 #include "decoder.h"
 #include "game.h"
+#include "metrics.h"
 
 static int tests_passed = 0;
 static int tests_failed = 0;
@@ -25,7 +26,7 @@ static void assert_test(int condition, const char *test_name,
 
 /* create a Player struct with a socketpair for testing.
  * Returns the other end socket that simulates the network peer.
- * Caller must free p->buffer and close both sockets. */
+ * Caller must free p->in and close both sockets. */
 static int create_test_player(Player *p, int p_num) {
   int sv[2];
   if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
@@ -37,9 +38,15 @@ static int create_test_player(Player *p, int p_num) {
   p->name[0] = '\0';
   p->p_num = p_num;
   p->opened = 0;
-  p->buffer = malloc(BUFLEN);
-  p->buffer_size = 0;
+  ring_init(&p->in, INLEN);
+  decoder_reset(&p->dec);
   p->playing = 0;
+  p->out = NULL;
+  p->outs = NULL;
+  p->out_head = 0;
+  p->out_size = 0;
+  p->out_full = 0;
+  p->paused = 0;
 
   int flags = fcntl(p->sock, F_GETFL, 0);
   fcntl(p->sock, F_SETFL, flags | O_NONBLOCK);
@@ -47,9 +54,15 @@ static int create_test_player(Player *p, int p_num) {
   return sv[1];
 }
 
+/* replaces whatever input the player has buffered with @data */
+static void fill_input(Player *p, const char *data, unsigned len) {
+  p->in.head = 0;
+  p->in.used = 0;
+  ring_write(&p->in, data, len);
+}
+
 static void cleanup_test_player(Player *p, int peer_sock) {
-  if (p->buffer)
-    free(p->buffer);
+  ring_free(&p->in);
   if (p->sock >= 0)
     close(p->sock);
   if (peer_sock >= 0)
@@ -361,6 +374,114 @@ void test_do_move() {
   }
 }
 
+/* the cached frame has to read exactly like a freshly encoded one */
+static int frame_matches(Game *g) {
+  char buf[FRAME_MAX];
+  int len = encode_play(buf, sizeof(buf), g->curr_player, g->piles, NULL);
+  return g->frame_len == len && memcmp(g->frame, buf, len) == 0;
+}
+
+void test_play_frame() {
+  printf("\n--- Cached PLAY Frame Tests ---\n");
+
+  {
+    Game g;
+    init_game(&g);
+    assert_test(frame_matches(&g), "frame_initial",
+                "Cached frame should be the opening PLAY");
+  }
+
+  {
+    Game g;
+    init_game(&g);
+    int moves[][2] = {{4, 2}, {0, 1}, {2, 5}, {3, 6}, {1, 3}, {4, 7}};
+    int pass = 1;
+    for (int i = 0; i < 6; i++) {
+      do_move(&g, moves[i][0], moves[i][1]);
+      if (!frame_matches(&g)) {
+        pass = 0;
+      }
+    }
+    assert_test(pass, "frame_patched",
+                "do_move() should keep the cached frame up to date");
+  }
+
+  {
+    Game g;
+    init_game(&g);
+    do_move(&g, 5, 1);
+    do_move(&g, 1, 9);
+    assert_test(frame_matches(&g), "frame_invalid_move",
+                "Rejected moves should leave the frame alone");
+  }
+
+  {
+    Game g;
+    init_game(&g);
+    g.piles[0] = 12;
+    g.piles[2] = 100;
+    render_play(&g);
+    do_move(&g, 0, 5);
+    int pass1 = frame_matches(&g);
+    do_move(&g, 2, 91);
+    int pass2 = frame_matches(&g);
+    do_move(&g, 0, 7);
+    int pass3 = frame_matches(&g);
+    assert_test(pass1 && pass2 && pass3 && g.frame_len == 22,
+                "frame_digits_shrink",
+                "Fewer digits should shift the frame and fix the header");
+  }
+
+  {
+    Player p1, p2;
+    int peer1 = create_test_player(&p1, 1);
+    int peer2 = create_test_player(&p2, 2);
+    Game g;
+    init_game(&g);
+    g.clocked = 1;
+    g.clock[0] = 59500;
+    g.clock[1] = 600;
+    do_move(&g, 4, 9);
+    send_play(&p1, &p2, &g);
+
+    char resp[BUFLEN];
+    int n = read_response(peer2, resp, sizeof(resp));
+    int pass = (n > 0 && strcmp(resp, "0|27|PLAY|2|1 3 5 7 0|59500 600|") == 0);
+    assert_test(pass, "frame_clocks", "PLAY should carry the current clocks");
+
+    cleanup_test_player(&p1, peer1);
+    cleanup_test_player(&p2, peer2);
+  }
+
+  {
+    Player p1, p2;
+    int peer1 = create_test_player(&p1, 1);
+    int peer2 = create_test_player(&p2, 2);
+    Game g;
+    init_game(&g);
+    do_move(&g, 2, 4);
+    send_over(&g, &p1, &p2, 2, 1);
+
+    char resp1[BUFLEN];
+    char resp2[BUFLEN];
+    read_response(peer1, resp1, sizeof(resp1));
+    read_response(peer2, resp2, sizeof(resp2));
+    int pass = (strcmp(resp1, "0|25|OVER|2|1 3 1 7 9|Forfeit|") == 0 &&
+                strcmp(resp2, resp1) == 0);
+
+    init_game(&g);
+    send_over(&g, &p1, NULL, 1, 0);
+    read_response(peer1, resp1, sizeof(resp1));
+    pass = pass && strcmp(resp1, "0|18|OVER|1|1 3 5 7 9||") == 0;
+
+    assert_test(pass, "over_from_frame",
+                "OVER should be built from the cached board");
+
+    cleanup_test_player(&p1, peer1);
+    cleanup_test_player(&p2, peer2);
+  }
+}
+
 void test_openGame() {
   printf("\n--- openGame() Tests ---\n");
 
@@ -370,8 +491,7 @@ void test_openGame() {
     int peer = create_test_player(&p, 1);
 
     char msg[] = "0|11|OPEN|Alice|";
-    memcpy(p.buffer, msg, sizeof(msg) - 1);
-    p.buffer_size = sizeof(msg) - 1;
+    fill_input(&p, msg, sizeof(msg) - 1);
 
     int result = openGame(&p);
 
@@ -386,6 +506,25 @@ void test_openGame() {
     cleanup_test_player(&p, peer);
   }
 
+  /* the frame is left as it arrived */
+  {
+    Player p;
+    int peer = create_test_player(&p, 1);
+
+    char msg[] = "0|11|OPEN|Alice|";
+    fill_input(&p, msg, sizeof(msg) - 1);
+
+    int result = openGame(&p);
+
+    int pass = (result == 1 && strcmp(p.name, "Alice") == 0 &&
+                memcmp(p.in.data, msg, sizeof(msg) - 1) == 0);
+
+    assert_test(pass, "open_untouched",
+                "Decoding OPEN should not write to the input");
+
+    cleanup_test_player(&p, peer);
+  }
+
   /* OPEN with max length name (72 chars) */
   {
     Player p;
@@ -398,8 +537,7 @@ void test_openGame() {
     char msg[128];
     int len = snprintf(msg, sizeof(msg), "0|78|OPEN|%s|", name72);
 
-    memcpy(p.buffer, msg, len);
-    p.buffer_size = len;
+    fill_input(&p, msg, len);
 
     int result = openGame(&p);
 
@@ -422,8 +560,7 @@ void test_openGame() {
     char msg[128];
     int len = snprintf(msg, sizeof(msg), "0|79|OPEN|%s|", name73);
 
-    memcpy(p.buffer, msg, len);
-    p.buffer_size = len;
+    fill_input(&p, msg, len);
 
     int result = openGame(&p);
 
@@ -440,8 +577,7 @@ void test_openGame() {
     int peer = create_test_player(&p, 1);
 
     char msg[] = "0|06|OPEN||";
-    memcpy(p.buffer, msg, sizeof(msg) - 1);
-    p.buffer_size = sizeof(msg) - 1;
+    fill_input(&p, msg, sizeof(msg) - 1);
 
     int result = openGame(&p);
 
@@ -458,8 +594,7 @@ void test_openGame() {
     int peer = create_test_player(&p, 1);
 
     char msg[] = "0|09|MOVE|1|2|";
-    memcpy(p.buffer, msg, sizeof(msg) - 1);
-    p.buffer_size = sizeof(msg) - 1;
+    fill_input(&p, msg, sizeof(msg) - 1);
 
     int result = openGame(&p);
 
@@ -476,8 +611,7 @@ void test_openGame() {
     int peer = create_test_player(&p, 1);
 
     char msg1[] = "0|09|OPEN|Bob|";
-    memcpy(p.buffer, msg1, sizeof(msg1) - 1);
-    p.buffer_size = sizeof(msg1) - 1;
+    fill_input(&p, msg1, sizeof(msg1) - 1);
 
     int result1 = openGame(&p);
 
@@ -485,8 +619,7 @@ void test_openGame() {
     read_response(peer, resp, sizeof(resp));
 
     char msg2[] = "0|10|OPEN|Bob2|";
-    memcpy(p.buffer, msg2, sizeof(msg2) - 1);
-    p.buffer_size = sizeof(msg2) - 1;
+    fill_input(&p, msg2, sizeof(msg2) - 1);
 
     int result2 = openGame(&p);
 
@@ -507,13 +640,12 @@ void test_openGame() {
     int peer = create_test_player(&p, 1);
 
     char msg[] = "0|11|OPEN|Ali";
-    memcpy(p.buffer, msg, sizeof(msg) - 1);
-    p.buffer_size = sizeof(msg) - 1;
+    fill_input(&p, msg, sizeof(msg) - 1);
 
     int result = openGame(&p);
 
     int pass = (result == 0 && p.opened == 0 &&
-                p.buffer_size == (int)(sizeof(msg) - 1));
+                ring_used(&p.in) == sizeof(msg) - 1);
 
     assert_test(pass, "incomplete", "Incomplete message should return 0");
 
@@ -526,8 +658,7 @@ void test_openGame() {
     int peer = create_test_player(&p, 1);
 
     char msg[] = "1|11|OPEN|Alice|";
-    memcpy(p.buffer, msg, sizeof(msg) - 1);
-    p.buffer_size = sizeof(msg) - 1;
+    fill_input(&p, msg, sizeof(msg) - 1);
 
     int result = openGame(&p);
 
@@ -544,13 +675,12 @@ void test_openGame() {
     int peer = create_test_player(&p, 1);
 
     char msg[] = "0|10|OPEN|Test|EXTRA";
-    memcpy(p.buffer, msg, sizeof(msg) - 1);
-    p.buffer_size = sizeof(msg) - 1;
+    fill_input(&p, msg, sizeof(msg) - 1);
 
     int result = openGame(&p);
 
-    int pass = (result == 1 && p.buffer_size == 5 &&
-                strncmp(p.buffer, "EXTRA", 5) == 0);
+    int pass = (result == 1 && ring_used(&p.in) == 5 &&
+                strncmp(ring_read_ptr(&p.in), "EXTRA", 5) == 0);
 
     assert_test(pass, "buffer_consumed",
                 "Should consume message and leave extra data");
@@ -564,8 +694,7 @@ void test_openGame() {
     int peer = create_test_player(&p, 1);
 
     char msg[] = "0|17|OPEN|John Doe Jr|";
-    memcpy(p.buffer, msg, sizeof(msg) - 1);
-    p.buffer_size = sizeof(msg) - 1;
+    fill_input(&p, msg, sizeof(msg) - 1);
 
     int result = openGame(&p);
 
@@ -582,8 +711,7 @@ void test_openGame() {
     int peer = create_test_player(&p, 1);
 
     char msg[] = "0|15|OPEN|Test-._@!|";
-    memcpy(p.buffer, msg, sizeof(msg) - 1);
-    p.buffer_size = sizeof(msg) - 1;
+    fill_input(&p, msg, sizeof(msg) - 1);
 
     int result = openGame(&p);
 
@@ -600,7 +728,7 @@ void test_openGame() {
     Player p;
     int peer = create_test_player(&p, 1);
 
-    p.buffer_size = 0;
+    fill_input(&p, "", 0);
 
     int result = openGame(&p);
 
@@ -617,8 +745,7 @@ void test_openGame() {
     int peer = create_test_player(&p, 1);
 
     char msg[] = "0|14|OPEN|Bad|Name|";
-    memcpy(p.buffer, msg, sizeof(msg) - 1);
-    p.buffer_size = sizeof(msg) - 1;
+    fill_input(&p, msg, sizeof(msg) - 1);
 
     int result = openGame(&p);
 
@@ -636,8 +763,7 @@ void test_openGame() {
     int peer = create_test_player(&p, 1);
 
     char msg[] = "0|11|OPEN|Alice|";
-    memcpy(p.buffer, msg, sizeof(msg) - 1);
-    p.buffer_size = sizeof(msg) - 1;
+    fill_input(&p, msg, sizeof(msg) - 1);
 
     int result = openGame(&p);
 
@@ -663,8 +789,7 @@ void test_openGame() {
     char msg[128];
     int len = snprintf(msg, sizeof(msg), "0|79|OPEN|%s|", name73);
 
-    memcpy(p.buffer, msg, len);
-    p.buffer_size = len;
+    fill_input(&p, msg, len);
 
     int result = openGame(&p);
 
@@ -686,8 +811,7 @@ void test_openGame() {
     int peer = create_test_player(&p, 1);
 
     char msg1[] = "0|09|OPEN|Bob|";
-    memcpy(p.buffer, msg1, sizeof(msg1) - 1);
-    p.buffer_size = sizeof(msg1) - 1;
+    fill_input(&p, msg1, sizeof(msg1) - 1);
 
     openGame(&p);
 
@@ -695,8 +819,7 @@ void test_openGame() {
     read_response(peer, resp, sizeof(resp));
 
     char msg2[] = "0|10|OPEN|Bob2|";
-    memcpy(p.buffer, msg2, sizeof(msg2) - 1);
-    p.buffer_size = sizeof(msg2) - 1;
+    fill_input(&p, msg2, sizeof(msg2) - 1);
 
     int result2 = openGame(&p);
 
@@ -717,8 +840,7 @@ void test_openGame() {
     int peer = create_test_player(&p, 1);
 
     char msg[] = "0|09|MOVE|1|2|";
-    memcpy(p.buffer, msg, sizeof(msg) - 1);
-    p.buffer_size = sizeof(msg) - 1;
+    fill_input(&p, msg, sizeof(msg) - 1);
 
     int result = openGame(&p);
 
@@ -848,6 +970,246 @@ void test_playGame() {
     cleanup_test_player(&p1, peer1);
     cleanup_test_player(&p2, peer2);
   }
+
+  /* frames arriving in one read are all answered */
+  {
+    Player p1, p2;
+    int peer1 = create_test_player(&p1, 1);
+    int peer2 = create_test_player(&p2, 2);
+
+    strcpy(p1.name, "Alice");
+    strcpy(p2.name, "Bob");
+    p1.opened = 1;
+    p2.opened = 1;
+
+    char moves[] = "0|09|MOVE|0|1|0|09|MOVE|1|1|";
+    write(peer1, moves, sizeof(moves) - 1);
+
+    playGame(&p1, &p2);
+
+    char resp1[1024];
+    read_response(peer1, resp1, sizeof(resp1));
+
+    /* the second MOVE is out of turn once the first one is played */
+    int pass = (strstr(resp1, "PLAY|2|0 3 5 7 9|") != NULL &&
+                strstr(resp1, "31 Impatient") != NULL);
+
+    assert_test(pass, "drains_pipelined",
+                "Both pipelined MOVEs should be handled in one go");
+
+    cleanup_test_player(&p1, peer1);
+    cleanup_test_player(&p2, peer2);
+  }
+
+  /* numbers too big for an int are bad moves, not wrapped around */
+  {
+    Player p1, p2;
+    int peer1 = create_test_player(&p1, 1);
+    int peer2 = create_test_player(&p2, 2);
+
+    strcpy(p1.name, "Alice");
+    strcpy(p2.name, "Bob");
+    p1.opened = 1;
+    p2.opened = 1;
+
+    char moves[] = "0|18|MOVE|4294967296|1|0|18|MOVE|0|4294967297|";
+    write(peer1, moves, sizeof(moves) - 1);
+
+    playGame(&p1, &p2);
+
+    char resp1[1024];
+    read_response(peer1, resp1, sizeof(resp1));
+
+    int pass = (strstr(resp1, "32 Pile Index") != NULL &&
+                strstr(resp1, "33 Quantity") != NULL &&
+                strstr(resp1, "PLAY|2|") == NULL);
+
+    assert_test(pass, "move_overflow",
+                "Numbers past INT_MAX should fail, not wrap into a move");
+
+    cleanup_test_player(&p1, peer1);
+    cleanup_test_player(&p2, peer2);
+  }
+
+  /* an empty pile reads as 0, the way atoi() read it */
+  {
+    Player p1, p2;
+    int peer1 = create_test_player(&p1, 1);
+    int peer2 = create_test_player(&p2, 2);
+
+    strcpy(p1.name, "Alice");
+    strcpy(p2.name, "Bob");
+    p1.opened = 1;
+    p2.opened = 1;
+
+    char move[] = "0|08|MOVE||1|";
+    write(peer1, move, sizeof(move) - 1);
+
+    playGame(&p1, &p2);
+
+    char resp1[1024];
+    read_response(peer1, resp1, sizeof(resp1));
+
+    int pass = (strstr(resp1, "PLAY|2|0 3 5 7 9|") != NULL &&
+                strstr(resp1, "FAIL") == NULL);
+
+    assert_test(pass, "move_empty_pile", "An empty pile should be pile 0");
+
+    cleanup_test_player(&p1, peer1);
+    cleanup_test_player(&p2, peer2);
+  }
+
+  /* the waiting player moving is told off without waiting for its turn */
+  {
+    Player p1, p2;
+    int peer1 = create_test_player(&p1, 1);
+    int peer2 = create_test_player(&p2, 2);
+
+    strcpy(p1.name, "Alice");
+    strcpy(p2.name, "Bob");
+    p1.opened = 1;
+    p2.opened = 1;
+
+    char move[] = "0|09|MOVE|2|1|";
+    write(peer2, move, sizeof(move) - 1);
+
+    playGame(&p1, &p2);
+
+    char resp2[1024];
+    read_response(peer2, resp2, sizeof(resp2));
+
+    int pass = strstr(resp2, "31 Impatient") != NULL;
+
+    assert_test(pass, "impatient_waiting",
+                "MOVE from the waiting player should get 31 Impatient");
+
+    cleanup_test_player(&p1, peer1);
+    cleanup_test_player(&p2, peer2);
+  }
+
+  /* the waiting player hanging up forfeits */
+  {
+    Player p1, p2;
+    int peer1 = create_test_player(&p1, 1);
+    int peer2 = create_test_player(&p2, 2);
+
+    strcpy(p1.name, "Alice");
+    strcpy(p2.name, "Bob");
+    p1.opened = 1;
+    p2.opened = 1;
+
+    shutdown(peer2, SHUT_WR);
+
+    playGame(&p1, &p2);
+
+    char resp1[1024];
+    read_response(peer1, resp1, sizeof(resp1));
+
+    int pass = strstr(resp1, "OVER|1|1 3 5 7 9|Forfeit|") != NULL;
+
+    assert_test(pass, "waiting_hangup",
+                "Player 1 should win by forfeit when player 2 leaves");
+
+    cleanup_test_player(&p1, peer1);
+    cleanup_test_player(&p2, peer2);
+  }
+}
+
+void test_output_queue() {
+  printf("\n--- Pooled Output Queue Tests ---\n");
+
+  /* a queue is taken on the first frame and given back once sent */
+  {
+    Player p;
+    int peer = create_test_player(&p, 1);
+    Slab outs;
+    slab_init(&outs, OUTLEN, 1, 0);
+    p.outs = &outs;
+
+    player_send(&p, "0|05|WAIT|", 10);
+    int attached = p.out != NULL && p.out_size == 10;
+    player_flush(&p);
+    char resp[BUFLEN];
+    int n = read_response(peer, resp, sizeof(resp));
+    SlabStats st;
+    slab_stats(&outs, &st);
+    int pass = attached && n == 10 && p.out == NULL && st.in_use == 0;
+    assert_test(pass, "queue_lends",
+                "the queue should only be held while frames are queued");
+
+    p.outs = NULL;
+    slab_destroy(&outs);
+    cleanup_test_player(&p, peer);
+  }
+
+  /* with the pool spent, a frame is refused like a full queue */
+  {
+    Player p1, p2;
+    int peer1 = create_test_player(&p1, 1);
+    int peer2 = create_test_player(&p2, 2);
+    Slab outs;
+    slab_init(&outs, OUTLEN, 1, 0);
+    p1.outs = &outs;
+    p2.outs = &outs;
+
+    player_send(&p1, "0|05|WAIT|", 10);
+    player_send(&p2, "0|05|WAIT|", 10);
+    int pass = p1.out != NULL && p2.out == NULL && p2.out_full;
+    player_discard(&p1);
+    SlabStats st;
+    slab_stats(&outs, &st);
+    pass = pass && p1.out == NULL && p1.out_size == 0 && st.in_use == 0;
+    assert_test(pass, "queue_spent",
+                "no queue to be had should count as a full one");
+
+    p1.outs = NULL;
+    p2.outs = NULL;
+    slab_destroy(&outs);
+    cleanup_test_player(&p1, peer1);
+    cleanup_test_player(&p2, peer2);
+  }
+}
+
+void test_game_metrics() {
+  printf("\n--- Game Metrics Tests ---\n");
+
+  /* a game is counted once when it starts and once when it ends */
+  {
+    Player p1, p2;
+    int peer1 = create_test_player(&p1, 1);
+    int peer2 = create_test_player(&p2, 2);
+    static MetricShard before, after;
+    metrics_sum(&before);
+
+    p1.since = metrics_now_us();
+    p2.since = p1.since;
+    Game g;
+    start_game(&g, &p1, &p2, 0);
+    send_fail(&p1, ERR_IMPATIENT);
+    send_over(&g, &p1, &p2, 1, 1);
+    send_over(&g, &p1, &p2, 1, 1);
+    metrics_sum(&after);
+
+    uint64_t names = 0, games = 0;
+    for (int i = 0; i <= HIST_BUCKETS; i++) {
+      names += after.hists[H_OPEN_NAME].buckets[i] -
+               before.hists[H_OPEN_NAME].buckets[i];
+      games += after.hists[H_GAME].buckets[i] - before.hists[H_GAME].buckets[i];
+    }
+    int pass =
+        after.counters[M_GAMES_STARTED] == before.counters[M_GAMES_STARTED] + 1 &&
+        after.counters[M_GAMES_FINISHED] ==
+            before.counters[M_GAMES_FINISHED] + 1 &&
+        after.counters[M_GAMES_FORFEITED] ==
+            before.counters[M_GAMES_FORFEITED] + 1 &&
+        after.fails[ERR_IMPATIENT] == before.fails[ERR_IMPATIENT] + 1 &&
+        names == 2 && games == 1;
+    assert_test(pass, "game_counted_once",
+                "start, end and OPEN -> NAME should be recorded once");
+
+    cleanup_test_player(&p1, peer1);
+    cleanup_test_player(&p2, peer2);
+  }
 }
 
 int main() {
@@ -858,8 +1220,11 @@ int main() {
   test_init_game();
   test_is_game_over();
   test_do_move();
+  test_play_frame();
   test_openGame();
   test_playGame();
+  test_output_queue();
+  test_game_metrics();
 
   printf("\n==============================================\n");
   printf("   Results: %d passed, %d failed\n", tests_passed, tests_failed);
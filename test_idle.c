@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "server.h"
+
+/*
+ * test_idle - memory the event loop holds per idle connection
+ *
+ * Runs run_event_loop() on a thread of this process and opens CONNECTIONS
+ * connections that then sit idle, twice over: connected but silent, as
+ * before OPEN, and opened and matched, in a game where nobody moves. The
+ * growth of the process's resident memory divided by the number of
+ * connections is the figure, which has to stay within the budgets below.
+ * Socket buffers live in the kernel and are not counted.
+ *
+ * The pool is sized past vm.max_map_count, which a server that mapped
+ * every session's input ring up front could not start with.
+ *
+ * Built without the sanitizers, whose shadow memory would be counted too.
+ */
+
+#define CONNECTIONS 2000
+#define WARMUP_GAMES 16
+// bytes per connection, with room for the names table's growth steps
+#define SILENT_BUDGET 640
+#define PLAYING_BUDGET 1024
+
+static int tests_passed = 0;
+static int tests_failed = 0;
+
+static void assert_test(int condition, const char *test_name,
+                        const char *message) {
+  if (condition) {
+    printf("  PASS: %s\n", test_name);
+    tests_passed++;
+  } else {
+    printf("  FAIL: %s - %s\n", test_name, message);
+    tests_failed++;
+  }
+}
+
+static volatile int running = 1;
+static int listener;
+static int port;
+static ServerConfig cfg = {BACKEND_EPOLL, 0, 0, 0, 0, 3 * CONNECTIONS, 0};
+
+static void *serve(void *arg) {
+  (void)arg;
+  run_event_loop(listener, &cfg, &running);
+  return NULL;
+}
+
+// the most mappings a process may have, 65530 unless changed
+static int max_map_count(void) {
+  FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+  int count = 65530;
+  if (f != NULL) {
+    if (fscanf(f, "%d", &count) != 1) {
+      count = 65530;
+    }
+    fclose(f);
+  }
+  return count;
+}
+
+static long resident_bytes(void) {
+  FILE *f = fopen("/proc/self/statm", "r");
+  long size = 0, resident = 0;
+  if (f != NULL) {
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(f);
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+static int connect_local(void) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("connect");
+    exit(EXIT_FAILURE);
+  }
+  // a server that did not start is a failed read, not a hang
+  struct timeval tv = {5, 0};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  return sock;
+}
+
+// reads until @until has arrived. Returns 0, or -1 if the server hung up
+static int expect(int sock, const char *until) {
+  char buf[512];
+  int len = 0;
+  while (len < (int)sizeof(buf) - 1) {
+    int n = read(sock, buf + len, sizeof(buf) - 1 - len);
+    if (n <= 0) {
+      return -1;
+    }
+    len += n;
+    buf[len] = '\0';
+    if (strstr(buf, until) != NULL) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static void send_open(int sock, const char *name) {
+  char frame[128];
+  int len = snprintf(frame, sizeof(frame), "0|%02d|OPEN|%s|",
+                     (int)strlen(name) + 6, name);
+  if (write(sock, frame, len) != len) {
+    perror("write");
+  }
+}
+
+// opens @pairs games and reads up to their first PLAY. Returns how many
+// players got that far
+static int start_games(int *socks, int pairs, int first) {
+  int ok = 0;
+  for (int i = 0; i < 2 * pairs; i += 2) {
+    char name[32];
+    socks[i] = connect_local();
+    socks[i + 1] = connect_local();
+    snprintf(name, sizeof(name), "idle%d", first + i);
+    send_open(socks[i], name);
+    expect(socks[i], "WAIT|");
+    snprintf(name, sizeof(name), "idle%d", first + i + 1);
+    send_open(socks[i + 1], name);
+    ok += expect(socks[i], "PLAY|") == 0;
+    ok += expect(socks[i + 1], "PLAY|") == 0;
+  }
+  return ok;
+}
+
+// connections are accepted in order, so once one made now has been
+// served every earlier one has been accepted too. Returns 0, or -1 if the
+// server did not answer
+static int sync_server(void) {
+  int sock = connect_local();
+  send_open(sock, "sync");
+  int ok = expect(sock, "WAIT|");
+  close(sock);
+  usleep(100 * 1000);
+  return ok;
+}
+
+int main() {
+  printf("==============================================\n");
+  printf("   Idle Connection Memory Test\n");
+  printf("==============================================\n");
+
+  // both ends of every connection are in this process
+  struct rlimit lim;
+  getrlimit(RLIMIT_NOFILE, &lim);
+  lim.rlim_cur = lim.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &lim);
+  if (lim.rlim_cur < 4 * CONNECTIONS + 256) {
+    printf("needs %d file descriptors, the limit is %ld\n",
+           4 * CONNECTIONS + 256, (long)lim.rlim_cur);
+    return EXIT_FAILURE;
+  }
+
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+  if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listener, 4096) < 0 ||
+      getsockname(listener, (struct sockaddr *)&addr, &addr_len) < 0) {
+    perror("listen");
+    return EXIT_FAILURE;
+  }
+  port = ntohs(addr.sin_port);
+
+  // the server's logging would otherwise grow the pipe it writes to
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  if (freopen("/dev/null", "w", stdout) == NULL) {
+    return EXIT_FAILURE;
+  }
+
+  cfg.max_sessions = max_map_count() + 3 * CONNECTIONS;
+  pthread_t thread;
+  pthread_create(&thread, NULL, serve, NULL);
+  if (sync_server() < 0) {
+    pthread_join(thread, NULL);
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    clearerr(stdout);
+    printf("\n");
+    assert_test(0, "pool_past_map_count",
+                "the server should start with a pool this large");
+    return EXIT_FAILURE;
+  }
+
+  // one-off costs: code pages, the first slab pages, stdio buffers
+  int warm[2 * WARMUP_GAMES];
+  start_games(warm, WARMUP_GAMES, 100000);
+  sync_server();
+  long base = resident_bytes();
+
+  static int silent[CONNECTIONS];
+  for (int i = 0; i < CONNECTIONS; i++) {
+    silent[i] = connect_local();
+  }
+  sync_server();
+  long after_silent = resident_bytes();
+
+  static int playing[CONNECTIONS];
+  int started = start_games(playing, CONNECTIONS / 2, 0);
+  sync_server();
+  // the player not to move keeps its ring this long
+  usleep(INPUT_REST_MS * 1000);
+  long after_playing = resident_bytes();
+
+  running = 0;
+  // wakes the loop up to notice
+  close(connect_local());
+  pthread_join(thread, NULL);
+  for (int i = 0; i < CONNECTIONS; i++) {
+    close(silent[i]);
+    close(playing[i]);
+  }
+  for (int i = 0; i < 2 * WARMUP_GAMES; i++) {
+    close(warm[i]);
+  }
+  close(listener);
+
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+  clearerr(stdout);
+
+  double silent_each = (double)(after_silent - base) / CONNECTIONS;
+  double playing_each = (double)(after_playing - after_silent) / CONNECTIONS;
+  printf("\n%d connections each way, resident bytes per connection:\n",
+         CONNECTIONS);
+  printf("  silent, before OPEN:    %8.0f\n", silent_each);
+  printf("  in a game, not moving:  %8.0f\n\n", playing_each);
+
+  assert_test(1, "pool_past_map_count",
+              "the server should start with a pool this large");
+  assert_test(started == CONNECTIONS, "games_started",
+              "every pair should have reached its first PLAY");
+  assert_test(silent_each <= SILENT_BUDGET, "silent_budget",
+              "a connection that sent nothing should cost little");
+  assert_test(playing_each <= PLAYING_BUDGET, "playing_budget",
+              "an idle player should not hold buffers");
+
+  printf("\n==============================================\n");
+  printf("   Results: %d passed, %d failed\n", tests_passed, tests_failed);
+  printf("==============================================\n");
+
+  return (tests_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
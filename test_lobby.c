@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lobby.h"
+
+/*
+ * test_lobby - the fork and prefork servers' matchmaking queue
+ *
+ * Players are socketpairs queued with lobby_add(), the test keeping the
+ * client end. Whatever a client writes is in the server end by the time
+ * write() returns, so one lobby_poll() with a timeout of 0 handles it,
+ * and the lobby's replies are there to read as soon as it returns. The
+ * listener is a real one on 127.0.0.1 that nothing connects to but the
+ * handshake deadline tests, which also need a connection it accepts.
+ */
+
+#define HANDSHAKE_MS 200
+
+static int tests_passed = 0;
+static int tests_failed = 0;
+
+static void assert_test(int condition, const char *test_name,
+                        const char *message) {
+  if (condition) {
+    printf("  PASS: %s\n", test_name);
+    tests_passed++;
+  } else {
+    printf("  FAIL: %s - %s\n", test_name, message);
+    tests_failed++;
+  }
+}
+
+static int listener;
+static int port;
+
+static int open_listener(void) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(sock, 16) < 0) {
+    perror("listener");
+    exit(EXIT_FAILURE);
+  }
+  socklen_t len = sizeof(addr);
+  getsockname(sock, (struct sockaddr *)&addr, &len);
+  port = ntohs(addr.sin_port);
+  return sock;
+}
+
+static int connect_local(void) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("connect");
+    exit(EXIT_FAILURE);
+  }
+  return sock;
+}
+
+// queues a new player and returns the client end
+static int join(Lobby *l) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    perror("socketpair");
+    exit(EXIT_FAILURE);
+  }
+  if (lobby_add(l, sv[1]) < 0) {
+    fprintf(stderr, "lobby_add failed\n");
+    exit(EXIT_FAILURE);
+  }
+  return sv[0];
+}
+
+static void send_raw(int sock, const char *data) {
+  int len = strlen(data);
+  if (write(sock, data, len) != len) {
+    perror("write");
+  }
+}
+
+static void send_open(int sock, const char *name) {
+  char frame[128];
+  snprintf(frame, sizeof(frame), "0|%02d|OPEN|%s|", (int)strlen(name) + 6,
+           name);
+  send_raw(sock, frame);
+}
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// handles what the clients have sent so far
+static void step(Lobby *l) {
+  if (lobby_poll(l, listener, 0) < 0) {
+    perror("lobby_poll");
+  }
+}
+
+// reads what the lobby sent, up to its closing the connection. Returns 1
+// if it is exactly @want and the connection was closed after it as
+// @closed says
+static int got(int sock, const char *want, int closed) {
+  char buf[256];
+  int len = 0;
+  int eof = 0;
+  struct pollfd pfd = {sock, POLLIN, 0};
+  while (len < (int)sizeof(buf) - 1 && poll(&pfd, 1, 0) > 0) {
+    int n = read(sock, buf + len, sizeof(buf) - 1 - len);
+    if (n <= 0) {
+      eof = 1;
+      break;
+    }
+    len += n;
+  }
+  buf[len] = '\0';
+  return strcmp(buf, want) == 0 && eof == closed;
+}
+
+static int matched(Lobby *l, const char *name1, const char *name2) {
+  Player p1, p2;
+  if (!lobby_match(l, &p1, &p2)) {
+    return 0;
+  }
+  int ok = strcmp(p1.name, name1) == 0 && strcmp(p2.name, name2) == 0 &&
+           p1.p_num == 1 && p2.p_num == 2;
+  // as the server would once the game is over
+  ring_free(&p1.in);
+  ring_free(&p2.in);
+  close(p1.sock);
+  close(p2.sock);
+  return ok;
+}
+
+// players are paired in the order they connected, not the order they
+// opened in, and one that has not opened is passed over
+void test_fifo() {
+  Lobby l;
+  lobby_init(&l, 0);
+  int a = join(&l), b = join(&l), c = join(&l), d = join(&l);
+  send_open(d, "d");
+  step(&l);
+  send_open(c, "c");
+  step(&l);
+  send_open(b, "b");
+  step(&l);
+  send_open(a, "a");
+  step(&l);
+  assert_test(got(a, "0|05|WAIT|", 0) && got(d, "0|05|WAIT|", 0),
+              "fifo_wait", "every opened player should get WAIT");
+  assert_test(matched(&l, "a", "b") && matched(&l, "c", "d"), "fifo_order",
+              "pairs should be made in the order the players connected");
+  assert_test(!matched(&l, "", "") && l.count == 0, "fifo_empty",
+              "nobody should be left to match");
+
+  int e = join(&l), f = join(&l), g = join(&l);
+  send_open(f, "f");
+  send_open(g, "g");
+  step(&l);
+  assert_test(matched(&l, "f", "g") && l.count == 1, "fifo_unopened",
+              "a player yet to open should be passed over, and kept");
+  close(a);
+  close(b);
+  close(c);
+  close(d);
+  close(e);
+  close(f);
+  close(g);
+  lobby_free(&l);
+}
+
+// a waiter that hangs up is dropped, not paired with the next arrival
+void test_dead_waiter() {
+  Lobby l;
+  lobby_init(&l, 0);
+  int a = join(&l);
+  send_open(a, "a");
+  step(&l);
+  int ok = got(a, "0|05|WAIT|", 0);
+  close(a);
+  int b = join(&l);
+  send_open(b, "b");
+  step(&l);
+  assert_test(ok && !matched(&l, "a", "b") && l.count == 1,
+              "dead_waiter_skipped", "a waiter gone should not be paired");
+
+  int c = join(&l);
+  send_open(c, "c");
+  step(&l);
+  assert_test(matched(&l, "b", "c"), "dead_waiter_next",
+              "the next two should be paired instead");
+
+  // gone in the same poll that brings its opponent
+  int d = join(&l);
+  send_open(d, "d");
+  step(&l);
+  int e = join(&l);
+  close(d);
+  send_open(e, "e");
+  step(&l);
+  assert_test(!matched(&l, "d", "e") && l.count == 1,
+              "dead_waiter_same_poll",
+              "a hang-up seen with the next OPEN should still win");
+  close(b);
+  close(c);
+  close(e);
+  lobby_free(&l);
+}
+
+// once opened, a player may only wait: any frame gets it dropped with a
+// FAIL, and it is not matched
+void test_after_open() {
+  Lobby l;
+  lobby_init(&l, 0);
+  int a = join(&l), b = join(&l), c = join(&l), d = join(&l);
+  send_open(a, "a");
+  send_open(b, "b");
+  send_open(c, "c");
+  step(&l);
+  got(a, "0|05|WAIT|", 0);
+  got(b, "0|05|WAIT|", 0);
+  got(c, "0|05|WAIT|", 0);
+
+  send_raw(a, "0|09|MOVE|0|1|");
+  send_open(b, "b2");
+  send_raw(c, "hello|");
+  step(&l);
+  assert_test(got(a, "0|20|FAIL|24 Not Playing|", 1), "after_open_move",
+              "a MOVE before the game should get 24 and be dropped");
+  assert_test(got(b, "0|21|FAIL|23 Already Open|", 1), "after_open_open",
+              "a second OPEN should get 23 and be dropped");
+  assert_test(got(c, "0|16|FAIL|10 Invalid|", 1), "after_open_garbage",
+              "bytes that are no frame should get 10 and be dropped");
+
+  // in the same read as OPEN
+  send_open(d, "d");
+  send_raw(d, "0|09|MOVE|0|1|");
+  step(&l);
+  assert_test(got(d, "0|05|WAIT|0|20|FAIL|24 Not Playing|", 1),
+              "after_open_same_read",
+              "a frame right behind OPEN should get the player dropped");
+  assert_test(l.count == 0 && !matched(&l, "", ""), "after_open_unmatched",
+              "none of them should be left to match");
+  close(a);
+  close(b);
+  close(c);
+  close(d);
+  lobby_free(&l);
+}
+
+// a name held in the queue is refused, and free again once its holder
+// has been matched
+void test_name_taken() {
+  Lobby l;
+  lobby_init(&l, 0);
+  int a = join(&l), b = join(&l);
+  send_open(a, "same");
+  step(&l);
+  send_open(b, "same");
+  step(&l);
+  assert_test(got(b, "0|24|FAIL|22 Already Playing|", 1) && l.count == 1,
+              "name_taken", "a name already queued should get 22");
+
+  int c = join(&l), d = join(&l);
+  send_open(c, "other");
+  step(&l);
+  int ok = matched(&l, "same", "other");
+  send_open(d, "same");
+  step(&l);
+  assert_test(ok && got(d, "0|05|WAIT|", 0), "name_taken_released",
+              "a matched player's name should be free again");
+  close(a);
+  close(b);
+  close(c);
+  close(d);
+  lobby_free(&l);
+}
+
+// polls as nimd's accept loop does, never waking on its own, until the
+// queue is down to @count or @ms have passed. Returns the time it took
+static long poll_until(Lobby *l, int count, int ms) {
+  long start = now_ms();
+  while (l->count > count && now_ms() - start < ms) {
+    if (lobby_poll(l, listener, ms) < 0) {
+      perror("lobby_poll");
+      break;
+    }
+  }
+  return now_ms() - start;
+}
+
+// with -d, a connection that has not opened in time is closed, whether
+// it sent nothing or only part of its OPEN, and the lobby wakes up for it
+// on its own. Fork and prefork both wait in this lobby
+void test_handshake_deadline() {
+  Lobby l;
+  lobby_init(&l, HANDSHAKE_MS);
+  int silent = connect_local();
+  // the listener is readable as soon as connect() returns
+  step(&l);
+  int accepted = l.count == 1;
+  int partial = join(&l);
+  send_raw(partial, "0|09|OP");
+  step(&l);
+
+  long took = poll_until(&l, 0, 5 * HANDSHAKE_MS);
+  assert_test(accepted && l.count == 0 && took >= HANDSHAKE_MS - 20 &&
+                  took < 2 * HANDSHAKE_MS,
+              "handshake_closed",
+              "connections yet to open should be closed at the deadline");
+  assert_test(got(silent, "", 1), "handshake_silent",
+              "an accepted connection that sent nothing should be closed");
+  assert_test(got(partial, "", 1), "handshake_partial",
+              "a connection with half an OPEN should be closed");
+  close(silent);
+  close(partial);
+  lobby_free(&l);
+}
+
+// a slow OPEN is fine as long as it is complete by the deadline, and an
+// opened player is never timed out
+void test_handshake_drip() {
+  Lobby l;
+  lobby_init(&l, HANDSHAKE_MS * 2);
+  int slow = join(&l);
+  const char *open = "0|10|OPEN|slow|";
+  long start = now_ms();
+  for (const char *c = open; *c != '\0'; c++) {
+    usleep(HANDSHAKE_MS / 20 * 1000);
+    char byte[2] = {*c, '\0'};
+    send_raw(slow, byte);
+    step(&l);
+  }
+  int in_time = now_ms() - start < HANDSHAKE_MS * 2;
+  assert_test(in_time && got(slow, "0|05|WAIT|", 0), "handshake_drip",
+              "an OPEN a byte at a time within the deadline should be taken");
+
+  poll_until(&l, 0, HANDSHAKE_MS * 3);
+  int fast = join(&l);
+  send_open(fast, "fast");
+  step(&l);
+  assert_test(matched(&l, "slow", "fast"), "handshake_drip_kept",
+              "an opened player should still be queued past the deadline");
+  close(slow);
+  close(fast);
+  lobby_free(&l);
+}
+
+// without -d a connection may take as long as it likes
+void test_no_handshake() {
+  Lobby l;
+  lobby_init(&l, 0);
+  int silent = join(&l);
+  poll_until(&l, 0, HANDSHAKE_MS * 2);
+  assert_test(l.count == 1 && got(silent, "", 0), "no_handshake",
+              "with no deadline a silent connection should be kept");
+  close(silent);
+  lobby_free(&l);
+}
+
+int main() {
+  printf("==============================================\n");
+  printf("   Lobby Test Suite\n");
+  printf("==============================================\n");
+
+  signal(SIGPIPE, SIG_IGN);
+  // in order with the lobby's own output when piped
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  listener = open_listener();
+
+  printf("\n--- matching ---\n");
+  test_fifo();
+  test_dead_waiter();
+  printf("\n--- after OPEN ---\n");
+  test_after_open();
+  test_name_taken();
+  printf("\n--- handshake deadline ---\n");
+  test_handshake_deadline();
+  test_handshake_drip();
+  test_no_handshake();
+
+  close(listener);
+  printf("\n==============================================\n");
+  printf("   Results: %d passed, %d failed\n", tests_passed, tests_failed);
+  printf("==============================================\n");
+
+  return (tests_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
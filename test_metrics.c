@@ -0,0 +1,408 @@
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+static int tests_passed = 0;
+static int tests_failed = 0;
+
+static void assert_test(int condition, const char *test_name,
+                        const char *message) {
+  if (condition) {
+    printf("  PASS: %s\n", test_name);
+    tests_passed++;
+  } else {
+    printf("  FAIL: %s - %s\n", test_name, message);
+    tests_failed++;
+  }
+}
+
+// shards only ever grow, so tests compare before and after
+static MetricShard before, after;
+
+static uint64_t hist_count(const MetricShard *m, int h) {
+  uint64_t n = 0;
+  for (int i = 0; i <= HIST_BUCKETS; i++) {
+    n += m->hists[h].buckets[i];
+  }
+  return n;
+}
+
+void test_histogram() {
+  printf("\n--- Histogram Bucket Tests ---\n");
+
+  {
+    int pass = 1;
+    for (unsigned long v = 0; v < 1UL << 33; v = v * 5 / 4 + 1) {
+      int b = hist_bucket(v);
+      if (b == HIST_BUCKETS) {
+        pass = pass && v >= 1UL << HIST_BITS;
+        continue;
+      }
+      // the bucket holds v, the one before ends below it, and is narrow
+      unsigned long upper = hist_upper(b);
+      unsigned long lower = b == 0 ? 0 : hist_upper(b - 1) + 1;
+      pass = pass && lower <= v && v <= upper &&
+             (upper - lower) * 4 <= lower + 3;
+    }
+    assert_test(pass, "bounds",
+                "every value should fall in a bucket a quarter wide");
+  }
+
+  {
+    int pass = hist_bucket(0) == 0 && hist_bucket(3) == 3 &&
+               hist_bucket(4) == 4 && hist_bucket(8) == 8 &&
+               hist_bucket(9) == 8 && hist_bucket(10) == 9 &&
+               hist_upper(HIST_BUCKETS - 1) == (1UL << HIST_BITS) - 1 &&
+               hist_bucket((1UL << HIST_BITS) - 1) == HIST_BUCKETS - 1 &&
+               hist_bucket(1UL << HIST_BITS) == HIST_BUCKETS;
+    assert_test(pass, "edges", "exact up to HIST_SUB, overflow past the top");
+  }
+
+  {
+    metrics_sum(&before);
+    metrics_observe(H_GAME, 1500);
+    metrics_observe(H_GAME, 1UL << 40);
+    metrics_sum(&after);
+    const Histogram *b = &before.hists[H_GAME];
+    const Histogram *a = &after.hists[H_GAME];
+    int bucket = hist_bucket(1500);
+    int pass = a->buckets[bucket] == b->buckets[bucket] + 1 &&
+               a->buckets[HIST_BUCKETS] == b->buckets[HIST_BUCKETS] + 1 &&
+               a->sum == b->sum + 1500 + (1UL << 40);
+    assert_test(pass, "observe", "samples should land in their buckets");
+  }
+}
+
+#define THREADS 4
+#define ROUNDS 100000
+
+static void *count_up(void *arg) {
+  (void)arg;
+  for (int i = 0; i < ROUNDS; i++) {
+    metrics_count(M_ACCEPTS);
+    metrics_gauge(G_SESSIONS, 1);
+    metrics_observe(H_ACCEPT_WAIT, i % 1000);
+  }
+  for (int i = 0; i < ROUNDS; i++) {
+    metrics_gauge(G_SESSIONS, -1);
+  }
+  return NULL;
+}
+
+void test_shards() {
+  printf("\n--- Per-Thread Shard Tests ---\n");
+
+  {
+    metrics_sum(&before);
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+      pthread_create(&threads[i], NULL, count_up, NULL);
+    }
+    for (int i = 0; i < THREADS; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    metrics_sum(&after);
+    int pass = after.counters[M_ACCEPTS] ==
+                   before.counters[M_ACCEPTS] + (uint64_t)THREADS * ROUNDS &&
+               after.gauges[G_SESSIONS] == before.gauges[G_SESSIONS] &&
+               hist_count(&after, H_ACCEPT_WAIT) ==
+                   hist_count(&before, H_ACCEPT_WAIT) +
+                       (uint64_t)THREADS * ROUNDS;
+    assert_test(pass, "threads", "no update should be lost across threads");
+  }
+
+  {
+    metrics_sum(&before);
+    metrics_gauge(G_SESSIONS, -3);
+    metrics_fail(31);
+    metrics_fail(31);
+    metrics_fail(100);
+    metrics_sum(&after);
+    int pass = (int64_t)(after.gauges[G_SESSIONS] -
+                         before.gauges[G_SESSIONS]) == -3 &&
+               after.fails[31] == before.fails[31] + 2;
+    metrics_gauge(G_SESSIONS, 3);
+    assert_test(pass, "gauge_and_fails",
+                "gauges should go down, FAILs count by code");
+  }
+
+  {
+    metrics_sum(&before);
+    metrics_moves_sent(metrics_now_us());
+    metrics_move();
+    metrics_move();
+    metrics_move();
+    metrics_moves_sent(metrics_now_us() - 2000);
+    metrics_moves_sent(0);
+    metrics_sum(&after);
+    int pass = hist_count(&after, H_MOVE_PLAY) ==
+                   hist_count(&before, H_MOVE_PLAY) + 3 &&
+               after.hists[H_MOVE_PLAY].sum >=
+                   before.hists[H_MOVE_PLAY].sum + 3 * 2000 &&
+               after.moves == 0;
+    assert_test(pass, "moves", "each pending move should be timed once");
+  }
+}
+
+static char stats_name[64];
+
+static void wait_byte(int fd) {
+  char c;
+  if (read(fd, &c, 1) != 1) {
+    perror("read");
+  }
+}
+
+static void send_byte(int fd) {
+  if (write(fd, "x", 1) != 1) {
+    perror("write");
+  }
+}
+
+void test_shared() {
+  printf("\n--- Shared Segment Tests ---\n");
+
+  /* a forked child's counts are seen while it runs, and kept after */
+  {
+    int to_parent[2], to_child[2];
+    if (pipe(to_parent) < 0 || pipe(to_child) < 0) {
+      perror("pipe");
+    }
+    metrics_sum(&before);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      for (int i = 0; i < 7; i++) {
+        metrics_count(M_GAMES_STARTED);
+      }
+      metrics_gauge(G_SESSIONS, 2);
+      send_byte(to_parent[1]);
+      wait_byte(to_child[0]);
+      metrics_gauge(G_SESSIONS, -2);
+      exit(EXIT_SUCCESS);
+    }
+    wait_byte(to_parent[0]);
+    metrics_sum(&after);
+    int live = after.counters[M_GAMES_STARTED] ==
+                   before.counters[M_GAMES_STARTED] + 7 &&
+               after.gauges[G_SESSIONS] == before.gauges[G_SESSIONS] + 2;
+    send_byte(to_child[1]);
+    waitpid(pid, NULL, 0);
+    metrics_sum(&after);
+    int kept = after.counters[M_GAMES_STARTED] ==
+                   before.counters[M_GAMES_STARTED] + 7 &&
+               after.gauges[G_SESSIONS] == before.gauges[G_SESSIONS];
+    assert_test(live && kept, "child_counts",
+                "a child's counts should show while it runs and outlive it");
+    close(to_parent[0]);
+    close(to_parent[1]);
+    close(to_child[0]);
+    close(to_child[1]);
+  }
+
+  /* snapshots never catch a histogram halfway through an update */
+  {
+    metrics_sum(&before);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      // long enough to be preempted in the middle of updates many times
+      for (int i = 0; i < 20 * ROUNDS; i++) {
+        metrics_observe(H_GAME, 1000);
+      }
+      exit(EXIT_SUCCESS);
+    }
+    int consistent = 1;
+    int done = 0;
+    while (!done) {
+      done = waitpid(pid, NULL, WNOHANG) == pid;
+      metrics_sum(&after);
+      uint64_t n = hist_count(&after, H_GAME) - hist_count(&before, H_GAME);
+      consistent = consistent && after.hists[H_GAME].sum -
+                                         before.hists[H_GAME].sum ==
+                                     n * 1000;
+    }
+    int pass = consistent && hist_count(&after, H_GAME) ==
+                                 hist_count(&before, H_GAME) + 20 * ROUNDS;
+    assert_test(pass, "seqlock", "every snapshot should have sum = count x 1000");
+  }
+
+  /* another process attaches by name and reads the same sums */
+  {
+    int fds[2];
+    if (pipe(fds) < 0) {
+      perror("pipe");
+    }
+    metrics_sum(&before);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      uint64_t accepts = 0;
+      if (metrics_attach(stats_name) == 0) {
+        metrics_sum(&after);
+        accepts = after.counters[M_ACCEPTS];
+      }
+      if (write(fds[1], &accepts, sizeof(accepts)) < 0) {
+        perror("write");
+      }
+      exit(EXIT_SUCCESS);
+    }
+    uint64_t accepts = 0;
+    if (read(fds[0], &accepts, sizeof(accepts)) != sizeof(accepts)) {
+      accepts = 0;
+    }
+    waitpid(pid, NULL, 0);
+    int pass = accepts == before.counters[M_ACCEPTS] && accepts != 0 &&
+               metrics_attach("/nim_test_metrics_missing") == -1;
+    assert_test(pass, "attach", "a reader should see the sums by name");
+    close(fds[0]);
+    close(fds[1]);
+  }
+}
+
+// renders into a string, the caller frees it
+static char *render(void) {
+  char *text = NULL;
+  size_t len = 0;
+  FILE *f = open_memstream(&text, &len);
+  metrics_render(f);
+  fclose(f);
+  return text;
+}
+
+void test_render() {
+  printf("\n--- Prometheus Format Tests ---\n");
+
+  {
+    metrics_sum(&before);
+    char *text = render();
+    char line[128];
+    snprintf(line, sizeof(line), "\nnim_accepts_total %llu\n",
+             (unsigned long long)before.counters[M_ACCEPTS]);
+    int pass = strstr(text, line) != NULL &&
+               strstr(text, "# TYPE nim_sessions gauge\n") != NULL &&
+               strstr(text, "nim_fails_total{code=\"31\"} ") != NULL &&
+               strstr(text, "# TYPE nim_move_to_play_seconds histogram\n") !=
+                   NULL;
+    assert_test(pass, "families", "counters, gauges and FAILs by code");
+    free(text);
+  }
+
+  {
+    char *text = render();
+    // buckets must be cumulative, with +Inf equal to _count
+    unsigned long long last = 0, inf = 0, count = 0;
+    int monotonic = 1, buckets = 0;
+    for (char *l = strstr(text, "nim_game_duration_seconds_bucket"); l != NULL;
+         l = strstr(l + 1, "nim_game_duration_seconds_bucket")) {
+      unsigned long long v = strtoull(strstr(l, "} ") + 2, NULL, 10);
+      monotonic = monotonic && v >= last;
+      last = v;
+      buckets++;
+      if (strncmp(l, "nim_game_duration_seconds_bucket{le=\"+Inf\"}", 43) == 0) {
+        inf = v;
+      }
+    }
+    char *c = strstr(text, "nim_game_duration_seconds_count ");
+    if (c != NULL) {
+      count = strtoull(c + 32, NULL, 10);
+    }
+    int pass = monotonic && buckets == HIST_BUCKETS + 1 && inf == count &&
+               count >= 2 &&
+               strstr(text, "_bucket{le=\"0.000009\"}") != NULL &&
+               strstr(text, "_bucket{le=\"4294.967295\"}") != NULL;
+    assert_test(pass, "histogram_buckets",
+                "buckets should be cumulative, in seconds, ending at +Inf");
+    free(text);
+  }
+}
+
+// sends @request to the admin port and reads the whole answer
+static int scrape(int port, const char *request, char *buf, int size) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(sock);
+    return -1;
+  }
+  if (write(sock, request, strlen(request)) < 0) {
+    close(sock);
+    return -1;
+  }
+  int len = 0;
+  int n;
+  while (len < size - 1 && (n = read(sock, buf + len, size - 1 - len)) > 0) {
+    len += n;
+  }
+  buf[len] = '\0';
+  close(sock);
+  return len;
+}
+
+void test_serve() {
+  printf("\n--- Admin Port Tests ---\n");
+
+  int port = metrics_serve("0");
+  static char buf[256 * 1024];
+
+  {
+    int n = scrape(port, "GET /metrics HTTP/1.1\r\nHost: x\r\n\r\n", buf,
+                   sizeof(buf));
+    int pass = port > 0 && n > 0 &&
+               strncmp(buf, "HTTP/1.0 200 OK\r\n", 17) == 0 &&
+               strstr(buf, "text/plain; version=0.0.4") != NULL &&
+               strstr(buf, "\r\n\r\n# HELP nim_accepts_total") != NULL &&
+               strstr(buf, "nim_game_duration_seconds_count ") != NULL;
+    assert_test(pass, "scrape", "GET /metrics should return every metric");
+  }
+
+  {
+    int n = scrape(port, "GET /other HTTP/1.0\r\n\r\n", buf, sizeof(buf));
+    int pass = n > 0 && strncmp(buf, "HTTP/1.0 404", 12) == 0;
+    assert_test(pass, "not_found", "other paths should get a 404");
+  }
+
+  {
+    int pass = metrics_serve("x") == -1 && metrics_serve("70000") == -1;
+    assert_test(pass, "bad_port", "a port that is not one should be refused");
+  }
+}
+
+int main() {
+  printf("==============================================\n");
+  printf("   Metrics Test Suite\n");
+  printf("==============================================\n");
+
+  snprintf(stats_name, sizeof(stats_name), "/nim_test_metrics_%d", getpid());
+  if (metrics_init(stats_name) < 0) {
+    return EXIT_FAILURE;
+  }
+
+  test_histogram();
+  test_shards();
+  // forks, so before the admin thread exists
+  test_shared();
+  test_render();
+  test_serve();
+  shm_unlink(stats_name);
+
+  printf("\n==============================================\n");
+  printf("   Results: %d passed, %d failed\n", tests_passed, tests_failed);
+  printf("==============================================\n");
+
+  return (tests_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
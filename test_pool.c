@@ -0,0 +1,448 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+/*
+ * test_pool - the prefork pool, played against over socketpairs
+ *
+ * Every player is one end of a socketpair: the test keeps the client end
+ * and hands the other to pool_dispatch() the way the lobby does, with
+ * whatever it had read ahead in the player's input ring. The workers run
+ * real games, so a pair that reaches one is played to OVER through the
+ * descriptors that came over SCM_RIGHTS. Workers are stopped with SIGSTOP
+ * to back their channels up, and killed to have them replaced.
+ */
+
+#define WAIT_MS 5000 // for any one reply
+#define MAX_GAMES 64
+#define MAX_WORKERS 4
+
+static int tests_passed = 0;
+static int tests_failed = 0;
+
+static void assert_test(int condition, const char *test_name,
+                        const char *message) {
+  if (condition) {
+    printf("  PASS: %s\n", test_name);
+    tests_passed++;
+  } else {
+    printf("  FAIL: %s - %s\n", test_name, message);
+    tests_failed++;
+  }
+}
+
+typedef struct {
+  int sock;
+  int len;
+  char buf[4096];
+} Client;
+
+// the two clients of a dispatched pair
+typedef struct {
+  Client p1;
+  Client p2;
+} Match;
+
+// what nimd's play_match() does on a worker, without the metrics
+static void play_and_close(Player *p1, Player *p2) {
+  playGame(p1, p2);
+  ring_free(&p1->in);
+  ring_free(&p2->in);
+  close(p1->sock);
+  close(p2->sock);
+}
+
+static void start_pool(Pool *pool, int count) {
+  if (pool_start(pool, count, play_and_close) < 0) {
+    fprintf(stderr, "pool_start failed\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// workers only exit once their games are done, and games the test left
+// hanging never will be, so every worker is killed
+static void stop_pool(Pool *pool) {
+  int count = pool->count;
+  int pids[MAX_WORKERS];
+  for (int i = 0; i < count; i++) {
+    pids[i] = pool->workers[i].pid;
+  }
+  pool_stop(pool);
+  for (int i = 0; i < count; i++) {
+    kill(pids[i], SIGCONT);
+    kill(pids[i], SIGKILL);
+  }
+  // the test's only children are workers, including replaced ones
+  while (waitpid(-1, NULL, 0) > 0) {
+  }
+}
+
+static void init_player(Player *p, int sock, int p_num, const char *name,
+                        const char *buffered) {
+  memset(p, 0, sizeof(*p));
+  p->sock = sock;
+  p->p_num = p_num;
+  p->opened = 1;
+  snprintf(p->name, sizeof(p->name), "%s", name);
+  if (ring_init(&p->in, INLEN) < 0) {
+    perror("ring_init");
+    exit(EXIT_FAILURE);
+  }
+  ring_write(&p->in, buffered, strlen(buffered));
+}
+
+// matches two fresh players and hands them to the pool with what they
+// had sent ahead, then lets go of the server ends as nimd's parent does.
+// Returns what pool_dispatch() did
+static int dispatch(Pool *pool, Match *m, const char *ahead1,
+                    const char *ahead2) {
+  static int count;
+  int sv1[2], sv2[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv1) < 0 ||
+      socketpair(AF_UNIX, SOCK_STREAM, 0, sv2) < 0) {
+    perror("socketpair");
+    exit(EXIT_FAILURE);
+  }
+  m->p1.sock = sv1[0];
+  m->p1.len = 0;
+  m->p2.sock = sv2[0];
+  m->p2.len = 0;
+
+  Player p1, p2;
+  char name[32];
+  snprintf(name, sizeof(name), "p%d", ++count);
+  init_player(&p1, sv1[1], 1, name, ahead1);
+  snprintf(name, sizeof(name), "p%d", ++count);
+  init_player(&p2, sv2[1], 2, name, ahead2);
+
+  int result = pool_dispatch(pool, &p1, &p2);
+  ring_free(&p1.in);
+  ring_free(&p2.in);
+  close(p1.sock);
+  close(p2.sock);
+  return result;
+}
+
+static void send_raw(Client *c, const char *data) {
+  int len = strlen(data);
+  if (write(c->sock, data, len) != len) {
+    perror("write");
+  }
+}
+
+static void send_move(Client *c, int pile, int count) {
+  char frame[64];
+  snprintf(frame, sizeof(frame), "0|09|MOVE|%d|%d|", pile, count);
+  send_raw(c, frame);
+}
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// reads until @until has arrived. Returns 1 and drops everything up to
+// and including it, or 0
+static int expect(Client *c, const char *until) {
+  long deadline = now_ms() + WAIT_MS;
+  for (;;) {
+    c->buf[c->len] = '\0';
+    char *at = strstr(c->buf, until);
+    if (at != NULL) {
+      int used = at + strlen(until) - c->buf;
+      memmove(c->buf, c->buf + used, c->len - used);
+      c->len -= used;
+      return 1;
+    }
+    long left = deadline - now_ms();
+    struct pollfd pfd = {c->sock, POLLIN, 0};
+    if (left <= 0 || poll(&pfd, 1, left) <= 0) {
+      return 0;
+    }
+    if (c->len == (int)sizeof(c->buf) - 1) {
+      memmove(c->buf, c->buf + c->len / 2, c->len - c->len / 2);
+      c->len -= c->len / 2;
+    }
+    int n = read(c->sock, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+    if (n <= 0) {
+      return 0;
+    }
+    c->len += n;
+  }
+}
+
+// 1 once every copy of the server end is closed
+static int closed(Client *c) {
+  long deadline = now_ms() + WAIT_MS;
+  for (;;) {
+    long left = deadline - now_ms();
+    struct pollfd pfd = {c->sock, POLLIN, 0};
+    if (left <= 0 || poll(&pfd, 1, left) <= 0) {
+      return 0;
+    }
+    char buf[512];
+    if (read(c->sock, buf, sizeof(buf)) <= 0) {
+      return 1;
+    }
+  }
+}
+
+static void close_match(Match *m) {
+  close(m->p1.sock);
+  close(m->p2.sock);
+}
+
+// each takes a whole pile in turn, player 1 the last one
+static const int moves[5][2] = {{0, 1}, {1, 3}, {2, 5}, {3, 7}, {4, 9}};
+static const char *boards[5] = {"PLAY|1|1 3 5 7 9|", "PLAY|2|0 3 5 7 9|",
+                                "PLAY|1|0 0 5 7 9|", "PLAY|2|0 0 0 7 9|",
+                                "PLAY|1|0 0 0 0 9|"};
+
+// reads up to the board before move @from and plays the rest of the
+// game. Returns 1 if it reached OVER and both were let go
+static int play_out(Match *m, int from) {
+  int ok = 1;
+  for (int i = from; i < 5 && ok; i++) {
+    ok = expect(&m->p1, boards[i]) && expect(&m->p2, boards[i]);
+    send_move(i % 2 == 0 ? &m->p1 : &m->p2, moves[i][0], moves[i][1]);
+  }
+  return ok && expect(&m->p1, "OVER|1|0 0 0 0 0||") &&
+         expect(&m->p2, "OVER|1|0 0 0 0 0||") && closed(&m->p1) &&
+         closed(&m->p2);
+}
+
+static int total_games(Pool *pool) {
+  int games = 0;
+  for (int i = 0; i < pool->count; i++) {
+    games += pool->workers[i].games;
+  }
+  return games;
+}
+
+// shrinks the parent end of every channel, so a stopped worker backs up
+// after a few pairs instead of a few hundred
+static void small_channels(Pool *pool) {
+  for (int i = 0; i < pool->count; i++) {
+    int size = 1; // raised to the kernel's minimum
+    setsockopt(pool->workers[i].channel, SOL_SOCKET, SO_SNDBUF, &size,
+               sizeof(size));
+  }
+}
+
+// the names and the sockets get across, and whatever the lobby had read
+// ahead is played as if it had arrived at the worker
+void test_handoff() {
+  Pool pool;
+  start_pool(&pool, 2);
+  Match m;
+  // player 1's first move and the start of player 2's
+  int sent = dispatch(&pool, &m, "0|09|MOVE|0|1|", "0|09|MO");
+  assert_test(sent == 0, "handoff_dispatched",
+              "an idle pool should take a pair");
+  assert_test(expect(&m.p1, "NAME|1|p2|") && expect(&m.p2, "NAME|2|p1|"),
+              "handoff_names", "both names should reach the worker");
+  assert_test(expect(&m.p1, boards[1]) && expect(&m.p2, boards[1]),
+              "handoff_buffered_move",
+              "a move read before dispatch should be played by the worker");
+  // the other half of player 2's move
+  send_raw(&m.p2, "VE|1|3|");
+  assert_test(play_out(&m, 2), "handoff_partial_frame",
+              "a frame cut at dispatch should be finished by the client");
+  close_match(&m);
+  stop_pool(&pool);
+}
+
+// pairs go to the worker with the fewest games, all of them are played at
+// once, and the workers' done reports bring the counts back down
+void test_least_loaded() {
+  Pool pool;
+  start_pool(&pool, 2);
+  Match m[6];
+  int ok = 1;
+  for (int i = 0; i < 6; i++) {
+    ok = ok && dispatch(&pool, &m[i], "", "") == 0;
+  }
+  assert_test(ok && pool.workers[0].games == 3 && pool.workers[1].games == 3,
+              "least_loaded_spread", "six pairs should be split 3 and 3");
+
+  // one move of every game before the next of any
+  for (int i = 0; i < 5 && ok; i++) {
+    for (int g = 0; g < 6 && ok; g++) {
+      ok = expect(&m[g].p1, boards[i]) && expect(&m[g].p2, boards[i]);
+      send_move(i % 2 == 0 ? &m[g].p1 : &m[g].p2, moves[i][0], moves[i][1]);
+    }
+  }
+  for (int g = 0; g < 6 && ok; g++) {
+    ok = expect(&m[g].p1, "OVER|1|") && expect(&m[g].p2, "OVER|1|") &&
+         closed(&m[g].p1) && closed(&m[g].p2);
+  }
+  assert_test(ok, "least_loaded_concurrent",
+              "games on both workers should be played side by side");
+
+  // done reports are picked up on the next dispatch
+  Match last;
+  ok = dispatch(&pool, &last, "", "") == 0 && total_games(&pool) == 1;
+  assert_test(ok, "least_loaded_reported",
+              "finished games should no longer count against a worker");
+  assert_test(play_out(&last, 0), "least_loaded_after",
+              "the pool should keep playing after its games ended");
+  for (int g = 0; g < 6; g++) {
+    close_match(&m[g]);
+  }
+  close_match(&last);
+  stop_pool(&pool);
+}
+
+static int resumed_pid;
+
+static void *resume_later(void *arg) {
+  (void)arg;
+  usleep(200 * 1000);
+  kill(resumed_pid, SIGCONT);
+  return NULL;
+}
+
+// a worker that is behind is passed over, not replaced, and with every
+// channel full the parent waits for one to take the pair
+void test_full_channel() {
+  Pool pool;
+  start_pool(&pool, 2);
+  small_channels(&pool);
+  int pids[2] = {pool.workers[0].pid, pool.workers[1].pid};
+  Match m[MAX_GAMES];
+  int games = 0;
+
+  kill(pids[0], SIGSTOP);
+  int ok = 1;
+  while (ok && !pool.workers[0].full && games < MAX_GAMES / 2) {
+    ok = dispatch(&pool, &m[games++], "", "") == 0;
+  }
+  assert_test(ok && pool.workers[0].full, "full_passed_over",
+              "pairs should go elsewhere once a stopped worker backs up");
+  assert_test(pool.workers[0].pid == pids[0], "full_not_replaced",
+              "a full channel should not be taken for a dead worker");
+
+  // both behind: refused after DISPATCH_WAIT_MS
+  kill(pids[1], SIGSTOP);
+  long start = now_ms();
+  while (games < MAX_GAMES - 1 &&
+         (ok = dispatch(&pool, &m[games++], "", "") == 0)) {
+    start = now_ms();
+  }
+  long waited = now_ms() - start;
+  assert_test(!ok && waited >= DISPATCH_WAIT_MS - 100,
+              "full_refused", "with every worker stopped a pair should be "
+                              "refused after the wait");
+
+  // and taken as soon as one catches up within it
+  resumed_pid = pids[0];
+  pthread_t thread;
+  pthread_create(&thread, NULL, resume_later, NULL);
+  start = now_ms();
+  ok = dispatch(&pool, &m[games++], "", "") == 0;
+  waited = now_ms() - start;
+  pthread_join(thread, NULL);
+  assert_test(ok && waited < DISPATCH_WAIT_MS, "full_waited",
+              "a pair should go to the first worker that has room again");
+  assert_test(pool.workers[0].pid == pids[0] &&
+                  pool.workers[1].pid == pids[1],
+              "full_same_workers", "no worker should have been replaced");
+
+  kill(pids[1], SIGCONT);
+  for (int g = 0; g < games; g++) {
+    close_match(&m[g]);
+  }
+  stop_pool(&pool);
+}
+
+// a killed worker takes its games with it, the next dispatch forks a new
+// one, and games elsewhere and after are played as usual
+void test_replace() {
+  Pool pool;
+  start_pool(&pool, 2);
+  Match lost, kept, next;
+  int ok = dispatch(&pool, &lost, "", "") == 0 &&
+           dispatch(&pool, &kept, "", "") == 0;
+  ok = ok && expect(&lost.p1, boards[0]) && expect(&kept.p1, boards[0]);
+  int dead = pool.workers[0].pid;
+  kill(dead, SIGKILL);
+  assert_test(ok && closed(&lost.p1) && closed(&lost.p2), "replace_lost",
+              "the games of a killed worker should be closed");
+
+  // the move before the next pair is sent
+  send_move(&kept.p1, moves[0][0], moves[0][1]);
+  ok = dispatch(&pool, &next, "", "") == 0;
+  assert_test(ok && pool.workers[0].pid != dead &&
+                  pool.workers[0].channel >= 0,
+              "replace_forked", "a dead worker should be replaced");
+  assert_test(play_out(&next, 0), "replace_new_game",
+              "the new worker should play the next pair, and let it go");
+  assert_test(play_out(&kept, 1), "replace_survivor",
+              "a game on another worker should go on");
+  close_match(&lost);
+  close_match(&kept);
+  close_match(&next);
+  stop_pool(&pool);
+}
+
+// the same with pairs still unread in the channel, which the parent reads
+// as ECONNRESET rather than EOF
+void test_replace_queued() {
+  Pool pool;
+  start_pool(&pool, 2);
+  int dead = pool.workers[0].pid;
+  kill(dead, SIGSTOP);
+  Match queued, next;
+  int ok = dispatch(&pool, &queued, "", "") == 0;
+  kill(dead, SIGKILL);
+  waitpid(dead, NULL, 0);
+  assert_test(ok && closed(&queued.p1) && closed(&queued.p2),
+              "replace_queued_lost",
+              "pairs a worker never read should be closed when it dies");
+  ok = dispatch(&pool, &next, "", "") == 0;
+  assert_test(ok && pool.workers[0].pid != dead, "replace_queued_forked",
+              "a worker that died with pairs queued should be replaced");
+  assert_test(play_out(&next, 0), "replace_queued_game",
+              "the replacement should play the next pair");
+  close_match(&queued);
+  close_match(&next);
+  stop_pool(&pool);
+}
+
+int main() {
+  printf("==============================================\n");
+  printf("   Prefork Pool Test Suite\n");
+  printf("==============================================\n");
+
+  signal(SIGPIPE, SIG_IGN);
+  // in order with the workers' output when piped
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  printf("\n--- handoff ---\n");
+  test_handoff();
+  printf("\n--- least loaded ---\n");
+  test_least_loaded();
+  printf("\n--- full channel ---\n");
+  test_full_channel();
+  printf("\n--- replace ---\n");
+  test_replace();
+  test_replace_queued();
+
+  printf("\n==============================================\n");
+  printf("   Results: %d passed, %d failed\n", tests_passed, tests_failed);
+  printf("==============================================\n");
+
+  return (tests_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decoder.h"
+#include "ring.h"
+
+static int tests_passed = 0;
+static int tests_failed = 0;
+
+static void assert_test(int condition, const char *test_name,
+                        const char *message) {
+  if (condition) {
+    printf("  PASS: %s\n", test_name);
+    tests_passed++;
+  } else {
+    printf("  FAIL: %s - %s\n", test_name, message);
+    tests_failed++;
+  }
+}
+
+/* moves the head of an empty ring to @offset */
+static void seek(Ring *r, unsigned offset) {
+  r->head = 0;
+  r->used = 0;
+  ring_produce(r, offset);
+  ring_consume(r, offset);
+}
+
+void test_basics() {
+  printf("\n--- Ring Basics Tests ---\n");
+
+  {
+    Ring r;
+    int err = ring_init(&r, 100);
+    assert_test(err == 0 && r.size >= 100 && r.size % 4096 == 0 &&
+                    ring_used(&r) == 0 && ring_space(&r) == r.size,
+                "init", "size should round up to whole pages, ring empty");
+    ring_free(&r);
+  }
+
+  {
+    Ring r;
+    ring_init(&r, 4096);
+    r.data[10] = 'x';
+    r.data[r.size + 20] = 'y';
+    assert_test(r.data[r.size + 10] == 'x' && r.data[20] == 'y', "mirror",
+                "both halves should be the same memory");
+    ring_free(&r);
+  }
+
+  {
+    Ring r;
+    ring_init(&r, 4096);
+    unsigned n = ring_write(&r, "hello", 5);
+    ring_consume(&r, 2);
+    assert_test(n == 5 && ring_used(&r) == 3 &&
+                    memcmp(ring_read_ptr(&r), "llo", 3) == 0,
+                "consume", "consuming should only move the head");
+    ring_free(&r);
+  }
+
+  {
+    Ring r;
+    ring_init(&r, 4096);
+    seek(&r, r.size - 3);
+    ring_write(&r, "abcdefgh", 8);
+    assert_test(ring_used(&r) == 8 &&
+                    memcmp(ring_read_ptr(&r), "abcdefgh", 8) == 0 &&
+                    memcmp(r.data, "defgh", 5) == 0,
+                "write_wrap", "a write past the end should wrap to the start");
+    ring_free(&r);
+  }
+
+  {
+    Ring r;
+    ring_init(&r, 4096);
+    seek(&r, 1000);
+    char fill[4096];
+    memset(fill, 'z', sizeof(fill));
+    unsigned n = ring_write(&r, fill, r.size - 1);
+    unsigned extra = ring_write(&r, "ab", 2);
+    assert_test(n == r.size - 1 && extra == 1 && ring_space(&r) == 0,
+                "full", "writes should stop when the ring is full");
+    ring_free(&r);
+  }
+
+  {
+    Ring r;
+    ring_init(&r, 4096);
+    seek(&r, r.size - 1);
+    ring_write(&r, "abc", 3);
+    ring_consume(&r, 3);
+    assert_test(r.head == 2 && ring_used(&r) == 0, "head_wrap",
+                "head should wrap back below size");
+    ring_free(&r);
+  }
+
+  {
+    Ring r = {0};
+    ring_free(&r);
+    ring_free(&r);
+    assert_test(r.data == NULL, "free_twice", "freeing twice should be safe");
+  }
+
+  {
+    RingSet rs;
+    int err = ringset_init(&rs, 4096, 3);
+    Ring a, b;
+    int got = ringset_get(&rs, &a) == 0 && ringset_get(&rs, &b) == 0;
+    seek(&b, b.size - 3);
+    ring_write(&b, "abcdefgh", 8);
+    ring_write(&a, "xyz", 3);
+    int pass = err == 0 && got && a.size == 4096 && ring_used(&a) == 3 &&
+               memcmp(ring_read_ptr(&b), "abcdefgh", 8) == 0 &&
+               memcmp(b.data, "defgh", 5) == 0 &&
+               memcmp(a.data, "xyz", 3) == 0;
+    ringset_free(&rs);
+    ringset_free(&rs);
+    assert_test(pass, "ringset",
+                "pooled rings should be mirrored and kept apart");
+  }
+
+  {
+    RingSet rs;
+    ringset_init(&rs, 4096, 2);
+    Ring a, b, c;
+    ringset_get(&rs, &a);
+    ringset_get(&rs, &b);
+    char *was = a.data;
+    ring_write(&a, "abc", 3);
+    ring_write(&b, "xyz", 3);
+    int pass = ringset_get(&rs, &c) < 0;
+    ringset_put(&rs, &a);
+    pass = pass && a.data == NULL;
+    ringset_get(&rs, &a);
+    pass = pass && a.data == was && a.data[0] == 0 && a.data[a.size] == 0 &&
+           ring_used(&a) == 0 && memcmp(b.data, "xyz", 3) == 0;
+    ring_write(&a, "def", 3);
+    pass = pass && memcmp(ring_read_ptr(&a), "def", 3) == 0;
+    ringset_free(&rs);
+    assert_test(pass, "ringset_put",
+                "a ring put back should read zeroes and be handed out again");
+  }
+
+  /* a set bigger than the process may have mappings, used a bit */
+  {
+    long limit = 65530;
+    FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+    if (f != NULL) {
+      if (fscanf(f, "%ld", &limit) != 1) {
+        limit = 65530;
+      }
+      fclose(f);
+    }
+    RingSet rs;
+    int err = ringset_init(&rs, 4096, limit + 1000);
+    static Ring rings[3 * RINGSET_CHUNK];
+    int pass = err == 0;
+    for (int i = 0; i < 3 * RINGSET_CHUNK && pass; i++) {
+      pass = ringset_get(&rs, &rings[i]) == 0;
+      if (pass) {
+        seek(&rings[i], rings[i].size - 2);
+        ring_write(&rings[i], (char *)&i, sizeof(i));
+      }
+    }
+    for (int i = 0; i < 3 * RINGSET_CHUNK && pass; i++) {
+      int v;
+      memcpy(&v, ring_read_ptr(&rings[i]), sizeof(v));
+      pass = v == i && memcmp(rings[i].data, ring_read_ptr(&rings[i]) + 2,
+                              sizeof(v) - 2) == 0;
+      ringset_put(&rs, &rings[i]);
+    }
+    pass = pass && rs.mapped == 3 * RINGSET_CHUNK;
+    ringset_free(&rs);
+    assert_test(pass, "ringset_past_map_count",
+                "rings should be mapped as they are wanted, not up front");
+  }
+}
+
+void test_decode() {
+  printf("\n--- Decoding From The Ring Tests ---\n");
+
+  {
+    Ring r;
+    ring_init(&r, 4096);
+    const char frame[] = "0|09|MOVE|2|3|";
+    seek(&r, r.size - 6);
+    ring_write(&r, frame, sizeof(frame) - 1);
+    Message msg;
+    int n = decode_message(ring_read_ptr(&r), ring_used(&r), &msg);
+    int pass = n == (int)sizeof(frame) - 1 &&
+               strcmp(msg.type, "MOVE") == 0 &&
+               strcmp(msg.fields[0], "2") == 0 &&
+               strcmp(msg.fields[1], "3") == 0;
+    assert_test(pass, "across_wrap",
+                "a frame split by the end of the ring should decode");
+    ring_free(&r);
+  }
+
+  {
+    Ring r;
+    ring_init(&r, 4096);
+    seek(&r, r.size - 40);
+    const char frame[] = "0|09|MOVE|1|1|";
+    int frames = 0;
+    int ok = 1;
+    // more frames than fit, consumed as they decode
+    for (int i = 0; i < 1000; i++) {
+      ring_write(&r, frame, sizeof(frame) - 1);
+      Message msg;
+      int n = decode_message(ring_read_ptr(&r), ring_used(&r), &msg);
+      if (n != (int)sizeof(frame) - 1 || strcmp(msg.fields[1], "1") != 0) {
+        ok = 0;
+        break;
+      }
+      ring_consume(&r, n);
+      frames++;
+    }
+    assert_test(ok && frames == 1000 && ring_used(&r) == 0, "stream",
+                "a long stream should keep decoding as it wraps");
+    ring_free(&r);
+  }
+
+  {
+    Ring r;
+    ring_init(&r, 4096);
+    seek(&r, r.size - 4);
+    ring_write(&r, "0|09|MO", 7);
+    Message msg;
+    int n = decode_message(ring_read_ptr(&r), ring_used(&r), &msg);
+    ring_write(&r, "VE|4|9|", 7);
+    int m = decode_message(ring_read_ptr(&r), ring_used(&r), &msg);
+    assert_test(n == 0 && m == 14 && strcmp(msg.fields[0], "4") == 0,
+                "partial_wrap",
+                "a frame completed by a later write should decode");
+    ring_free(&r);
+  }
+}
+
+int main() {
+  printf("==============================================\n");
+  printf("   Input Ring Test Suite\n");
+  printf("==============================================\n");
+
+  test_basics();
+  test_decode();
+
+  printf("\n==============================================\n");
+  printf("   Results: %d passed, %d failed\n", tests_passed, tests_failed);
+  printf("==============================================\n");
+
+  return (tests_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,597 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "names.h"
+#include "server.h"
+#include "uring.h"
+
+/*
+ * test_server - the event loop driven over loopback
+ *
+ * Serves from run_event_loop() or run_reactors() on a thread of this
+ * process and plays the protocol against it as clients would: a full
+ * game, an impatient move, a name already in use, a forfeit on hang-up,
+ * OPEN after OPEN and a player whose output queue overflows. Every setup
+ * below runs all of them. With more than one reactor, each listens on a
+ * port of its own, so a client picks its shard by the port it connects to
+ * and waiters can be made to meet across shards.
+ *
+ * Built with OUT_HIGH past OUTLEN, so a player's input is never paused and
+ * one that floods the server without reading fills its output queue
+ * instead of being throttled. name_claim() and uring_init() are wrapped
+ * (-Wl,--wrap), so the registry can be made to run out of memory and
+ * io_uring setup to fail, which has the loop fall back to epoll.
+ */
+
+#define MAX_SHARDS 4
+#define WAIT_MS 5000 // for any one reply
+#define FLOOD_MS 10000
+
+static int tests_passed = 0;
+static int tests_failed = 0;
+
+static void assert_test(int condition, const char *test_name,
+                        const char *message) {
+  if (condition) {
+    printf("  PASS: %s\n", test_name);
+    tests_passed++;
+  } else {
+    printf("  FAIL: %s - %s\n", test_name, message);
+    tests_failed++;
+  }
+}
+
+typedef struct {
+  const char *label;
+  int backend;
+  int shards; // 0 serves from run_event_loop(), else that many reactors
+  int uring_fails; // uring_init() fails as if the kernel refused it
+} Setup;
+
+static const Setup *setup;
+static ServerConfig cfg;
+static volatile int running;
+static int listeners[MAX_SHARDS];
+static int ports[MAX_SHARDS];
+static pthread_t server_thread;
+static int served;
+
+int __real_name_claim(const char *name);
+
+static volatile int claims_fail; // name_claim() reports out of memory
+
+int __wrap_name_claim(const char *name) {
+  return claims_fail ? -1 : __real_name_claim(name);
+}
+
+int __real_uring_init(Uring *r, unsigned entries);
+
+static int uring_inits;   // calls during the current setup
+static int uring_refused; // by the kernel, not by the setup
+
+int __wrap_uring_init(Uring *r, unsigned entries) {
+  uring_inits++;
+  if (setup->uring_fails) {
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    return -ENOSYS;
+  }
+  int err = __real_uring_init(r, entries);
+  if (err < 0) {
+    uring_refused = 1;
+  }
+  return err;
+}
+
+// prefixes the setup's label, so a failure says which server it was
+static void check(int condition, const char *test_name, const char *message) {
+  char name[128];
+  snprintf(name, sizeof(name), "%s: %s", setup->label, test_name);
+  assert_test(condition, name, message);
+}
+
+static void *serve(void *arg) {
+  (void)arg;
+  if (setup->shards == 0) {
+    served = run_event_loop(listeners[0], &cfg, &running);
+  } else {
+    served = run_reactors(listeners, setup->shards, &cfg, &running);
+  }
+  return NULL;
+}
+
+// run_reactors() waits for a signal to notice the flag
+static void on_term(int signum) {
+  (void)signum;
+  running = 0;
+}
+
+static int open_local(int *port) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(sock, 128) < 0 ||
+      getsockname(sock, (struct sockaddr *)&addr, &len) < 0) {
+    perror("listen");
+    exit(EXIT_FAILURE);
+  }
+  *port = ntohs(addr.sin_port);
+  return sock;
+}
+
+static void start_server(const Setup *s) {
+  setup = s;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.backend = s->backend;
+  cfg.max_sessions = 256;
+  int count = s->shards > 0 ? s->shards : 1;
+  for (int i = 0; i < count; i++) {
+    listeners[i] = open_local(&ports[i]);
+  }
+  running = 1;
+  served = 0;
+  uring_inits = 0;
+  pthread_create(&server_thread, NULL, serve, NULL);
+  printf("\n--- %s ---\n", s->label);
+}
+
+typedef struct {
+  int sock;
+  int len;
+  char buf[8192]; // what arrived and was not expected yet
+} Client;
+
+static void connect_client(Client *c, int shard) {
+  memset(c, 0, sizeof(*c));
+  c->sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(ports[shard]);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(c->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("connect");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void stop_server(void) {
+  running = 0;
+  if (setup->shards > 0) {
+    pthread_kill(server_thread, SIGTERM);
+  } else {
+    // wakes the loop up to notice
+    Client c;
+    connect_client(&c, 0);
+    close(c.sock);
+  }
+  pthread_join(server_thread, NULL);
+  int count = setup->shards > 0 ? setup->shards : 1;
+  for (int i = 0; i < count; i++) {
+    close(listeners[i]);
+  }
+  check(served == 0, "clean_shutdown", "the server should stop cleanly");
+  if (setup->backend == BACKEND_URING) {
+    int shards = setup->shards > 0 ? setup->shards : 1;
+    check(uring_inits == shards, "uring_tried",
+          "every loop should have set up its own io_uring");
+  }
+}
+
+static void send_raw(Client *c, const char *data) {
+  int len = strlen(data);
+  if (write(c->sock, data, len) != len) {
+    perror("write");
+  }
+}
+
+static void send_open(Client *c, const char *name) {
+  char frame[128];
+  snprintf(frame, sizeof(frame), "0|%02d|OPEN|%s|", (int)strlen(name) + 6,
+           name);
+  send_raw(c, frame);
+}
+
+static void send_move(Client *c, int pile, int count) {
+  char frame[64];
+  snprintf(frame, sizeof(frame), "0|09|MOVE|%d|%d|", pile, count);
+  send_raw(c, frame);
+}
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// reads until @until has arrived, within @ms. Returns 1 and drops
+// everything up to and including it, or 0
+static int expect_within(Client *c, const char *until, int ms) {
+  long deadline = now_ms() + ms;
+  for (;;) {
+    c->buf[c->len] = '\0';
+    char *at = strstr(c->buf, until);
+    if (at != NULL) {
+      int used = at + strlen(until) - c->buf;
+      memmove(c->buf, c->buf + used, c->len - used);
+      c->len -= used;
+      return 1;
+    }
+    long left = deadline - now_ms();
+    struct pollfd pfd = {c->sock, POLLIN, 0};
+    if (left <= 0 || poll(&pfd, 1, left) <= 0) {
+      return 0;
+    }
+    if (c->len == (int)sizeof(c->buf) - 1) {
+      // keeps the tail, where a frame may have been cut
+      memmove(c->buf, c->buf + c->len / 2, c->len - c->len / 2);
+      c->len -= c->len / 2;
+    }
+    int n = read(c->sock, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+    if (n <= 0) {
+      return 0;
+    }
+    c->len += n;
+  }
+}
+
+static int expect(Client *c, const char *until) {
+  return expect_within(c, until, WAIT_MS);
+}
+
+// 1 once the server has closed the connection. What came before is kept
+// in c->buf, as far as it fits
+static int closed(Client *c) {
+  long deadline = now_ms() + WAIT_MS;
+  for (;;) {
+    long left = deadline - now_ms();
+    struct pollfd pfd = {c->sock, POLLIN, 0};
+    if (left <= 0 || poll(&pfd, 1, left) <= 0) {
+      return 0;
+    }
+    char buf[512];
+    int n = read(c->sock, buf, sizeof(buf));
+    if (n <= 0) {
+      c->buf[c->len] = '\0';
+      return 1;
+    }
+    if (n > (int)sizeof(c->buf) - 1 - c->len) {
+      n = sizeof(c->buf) - 1 - c->len;
+    }
+    memcpy(c->buf + c->len, buf, n);
+    c->len += n;
+  }
+}
+
+// a fresh name for every player, so no test waits on another's leftovers
+static void next_name(char *name, int size) {
+  static int count;
+  snprintf(name, size, "%s%d", setup->shards > 0 ? "r" : "e", ++count);
+}
+
+// opens two players on @shard1 and @shard2 and reads up to their first
+// PLAY. Returns 1 if both got there
+static int start_game(Client *p1, Client *p2, int shard1, int shard2) {
+  char name[32];
+  connect_client(p1, shard1);
+  next_name(name, sizeof(name));
+  send_open(p1, name);
+  int ok = expect(p1, "WAIT|");
+  connect_client(p2, shard2);
+  next_name(name, sizeof(name));
+  send_open(p2, name);
+  ok = ok && expect(p2, "WAIT|");
+  ok = ok && expect(p1, "NAME|1|") && expect(p2, "NAME|2|");
+  ok = ok && expect(p1, "PLAY|1|1 3 5 7 9|") &&
+       expect(p2, "PLAY|1|1 3 5 7 9|");
+  return ok;
+}
+
+void test_full_game() {
+  Client a, b;
+  int ok = start_game(&a, &b, 0, 0);
+  // each takes a whole pile in turn, player 1 the last one
+  int moves[5][2] = {{0, 1}, {1, 3}, {2, 5}, {3, 7}, {4, 9}};
+  const char *boards[4] = {"PLAY|2|0 3 5 7 9|", "PLAY|1|0 0 5 7 9|",
+                           "PLAY|2|0 0 0 7 9|", "PLAY|1|0 0 0 0 9|"};
+  for (int i = 0; i < 5 && ok; i++) {
+    send_move(i % 2 == 0 ? &a : &b, moves[i][0], moves[i][1]);
+    if (i < 4) {
+      ok = expect(&a, boards[i]) && expect(&b, boards[i]);
+    }
+  }
+  ok = ok && expect(&a, "OVER|1|0 0 0 0 0||") &&
+       expect(&b, "OVER|1|0 0 0 0 0||");
+  check(ok, "full_game", "a game should be played through to OVER");
+  check(closed(&a) && closed(&b), "full_game_closed",
+        "both players should be let go after OVER");
+  close(a.sock);
+  close(b.sock);
+}
+
+void test_impatient() {
+  Client a, b;
+  int ok = start_game(&a, &b, 0, 0);
+  send_move(&b, 0, 1);
+  check(ok && expect(&b, "FAIL|31 Impatient|"), "impatient",
+        "moving out of turn should get 31 Impatient");
+
+  // the game goes on
+  send_move(&a, 0, 1);
+  check(expect(&a, "PLAY|2|0 3 5 7 9|") && expect(&b, "PLAY|2|0 3 5 7 9|"),
+        "impatient_game_goes_on", "the game should carry on after a FAIL");
+  close(a.sock);
+  check(expect(&b, "OVER|2|0 3 5 7 9|Forfeit|"), "impatient_cleanup",
+        "the opponent should win when player 1 leaves");
+  close(b.sock);
+}
+
+void test_duplicate_name() {
+  Client a, b, c;
+  char name[32];
+  next_name(name, sizeof(name));
+  connect_client(&a, 0);
+  send_open(&a, name);
+  int ok = expect(&a, "WAIT|");
+  connect_client(&b, 0);
+  send_open(&b, name);
+  check(ok && expect(&b, "FAIL|22 Already Playing|") && closed(&b),
+        "duplicate_name", "a name in use should get 22 Already Playing");
+  close(b.sock);
+
+  // the waiter is still there for someone else
+  connect_client(&c, 0);
+  next_name(name, sizeof(name));
+  send_open(&c, name);
+  check(expect(&c, "WAIT|") && expect(&a, "NAME|1|") &&
+            expect(&c, "NAME|2|"),
+        "duplicate_name_waiter_kept",
+        "the first holder of the name should still be matched");
+  close(a.sock);
+  expect(&c, "Forfeit|");
+  close(c.sock);
+}
+
+void test_forfeit() {
+  Client a, b;
+  int ok = start_game(&a, &b, 0, 0);
+  close(b.sock);
+  check(ok && expect(&a, "OVER|1|1 3 5 7 9|Forfeit|") && closed(&a),
+        "forfeit", "hanging up should forfeit to the opponent");
+  close(a.sock);
+}
+
+void test_open_twice() {
+  Client a;
+  char name[32];
+  next_name(name, sizeof(name));
+  connect_client(&a, 0);
+  send_open(&a, name);
+  int ok = expect(&a, "WAIT|");
+  send_open(&a, name);
+  check(ok && expect(&a, "FAIL|23 Already Open|") && closed(&a),
+        "open_twice", "OPEN after OPEN should get 23 Already Open");
+  close(a.sock);
+}
+
+// a registry out of memory is not a name in use
+void test_claim_oom() {
+  Client a;
+  char name[32];
+  next_name(name, sizeof(name));
+  claims_fail = 1;
+  connect_client(&a, 0);
+  send_open(&a, name);
+  int gone = closed(&a);
+  claims_fail = 0;
+  check(gone && strstr(a.buf, "FAIL") == NULL, "claim_oom",
+        "a failed claim should close the connection without a FAIL");
+  close(a.sock);
+}
+
+// player 2 sends MOVE after MOVE out of turn and never reads the FAILs
+void test_output_overflow() {
+  Client a, b;
+  char name[32];
+  connect_client(&a, 0);
+  next_name(name, sizeof(name));
+  send_open(&a, name);
+  int ok = expect(&a, "WAIT|");
+
+  memset(&b, 0, sizeof(b));
+  b.sock = socket(AF_INET, SOCK_STREAM, 0);
+  // as little as the kernel allows, so the server's queue is what fills
+  int small = 1024;
+  setsockopt(b.sock, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(ports[0]);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(b.sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("connect");
+    exit(EXIT_FAILURE);
+  }
+  next_name(name, sizeof(name));
+  send_open(&b, name);
+  ok = ok && expect(&b, "PLAY|1|") && expect(&a, "PLAY|1|");
+
+  fcntl(b.sock, F_SETFL, fcntl(b.sock, F_GETFL, 0) | O_NONBLOCK);
+  char flood[14 * 64];
+  for (int i = 0; i < 64; i++) {
+    memcpy(flood + 14 * i, "0|09|MOVE|0|1|", 14);
+  }
+  int forfeited = 0;
+  long deadline = now_ms() + FLOOD_MS;
+  while (ok && !forfeited && now_ms() < deadline) {
+    if (write(b.sock, flood, sizeof(flood)) < 0 && errno != EAGAIN) {
+      break; // the server let go of it
+    }
+    forfeited = expect_within(&a, "OVER|1|1 3 5 7 9|Forfeit|", 10);
+  }
+  forfeited = forfeited || expect(&a, "OVER|1|1 3 5 7 9|Forfeit|");
+  check(ok && forfeited, "output_overflow",
+        "a player whose output queue overflows should forfeit");
+  close(a.sock);
+  close(b.sock);
+}
+
+// a waiter on shard 0 and one on shard 1, the second travels to the first
+void test_cross_shard_match() {
+  Client a, b;
+  int ok = start_game(&a, &b, 0, 1);
+  check(ok, "cross_shard_match", "waiters on two shards should meet");
+
+  // the one that moved is served by its new shard
+  send_move(&a, 4, 9);
+  ok = expect(&a, "PLAY|2|1 3 5 7 0|") && expect(&b, "PLAY|2|1 3 5 7 0|");
+  send_move(&b, 3, 7);
+  ok = ok && expect(&a, "PLAY|1|1 3 5 0 0|") &&
+       expect(&b, "PLAY|1|1 3 5 0 0|");
+  check(ok, "cross_shard_play", "the moved player should be able to play");
+  close(b.sock);
+  check(expect(&a, "OVER|1|1 3 5 0 0|Forfeit|"), "cross_shard_forfeit",
+        "the moved player hanging up should forfeit");
+  close(a.sock);
+}
+
+// a waiter that hangs up right after OPEN is in the lone waiter's shard's
+// inbox by the time its hang-up can be read
+void test_inbox_hangup() {
+  Client a, b, c, d;
+  char name[32], gone[32];
+  connect_client(&a, 0);
+  next_name(name, sizeof(name));
+  send_open(&a, name);
+  int ok = expect(&a, "WAIT|");
+
+  // corked, so OPEN only leaves with the FIN: shard 1 hands b over on
+  // the same read that makes it hang up, before shard 0 can look at it
+  connect_client(&b, 1);
+  int on = 1;
+  setsockopt(b.sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+  next_name(gone, sizeof(gone));
+  send_open(&b, gone);
+  close(b.sock);
+  check(ok && !expect_within(&a, "NAME|", 500), "inbox_hangup_not_paired",
+        "a waiter gone on its way over should not be matched");
+
+  char frame[64];
+  connect_client(&c, 1);
+  next_name(name, sizeof(name));
+  send_open(&c, name);
+  snprintf(frame, sizeof(frame), "NAME|1|%s|", name);
+  check(expect(&c, "WAIT|") && expect(&a, frame), "inbox_hangup_next",
+        "the lone waiter should be matched with the next one instead");
+
+  // and its name was let go
+  connect_client(&d, 1);
+  send_open(&d, gone);
+  check(expect(&d, "WAIT|"), "inbox_hangup_name_released",
+        "the discarded waiter's name should be free again");
+  close(a.sock);
+  expect(&c, "Forfeit|");
+  close(c.sock);
+  close(d.sock);
+  // d went to shard 1's queue, nobody else is coming for it
+  usleep(100 * 1000);
+}
+
+// the registry is shared, a name taken on one shard is taken on all
+void test_name_across_shards() {
+  Client a, b, c;
+  char name[32];
+  next_name(name, sizeof(name));
+  connect_client(&a, 0);
+  send_open(&a, name);
+  int ok = expect(&a, "WAIT|");
+  connect_client(&b, 1);
+  send_open(&b, name);
+  check(ok && expect(&b, "FAIL|22 Already Playing|") && closed(&b),
+        "name_across_shards", "a name held on another shard should get 22");
+  close(b.sock);
+
+  connect_client(&c, 1);
+  next_name(name, sizeof(name));
+  send_open(&c, name);
+  check(expect(&c, "WAIT|") && expect(&a, "NAME|1|") &&
+            expect(&c, "NAME|2|"),
+        "name_across_shards_waiter_kept",
+        "the holder of the name should still be matched across shards");
+  close(a.sock);
+  expect(&c, "Forfeit|");
+  close(c.sock);
+}
+
+static void run_all(const Setup *s) {
+  start_server(s);
+  test_full_game();
+  test_impatient();
+  test_duplicate_name();
+  test_forfeit();
+  test_open_twice();
+  test_claim_oom();
+  test_output_overflow();
+  if (s->shards > 1) {
+    test_cross_shard_match();
+    test_inbox_hangup();
+    test_name_across_shards();
+  }
+  stop_server();
+}
+
+int main() {
+  printf("==============================================\n");
+  printf("   Event Loop Test Suite\n");
+  printf("==============================================\n");
+
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = on_term;
+  sigaction(SIGTERM, &act, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  // in order with the server's own output when piped
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  static const Setup setups[] = {
+      {"epoll", BACKEND_EPOLL, 0},
+      {"reactor", BACKEND_EPOLL, 1},
+      {"reactor -n 2", BACKEND_EPOLL, 2},
+      {"epoll -b uring", BACKEND_URING, 0},
+      {"reactor -n 2 -b uring", BACKEND_URING, 2},
+      // games are still served once io_uring is found missing
+      {"epoll -b uring, no io_uring", BACKEND_URING, 0, 1},
+      {"reactor -n 2 -b uring, no io_uring", BACKEND_URING, 2, 1},
+  };
+  for (size_t i = 0; i < sizeof(setups) / sizeof(setups[0]); i++) {
+    run_all(&setups[i]);
+  }
+
+  if (uring_refused) {
+    printf("\nio_uring is not allowed here, the uring setups ran on epoll\n");
+  }
+
+  printf("\n==============================================\n");
+  printf("   Results: %d passed, %d failed\n", tests_passed, tests_failed);
+  printf("==============================================\n");
+
+  return (tests_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,179 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+static int tests_passed = 0;
+static int tests_failed = 0;
+
+static void assert_test(int condition, const char *test_name,
+                        const char *message) {
+  if (condition) {
+    printf("  PASS: %s\n", test_name);
+    tests_passed++;
+  } else {
+    printf("  FAIL: %s - %s\n", test_name, message);
+    tests_failed++;
+  }
+}
+
+void test_basics() {
+  printf("\n--- Slab Basics Tests ---\n");
+
+  {
+    Slab s;
+    int err = slab_init(&s, 100, 10, 0);
+    SlabStats st;
+    slab_stats(&s, &st);
+    assert_test(err == 0 && st.capacity == 10 && st.object_size == 128 &&
+                    st.in_use == 0 && st.reserved >= 10 * 128,
+                "init", "objects should round up to whole cache lines");
+    slab_destroy(&s);
+  }
+
+  {
+    Slab s;
+    slab_init(&s, 40, 4, 0);
+    char *a = slab_alloc(&s);
+    char *b = slab_alloc(&s);
+    int pass = a != NULL && b != NULL && a != b &&
+               (uintptr_t)a % 64 == 0 && (uintptr_t)b % 64 == 0 &&
+               slab_index(&s, a) == 0 && slab_index(&s, b) == 1;
+    assert_test(pass, "alloc", "objects should be distinct and aligned");
+    slab_destroy(&s);
+  }
+
+  {
+    Slab s;
+    slab_init(&s, 64, 4, 0);
+    char *a = slab_alloc(&s);
+    memset(a, 0xab, 64);
+    slab_free(&s, a);
+    char *b = slab_alloc(&s);
+    int zeroed = 1;
+    for (int i = 0; i < 64; i++) {
+      if (b[i] != 0) {
+        zeroed = 0;
+      }
+    }
+    assert_test(b == a && zeroed, "reuse",
+                "a freed object should come back first, zeroed");
+    slab_destroy(&s);
+  }
+
+  {
+    Slab s;
+    slab_init(&s, 64, 3, 0);
+    void *objs[3];
+    for (int i = 0; i < 3; i++) {
+      objs[i] = slab_alloc(&s);
+    }
+    void *extra = slab_alloc(&s);
+    slab_free(&s, objs[1]);
+    void *again = slab_alloc(&s);
+    SlabStats st;
+    slab_stats(&s, &st);
+    assert_test(objs[2] != NULL && extra == NULL && again == objs[1] &&
+                    st.refused == 1 && st.allocs == 4,
+                "ceiling", "alloc should fail past capacity until a free");
+    slab_destroy(&s);
+  }
+
+  {
+    Slab s;
+    slab_init(&s, 64, 8, 0);
+    void *objs[5];
+    for (int i = 0; i < 5; i++) {
+      objs[i] = slab_alloc(&s);
+    }
+    for (int i = 0; i < 3; i++) {
+      slab_free(&s, objs[i]);
+    }
+    SlabStats st;
+    slab_stats(&s, &st);
+    assert_test(st.in_use == 2 && st.peak == 5 && st.allocs == 5,
+                "stats", "in_use and peak should follow allocs and frees");
+    slab_destroy(&s);
+  }
+
+  {
+    Slab s;
+    int err = slab_init(&s, 256, 100, SLAB_HUGE | SLAB_PREFAULT);
+    char *a = slab_alloc(&s);
+    SlabStats st;
+    slab_stats(&s, &st);
+    assert_test(err == 0 && a != NULL && st.huge >= SLAB_PAGES_SMALL &&
+                    st.huge <= SLAB_PAGES_HUGETLB,
+                "huge", "huge pages should fall back to what there is");
+    slab_destroy(&s);
+  }
+
+  {
+    Slab s;
+    int err = slab_init(&s, 64, 0, 0);
+    slab_destroy(&s);
+    slab_destroy(&s);
+    assert_test(err == -1, "bad_capacity",
+                "an empty slab should be refused, destroying it safe");
+  }
+}
+
+#define THREADS 4
+#define ROUNDS 10000
+
+static void *churn(void *arg) {
+  Slab *s = arg;
+  for (int i = 0; i < ROUNDS; i++) {
+    int *a = slab_alloc(s);
+    int *b = slab_alloc(s);
+    if (a == NULL || b == NULL || *a != 0 || *b != 0) {
+      return (void *)1;
+    }
+    *a = 1;
+    *b = 1;
+    slab_free(s, a);
+    slab_free(s, b);
+  }
+  return NULL;
+}
+
+void test_threads() {
+  printf("\n--- Slab Thread Tests ---\n");
+
+  Slab s;
+  slab_init(&s, 64, 2 * THREADS, 0);
+  pthread_t threads[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    pthread_create(&threads[i], NULL, churn, &s);
+  }
+  int ok = 1;
+  for (int i = 0; i < THREADS; i++) {
+    void *res;
+    pthread_join(threads[i], &res);
+    ok = ok && res == NULL;
+  }
+  SlabStats st;
+  slab_stats(&s, &st);
+  assert_test(ok && st.in_use == 0 && st.refused == 0 &&
+                  st.allocs == 2UL * THREADS * ROUNDS,
+              "churn", "threads sharing a slab should never collide");
+  slab_destroy(&s);
+}
+
+int main() {
+  printf("==============================================\n");
+  printf("   Slab Test Suite\n");
+  printf("==============================================\n");
+
+  test_basics();
+  test_threads();
+
+  printf("\n==============================================\n");
+  printf("   Results: %d passed, %d failed\n", tests_passed, tests_failed);
+  printf("==============================================\n");
+
+  return (tests_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
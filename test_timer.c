@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "timer.h"
+
+static int tests_passed = 0;
+static int tests_failed = 0;
+
+static void assert_test(int condition, const char *test_name,
+                        const char *message) {
+  if (condition) {
+    printf("  PASS: %s\n", test_name);
+    tests_passed++;
+  } else {
+    printf("  FAIL: %s - %s\n", test_name, message);
+    tests_failed++;
+  }
+}
+
+/* advances the wheel one tick at a time until @t pops.
+ * Returns the tick it popped at, 0 if it did not by @limit. */
+static unsigned long run_until(TimerWheel *w, Timer *t, unsigned long limit) {
+  for (unsigned long now = w->now + 1; now <= limit; now++) {
+    wheel_advance(w, now);
+    Timer *due;
+    while ((due = wheel_pop(w)) != NULL) {
+      if (due == t) {
+        return now;
+      }
+    }
+  }
+  return 0;
+}
+
+void test_expiry() {
+  printf("\n--- Expiry Tests ---\n");
+
+  {
+    TimerWheel w;
+    Timer t;
+    wheel_init(&w, 1000);
+    timer_init(&t, NULL);
+    timer_add(&w, &t, 1100);
+    assert_test(run_until(&w, &t, 2000) == 1100, "level0_exact",
+                "timer within 256 ms should fire at its tick");
+  }
+
+  {
+    TimerWheel w;
+    Timer t;
+    wheel_init(&w, 5);
+    timer_init(&t, NULL);
+    timer_add(&w, &t, 5 + 12345);
+    assert_test(run_until(&w, &t, 20000) == 5 + 12345, "level1_exact",
+                "timer in level 1 should cascade and fire on time");
+  }
+
+  {
+    TimerWheel w;
+    Timer t;
+    wheel_init(&w, 77);
+    timer_init(&t, NULL);
+    timer_add(&w, &t, 77 + 1500000);
+    assert_test(run_until(&w, &t, 2000000) == 77 + 1500000, "level3_exact",
+                "timer in the top level should cascade and fire on time");
+  }
+
+  {
+    TimerWheel w;
+    Timer t;
+    wheel_init(&w, 500);
+    timer_init(&t, NULL);
+    timer_add(&w, &t, 400);
+    assert_test(wheel_timeout(&w) == 0 && wheel_pop(&w) == &t, "past_due",
+                "timer in the past should be due right away");
+  }
+
+  {
+    TimerWheel w;
+    Timer t;
+    wheel_init(&w, 0);
+    timer_init(&t, NULL);
+    timer_add(&w, &t, 300);
+    wheel_advance(&w, 10000);
+    assert_test(wheel_pop(&w) == &t && w.count == 0, "big_jump",
+                "advancing far past expiry should still fire the timer");
+  }
+}
+
+void test_cancel() {
+  printf("\n--- Cancel Tests ---\n");
+
+  {
+    TimerWheel w;
+    Timer t;
+    wheel_init(&w, 0);
+    timer_init(&t, NULL);
+    timer_add(&w, &t, 50);
+    timer_cancel(&w, &t);
+    wheel_advance(&w, 100);
+    assert_test(wheel_pop(&w) == NULL && !timer_pending(&t), "cancel",
+                "cancelled timer should never fire");
+  }
+
+  {
+    TimerWheel w;
+    Timer a, b;
+    wheel_init(&w, 0);
+    timer_init(&a, NULL);
+    timer_init(&b, NULL);
+    timer_add(&w, &a, 10);
+    timer_add(&w, &b, 10);
+    wheel_advance(&w, 10);
+    Timer *first = wheel_pop(&w);
+    // the handler of one cancels the other, which is due as well
+    timer_cancel(&w, first == &a ? &b : &a);
+    assert_test(wheel_pop(&w) == NULL && w.count == 0, "cancel_due",
+                "cancelling a due timer should remove it from the due list");
+  }
+
+  {
+    TimerWheel w;
+    Timer t;
+    wheel_init(&w, 0);
+    timer_init(&t, NULL);
+    timer_add(&w, &t, 100);
+    timer_add(&w, &t, 30000);
+    assert_test(w.count == 1 && run_until(&w, &t, 40000) == 30000, "rearm",
+                "re-adding should move the timer, not duplicate it");
+  }
+}
+
+void test_timeout() {
+  printf("\n--- wheel_timeout() Tests ---\n");
+
+  {
+    TimerWheel w;
+    wheel_init(&w, 0);
+    assert_test(wheel_timeout(&w) == -1, "empty",
+                "empty wheel should sleep forever");
+  }
+
+  {
+    TimerWheel w;
+    Timer t;
+    wheel_init(&w, 1000);
+    timer_init(&t, NULL);
+    timer_add(&w, &t, 1040);
+    int timeout = wheel_timeout(&w);
+    assert_test(timeout > 0 && timeout <= 40, "near",
+                "timeout should never overshoot a near timer");
+  }
+
+  {
+    TimerWheel w;
+    Timer t;
+    wheel_init(&w, 1000);
+    timer_init(&t, NULL);
+    timer_add(&w, &t, 60000);
+    int timeout = wheel_timeout(&w);
+    assert_test(timeout > 0 && timeout <= 59000, "far",
+                "timeout should never overshoot a far timer");
+  }
+
+  {
+    TimerWheel w;
+    Timer t[100];
+    wheel_init(&w, 0);
+    for (int i = 0; i < 100; i++) {
+      timer_init(&t[i], NULL);
+      timer_add(&w, &t[i], (unsigned long)(i * 7919) % 50000 + 1);
+    }
+    // sleep as told each time, every timer must fire exactly on its tick
+    int late = 0;
+    int fired = 0;
+    while (w.count > 0) {
+      int timeout = wheel_timeout(&w);
+      wheel_advance(&w, w.now + timeout);
+      Timer *due;
+      while ((due = wheel_pop(&w)) != NULL) {
+        fired++;
+        if (due->expires != w.now) {
+          late++;
+        }
+      }
+    }
+    assert_test(fired == 100 && late == 0, "sleep_loop",
+                "sleeping for wheel_timeout() should hit every deadline");
+  }
+}
+
+int main() {
+  printf("==============================================\n");
+  printf("   Timer Wheel Test Suite\n");
+  printf("==============================================\n");
+
+  test_expiry();
+  test_cancel();
+  test_timeout();
+
+  printf("\n==============================================\n");
+  printf("   Results: %d passed, %d failed\n", tests_passed, tests_failed);
+  printf("==============================================\n");
+
+  return (tests_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,152 @@
+#include "timer.h"
+#include <stddef.h>
+#include <string.h>
+
+#define L0_MASK (WHEEL_L0_SIZE - 1)
+#define LN_MASK (WHEEL_LN_SIZE - 1)
+
+// ticks covered by levels 0..level
+static unsigned long span(int level) {
+  return 1UL << (WHEEL_L0_BITS + level * WHEEL_LN_BITS);
+}
+
+// first tick bit that indexes level (1-based for the upper levels)
+static int shift(int level) {
+  return WHEEL_L0_BITS + (level - 1) * WHEEL_LN_BITS;
+}
+
+static void list_push(Timer **head, Timer *t) {
+  t->next = *head;
+  if (*head != NULL) {
+    (*head)->pprev = &t->next;
+  }
+  *head = t;
+  t->pprev = head;
+}
+
+static void list_remove(Timer *t) {
+  *t->pprev = t->next;
+  if (t->next != NULL) {
+    t->next->pprev = t->pprev;
+  }
+  t->next = NULL;
+  t->pprev = NULL;
+}
+
+// the list a timer expiring at @expires belongs on right now
+static Timer **slot_for(TimerWheel *w, unsigned long expires) {
+  if (expires <= w->now) {
+    return &w->due;
+  }
+  unsigned long delta = expires - w->now;
+  if (delta < span(0)) {
+    return &w->l0[expires & L0_MASK];
+  }
+  for (int level = 1; level < WHEEL_LEVELS; level++) {
+    if (delta < span(level) || level == WHEEL_LEVELS - 1) {
+      return &w->ln[level - 1][(expires >> shift(level)) & LN_MASK];
+    }
+  }
+  return &w->due; // not reached
+}
+
+void wheel_init(TimerWheel *w, unsigned long now) {
+  memset(w, 0, sizeof(*w));
+  w->now = now;
+}
+
+void timer_init(Timer *t, void *data) {
+  t->next = NULL;
+  t->pprev = NULL;
+  t->expires = 0;
+  t->data = data;
+}
+
+int timer_pending(const Timer *t) { return t->pprev != NULL; }
+
+void timer_add(TimerWheel *w, Timer *t, unsigned long expires) {
+  timer_cancel(w, t);
+  // beyond the top level is clamped to its far end
+  unsigned long max = w->now + span(WHEEL_LEVELS - 1) - 1;
+  if (expires > max) {
+    expires = max;
+  }
+  t->expires = expires;
+  list_push(slot_for(w, expires), t);
+  w->count++;
+}
+
+void timer_cancel(TimerWheel *w, Timer *t) {
+  if (t->pprev == NULL) {
+    return;
+  }
+  list_remove(t);
+  w->count--;
+}
+
+// spreads the current slot of @level over the finer levels. Returns the
+// slot index, 0 means the level above wrapped too
+static int cascade(TimerWheel *w, int level) {
+  int idx = (w->now >> shift(level)) & LN_MASK;
+  Timer *list = w->ln[level - 1][idx];
+  w->ln[level - 1][idx] = NULL;
+  while (list != NULL) {
+    Timer *t = list;
+    list = t->next;
+    t->next = NULL;
+    t->pprev = NULL;
+    list_push(slot_for(w, t->expires), t);
+  }
+  return idx;
+}
+
+void wheel_advance(TimerWheel *w, unsigned long now) {
+  if (w->count == 0) {
+    // nothing to expire, skip straight there
+    if (now > w->now) {
+      w->now = now;
+    }
+    return;
+  }
+
+  while (w->now < now) {
+    w->now++;
+    int idx = w->now & L0_MASK;
+    if (idx == 0) {
+      for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if (cascade(w, level) != 0) {
+          break;
+        }
+      }
+    }
+    while (w->l0[idx] != NULL) {
+      Timer *t = w->l0[idx];
+      list_remove(t);
+      list_push(&w->due, t);
+    }
+  }
+}
+
+Timer *wheel_pop(TimerWheel *w) {
+  Timer *t = w->due;
+  if (t != NULL) {
+    list_remove(t);
+    w->count--;
+  }
+  return t;
+}
+
+int wheel_timeout(const TimerWheel *w) {
+  if (w->due != NULL) {
+    return 0;
+  }
+  if (w->count == 0) {
+    return -1;
+  }
+  // the next tick with something on it, or the next cascade
+  for (unsigned long tick = w->now + 1;; tick++) {
+    if (w->l0[tick & L0_MASK] != NULL || (tick & L0_MASK) == 0) {
+      return tick - w->now;
+    }
+  }
+}
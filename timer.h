@@ -0,0 +1,69 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+/*
+ * timer.h - hierarchical timer wheel
+ *
+ * Deadlines for every connection (handshake, turn, idle) live in one
+ * wheel per event loop. Adding and cancelling are O(1): a timer is put on
+ * the list of the slot its expiry falls in and unlinked from wherever it
+ * is. Time is in milliseconds, one tick per ms.
+ *
+ * The first level has a slot per tick for the next 256 ms, each further
+ * level is 64 times coarser (16 s, 17 min, 18 h). When a level wraps
+ * around, the next slot of the level above is redistributed into the
+ * finer ones. Deadlines further out than the top level are clamped.
+ *
+ * Expired timers are moved to a due list and handed out one at a time by
+ * wheel_pop(), so a handler may freely add or cancel other timers,
+ * including ones that are due as well.
+ */
+
+#define WHEEL_L0_BITS 8
+#define WHEEL_LN_BITS 6
+#define WHEEL_LEVELS 4
+#define WHEEL_L0_SIZE (1 << WHEEL_L0_BITS)
+#define WHEEL_LN_SIZE (1 << WHEEL_LN_BITS)
+
+typedef struct Timer {
+  struct Timer *next;
+  struct Timer **pprev; // NULL unless pending
+  unsigned long expires;
+  void *data; // for the owner, untouched by the wheel
+} Timer;
+
+typedef struct {
+  unsigned long now; // last tick processed
+  int count;         // pending timers, due ones included
+  Timer *due;
+  Timer *l0[WHEEL_L0_SIZE];
+  Timer *ln[WHEEL_LEVELS - 1][WHEEL_LN_SIZE];
+} TimerWheel;
+
+void wheel_init(TimerWheel *w, unsigned long now);
+
+void timer_init(Timer *t, void *data);
+
+int timer_pending(const Timer *t);
+
+// (re)arms @t to fire at @expires, cancelling it first if pending
+void timer_add(TimerWheel *w, Timer *t, unsigned long expires);
+
+// no-op if @t is not pending
+void timer_cancel(TimerWheel *w, Timer *t);
+
+// moves every timer that expired by @now to the due list
+void wheel_advance(TimerWheel *w, unsigned long now);
+
+// next due timer, no longer pending, or NULL
+Timer *wheel_pop(TimerWheel *w);
+
+/*
+ * wheel_timeout - how long the loop may sleep, in ms
+ *
+ * Returns -1 if nothing is pending. May be shorter than the next expiry
+ * (never longer), the loop then just wakes up once for nothing.
+ */
+int wheel_timeout(const TimerWheel *w);
+
+#endif
@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags, void *arg, size_t argsz) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 arg, argsz);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+int uring_init(Uring *r, unsigned entries) {
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = sys_setup(entries, &p);
+  if (fd < 0) {
+    return -errno;
+  }
+  r->fd = fd;
+  if (!(p.features & IORING_FEAT_EXT_ARG)) {
+    // no way to wait with a timeout, which the timers need
+    errno = ENOSYS;
+    goto fail;
+  }
+
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_len > r->sq_len) {
+      r->sq_len = r->cq_len;
+    }
+    r->cq_len = r->sq_len;
+  }
+
+  r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED) {
+    r->sq_ptr = NULL;
+    goto fail;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cq_ptr = r->sq_ptr;
+  } else {
+    r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED) {
+      r->cq_ptr = NULL;
+      goto fail;
+    }
+  }
+
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = NULL;
+    goto fail;
+  }
+
+  char *sq = r->sq_ptr;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_entries = *(unsigned *)(sq + p.sq_off.ring_entries);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->sqe_tail = *r->sq_tail;
+
+  char *cq = r->cq_ptr;
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+
+fail:;
+  int err = -errno;
+  uring_free(r);
+  return err;
+}
+
+int uring_setup_buffers(Uring *r, unsigned count, int size) {
+  r->br_len = count * sizeof(struct io_uring_buf);
+  r->br = mmap(NULL, r->br_len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r->br == MAP_FAILED) {
+    r->br = NULL;
+    return -errno;
+  }
+  r->bufs = malloc((size_t)count * size);
+  if (r->bufs == NULL) {
+    return -ENOMEM;
+  }
+  r->br_entries = count;
+  r->buf_size = size;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)r->br;
+  reg.ring_entries = count;
+  reg.bgid = 0;
+  if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    return -errno;
+  }
+
+  r->br_tail = 0;
+  for (unsigned i = 0; i < count; i++) {
+    uring_recycle(r, i);
+  }
+  return 0;
+}
+
+void uring_free(Uring *r) {
+  if (r->sqes != NULL) {
+    munmap(r->sqes, r->sqes_len);
+  }
+  if (r->cq_ptr != NULL && r->cq_ptr != r->sq_ptr) {
+    munmap(r->cq_ptr, r->cq_len);
+  }
+  if (r->sq_ptr != NULL) {
+    munmap(r->sq_ptr, r->sq_len);
+  }
+  if (r->fd >= 0) {
+    close(r->fd);
+  }
+  if (r->br != NULL) {
+    munmap(r->br, r->br_len);
+  }
+  free(r->bufs);
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+}
+
+static unsigned queued(Uring *r) {
+  return r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe *uring_get_sqe(Uring *r) {
+  if (queued(r) >= r->sq_entries) {
+    uring_submit_and_wait(r, 0, -1);
+    if (queued(r) >= r->sq_entries) {
+      return NULL;
+    }
+  }
+  unsigned idx = r->sqe_tail & r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[idx] = idx;
+  r->sqe_tail++;
+  return sqe;
+}
+
+int uring_submit_and_wait(Uring *r, unsigned wait_nr, int timeout_ms) {
+  // anything the kernel has not consumed yet, including leftovers from an
+  // interrupted enter
+  unsigned to_submit = queued(r);
+  __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+  unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+  if (to_submit == 0 && wait_nr == 0) {
+    return 0;
+  }
+
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  void *argp = NULL;
+  size_t argsz = 0;
+  if (wait_nr > 0 && timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (unsigned long)&ts;
+    argp = &arg;
+    argsz = sizeof(arg);
+    flags |= IORING_ENTER_EXT_ARG;
+  }
+
+  int n = sys_enter(r->fd, to_submit, wait_nr, flags, argp, argsz);
+  return n < 0 ? -errno : n;
+}
+
+struct io_uring_cqe *uring_peek_cqe(Uring *r) {
+  unsigned head = *r->cq_head;
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen(Uring *r) {
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+char *uring_buffer(Uring *r, int bid) {
+  return r->bufs + (size_t)bid * r->buf_size;
+}
+
+void uring_recycle(Uring *r, int bid) {
+  struct io_uring_buf *buf = &r->br->bufs[r->br_tail & (r->br_entries - 1)];
+  buf->addr = (unsigned long)uring_buffer(r, bid);
+  buf->len = r->buf_size;
+  buf->bid = bid;
+  r->br_tail++;
+  __atomic_store_n(&r->br->tail, (unsigned short)r->br_tail,
+                   __ATOMIC_RELEASE);
+}
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd,
+                                 uint64_t user_data) {
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = user_data;
+}
+
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd,
+                               uint64_t user_data) {
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = user_data;
+}
+
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                        const struct msghdr *msg, uint64_t user_data) {
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = user_data;
+}
+
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd,
+                               uint64_t user_data) {
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = user_data;
+}
+
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target,
+                       uint64_t user_data) {
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = user_data;
+}
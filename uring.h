@@ -0,0 +1,109 @@
+#ifndef URING_H
+#define URING_H
+
+/*
+ * uring.h - minimal io_uring wrapper for the server loop
+ *
+ * Just enough of the ring to drive nimd without liburing: set up the
+ * submission and completion rings with raw syscalls, hand out SQEs, submit
+ * everything queued in one io_uring_enter() per loop iteration, and walk the
+ * completions. Reads use one provided buffer ring (group 0) so the kernel
+ * picks a buffer only once data has arrived, instead of every idle
+ * connection pinning a read buffer.
+ *
+ * uring_init() fails cleanly on kernels without io_uring (or where it is
+ * disabled, or too old to wait with a timeout), callers fall back to epoll.
+ */
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+typedef struct {
+  int fd;
+
+  // submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sqe_tail; // local tail, published by uring_submit
+  struct io_uring_sqe *sqes;
+
+  // completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  // provided buffers
+  struct io_uring_buf_ring *br;
+  char *bufs;
+  unsigned br_entries;
+  unsigned br_tail;
+  int buf_size;
+
+  void *sq_ptr;
+  size_t sq_len;
+  void *cq_ptr;
+  size_t cq_len;
+  size_t sqes_len;
+  size_t br_len;
+} Uring;
+
+/*
+ * uring_init - set up a ring with at least @entries submission slots
+ *
+ * Returns 0 on success, -errno on failure (e.g. -ENOSYS, -EPERM).
+ */
+int uring_init(Uring *r, unsigned entries);
+
+/*
+ * uring_setup_buffers - register @count buffers of @size bytes as group 0
+ *
+ * @count must be a power of two. Returns 0 or -errno.
+ */
+int uring_setup_buffers(Uring *r, unsigned count, int size);
+
+void uring_free(Uring *r);
+
+/*
+ * uring_get_sqe - next free submission slot, zeroed
+ *
+ * Submits what is queued if the ring is full. Returns NULL only if that
+ * did not free a slot either.
+ */
+struct io_uring_sqe *uring_get_sqe(Uring *r);
+
+/*
+ * uring_submit_and_wait - publish queued SQEs and wait for @wait_nr
+ * completions in a single io_uring_enter()
+ *
+ * Gives up waiting after @timeout_ms (-1 waits as long as it takes).
+ * Returns the number submitted or -errno, -ETIME if the wait timed out.
+ */
+int uring_submit_and_wait(Uring *r, unsigned wait_nr, int timeout_ms);
+
+// next unread completion or NULL, then uring_cqe_seen() to release it
+struct io_uring_cqe *uring_peek_cqe(Uring *r);
+void uring_cqe_seen(Uring *r);
+
+// data of provided buffer @bid, and handing it back to the kernel
+char *uring_buffer(Uring *r, int bid);
+void uring_recycle(Uring *r, int bid);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd,
+                                 uint64_t user_data);
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd,
+                               uint64_t user_data);
+// @msg has to stay valid until the completion
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                        const struct msghdr *msg, uint64_t user_data);
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd,
+                               uint64_t user_data);
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target,
+                       uint64_t user_data);
+
+#endif